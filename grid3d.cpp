@@ -3,23 +3,36 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
-#include <vector>
-#include <iostream>
-#define M_PI 3.14159265358979323846
-
-// Grid parameters
-const int GRID_SIZE = 5;  // Number of cells in each dimension
-const float CELL_SIZE = 0.2f;  // Size of each cell
+#include "photon_engine.h"
+#include "photon_gpu.h"
+#include <csignal>
+#include <cctype>
+#ifdef PHOTON_ENABLE_MPI
+#include "photon_mpi.h"
+#endif
+#ifdef PHOTON_ENABLE_HDF5
+#include "photon_hdf5.h"
+#endif
+
+const size_t MAX_TRAIL_PHOTONS = 4096;  // Photons whose trails are drawn each frame
 
 // Shader sources
 const char* vertexShaderSource = R"(
     #version 330 core
     layout (location = 0) in vec3 aPos;
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
+    layout (location = 1) in vec4 aInstance;  // Sphere center (xyz) and radius (w)
+    layout (location = 2) in float aIndex;    // Sphere or face cell looked up by the heatmap
+    layout (std140) uniform Camera {
+        mat4 view;
+        mat4 projection;
+    };
+    uniform bool isInstanced;  // aPos is a unit-sphere vertex placed by aInstance
+    uniform bool isOverlay;  // aPos is already in normalized device coordinates
+    flat out int vIndex;
     void main() {
-        gl_Position = projection * view * model * vec4(aPos, 1.0);
+        vec3 position = isInstanced ? aInstance.xyz + aPos * aInstance.w : aPos;
+        gl_Position = isOverlay ? vec4(aPos, 1.0) : projection * view * vec4(position, 1.0);
+        vIndex = int(aIndex);
     }
 )";
 
@@ -27,9 +40,24 @@ const char* fragmentShaderSource = R"(
     #version 330 core
     uniform bool isRay;  // Used to distinguish between grid and ray
     uniform bool isSphere;  // Used to identify sphere
+    uniform bool isHeatmap;  // Color by heatCounts[vIndex] instead
+    uniform samplerBuffer heatCounts;  // Hits per sphere or exits per face cell
+    uniform float heatScale;  // 1 / log(1 + largest count)
+    uniform float heatAlpha;
+    uniform bool isOverlay;  // Timing HUD bar
+    uniform vec3 overlayColor;
+    flat in int vIndex;
     out vec4 FragColor;
     void main() {
-        if (isRay) {
+        if (isOverlay) {
+            FragColor = vec4(overlayColor, 1.0);
+        } else if (isHeatmap) {
+            // Log scale from dark blue through red to yellow
+            float t = clamp(log(1.0 + texelFetch(heatCounts, vIndex).r) * heatScale, 0.0, 1.0);
+            vec3 color = mix(vec3(0.05, 0.05, 0.3), vec3(0.9, 0.1, 0.1), clamp(2.0 * t, 0.0, 1.0));
+            color = mix(color, vec3(1.0, 1.0, 0.2), clamp(2.0 * t - 1.0, 0.0, 1.0));
+            FragColor = vec4(color, heatAlpha);
+        } else if (isRay) {
             FragColor = vec4(1.0, 1.0, 0.0, 1.0); // Yellow for ray
         } else if (isSphere) {
             FragColor = vec4(0.0, 0.0, 1.0, 1.0); // Blue for sphere
@@ -39,117 +67,531 @@ const char* fragmentShaderSource = R"(
     }
 )";
 
-// Add this new class after the Ray class
-class Sphere {
+// The scene shader program and its uniform state. Uniform locations are
+// looked up once after linking. View and projection sit in a uniform buffer
+// that is rewritten only when one of them changes, so frames with the camera
+// at rest make no matrix uploads.
+class Renderer {
+public:
+    static const GLuint CAMERA_BINDING = 0;  // Uniform buffer binding of the Camera block
+
+    GLuint program;
+    GLuint cameraBuffer;
+    GLint isInstancedLocation, isOverlayLocation, overlayColorLocation, isRayLocation, isSphereLocation;
+    GLint isHeatmapLocation, heatScaleLocation, heatAlphaLocation;
+    glm::mat4 view, projection;  // As last uploaded
+    bool viewUploaded, projectionUploaded;
+
+    Renderer() :
+        program(0), cameraBuffer(0), isInstancedLocation(-1), isOverlayLocation(-1), overlayColorLocation(-1),
+        isRayLocation(-1), isSphereLocation(-1), isHeatmapLocation(-1), heatScaleLocation(-1), heatAlphaLocation(-1),
+        view(1.0f), projection(1.0f), viewUploaded(false), projectionUploaded(false) {}
+
+    // Returns false (after printing why) if the shaders do not build
+    bool init() {
+        GLuint vertexShader = compile(GL_VERTEX_SHADER, vertexShaderSource, "vertex");
+        GLuint fragmentShader = compile(GL_FRAGMENT_SHADER, fragmentShaderSource, "fragment");
+        if (!vertexShader || !fragmentShader) {
+            glDeleteShader(vertexShader);
+            glDeleteShader(fragmentShader);
+            return false;
+        }
+        program = glCreateProgram();
+        glAttachShader(program, vertexShader);
+        glAttachShader(program, fragmentShader);
+        glLinkProgram(program);
+        glDeleteShader(vertexShader);
+        glDeleteShader(fragmentShader);
+        GLint ok = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &ok);
+        if (!ok) {
+            std::cerr << "Scene shader failed to link" << std::endl;
+            return false;
+        }
+
+        isInstancedLocation = glGetUniformLocation(program, "isInstanced");
+        isOverlayLocation = glGetUniformLocation(program, "isOverlay");
+        overlayColorLocation = glGetUniformLocation(program, "overlayColor");
+        isRayLocation = glGetUniformLocation(program, "isRay");
+        isSphereLocation = glGetUniformLocation(program, "isSphere");
+        isHeatmapLocation = glGetUniformLocation(program, "isHeatmap");
+        heatScaleLocation = glGetUniformLocation(program, "heatScale");
+        heatAlphaLocation = glGetUniformLocation(program, "heatAlpha");
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "heatCounts"), 0);  // Texture unit 0
+
+        glUniformBlockBinding(program, glGetUniformBlockIndex(program, "Camera"), CAMERA_BINDING);
+        glGenBuffers(1, &cameraBuffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, cameraBuffer);
+        glBufferData(GL_UNIFORM_BUFFER, 2 * sizeof(glm::mat4), nullptr, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_BINDING, cameraBuffer);
+        return true;
+    }
+
+    void release() {
+        if (cameraBuffer)
+            glDeleteBuffers(1, &cameraBuffer);
+        if (program)
+            glDeleteProgram(program);
+        cameraBuffer = program = 0;
+    }
+
+    void use() const {
+        glUseProgram(program);
+    }
+
+    void setView(const glm::mat4& newView) {
+        if (viewUploaded && newView == view)
+            return;
+        view = newView;
+        viewUploaded = true;
+        glBindBuffer(GL_UNIFORM_BUFFER, cameraBuffer);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(glm::mat4), glm::value_ptr(view));
+    }
+
+    void setProjection(const glm::mat4& newProjection) {
+        if (projectionUploaded && newProjection == projection)
+            return;
+        projection = newProjection;
+        projectionUploaded = true;
+        glBindBuffer(GL_UNIFORM_BUFFER, cameraBuffer);
+        glBufferSubData(GL_UNIFORM_BUFFER, sizeof(glm::mat4), sizeof(glm::mat4), glm::value_ptr(projection));
+    }
+
+private:
+    static GLuint compile(GLenum type, const char* source, const char* stage) {
+        GLuint shader = glCreateShader(type);
+        glShaderSource(shader, 1, &source, nullptr);
+        glCompileShader(shader);
+        GLint ok = 0;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+        if (!ok) {
+            char log[2048];
+            glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+            std::cerr << "Scene " << stage << " shader failed to compile:\n" << log << std::endl;
+            glDeleteShader(shader);
+            return 0;
+        }
+        return shader;
+    }
+};
+
+// Unit-sphere triangle strips at a few levels of detail, generated once and
+// shared by every sphere (placed per instance by the vertex shader). All
+// levels live in one vertex array; level i occupies [first[i], first[i] + count[i]).
+class SphereMesh {
 public:
-    float x, y, z;  // Position
-    float radius;
+    static const int LEVELS = 3;
     std::vector<float> vertices;
-    
-    Sphere(float xPos, float yPos, float zPos, float r) 
-        : x(xPos), y(yPos), z(zPos), radius(r) {
-        generateVertices();
+    GLint first[LEVELS];
+    GLsizei count[LEVELS];
+
+    // Segments around the equator per level, coarsest first
+    static int segments(int level) {
+        return 8 << level;
     }
-    
-    void generateVertices() {
-        const int segments = 16;
-        const int rings = 16;
-        
-        for(int i = 0; i <= rings; i++) {
-            float phi = M_PI * (float)i / (float)rings;
-            for(int j = 0; j <= segments; j++) {
-                float theta = 2.0f * M_PI * (float)j / (float)segments;
-                
-                float xPos = x + radius * sin(phi) * cos(theta);
-                float yPos = y + radius * sin(phi) * sin(theta);
-                float zPos = z + radius * cos(phi);
-                
-                vertices.push_back(xPos);
-                vertices.push_back(yPos);
-                vertices.push_back(zPos);
+
+    // The cached mesh, tessellated on first use
+    static const SphereMesh& shared() {
+        static const SphereMesh mesh;
+        return mesh;
+    }
+
+    // Level for a sphere covering `pixels` pixels of radius on screen
+    static int levelFor(float pixels) {
+        if (pixels < 4.0f)
+            return 0;
+        if (pixels < 32.0f)
+            return 1;
+        return 2;
+    }
+
+private:
+    SphereMesh() {
+        size_t total = 0;
+        for (int level = 0; level < LEVELS; level++)
+            total += (size_t)(segments(level) / 2) * (segments(level) + 1) * 2 * 3;
+        vertices.reserve(total);
+        for (int level = 0; level < LEVELS; level++) {
+            first[level] = (GLint)(vertices.size() / 3);
+            tessellate(segments(level) / 2, segments(level));
+            count[level] = (GLsizei)(vertices.size() / 3) - first[level];
+        }
+    }
+
+    // One strip zig-zagging between neighbouring rings, band after band
+    void tessellate(int rings, int segmentCount) {
+        for (int i = 0; i < rings; i++) {
+            for (int j = 0; j <= segmentCount; j++) {
+                float theta = 2.0f * M_PI * (float)j / (float)segmentCount;
+                for (int k = 0; k < 2; k++) {
+                    float phi = M_PI * (float)(i + k) / (float)rings;
+                    vertices.push_back(sin(phi) * cos(theta));
+                    vertices.push_back(sin(phi) * sin(theta));
+                    vertices.push_back(cos(phi));
+                }
             }
         }
     }
 };
 
-class Ray {
+// Layout GL reads from GL_DRAW_INDIRECT_BUFFER for glMultiDrawArraysIndirect
+struct DrawArraysIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint first;
+    GLuint baseInstance;
+};
+
+// Picks the spheres to draw whenever the camera moves: spheres entirely
+// outside the view frustum are dropped and the rest are grouped by level of
+// detail into one run of instances per level. commands[level] describes that
+// run as an indirect draw of the level's strip, so the draw needs no further
+// per-level CPU work; without base instances (GL < 4.2) the caller points the
+// instance attributes at each run instead.
+class SphereCuller {
 public:
-    // Spherical coordinates
-    float zenith;    // angle from vertical (0 = up, 180 = down)
-    float azimuth;   // angle in horizontal plane (0 = +x axis)
-    float currentLength;
-    float speed;
-    float gridHalfSize;  // Half size of the grid for boundary checking
-    
-    // Current position
-    float x, y, z;
-    
-    Ray() : 
-        zenith(45.0f),
-        azimuth(45.0f),
-        currentLength(0.0f),
-        speed(0.005f),
-        gridHalfSize((GRID_SIZE * CELL_SIZE) / 2.0f),
-        x(0.0f), y(0.0f), z(0.0f) {}
-    
-    bool isOutsideCube() {
-        return (std::fabs(x) > gridHalfSize || 
-                std::fabs(y) > gridHalfSize || 
-                std::fabs(z) > gridHalfSize);
+    std::vector<Sphere> instances;  // Visible spheres, grouped by level
+    std::vector<float> indices;     // Scene index of each instance, for the heatmap
+    std::vector<unsigned char> levels;
+    DrawArraysIndirectCommand commands[SphereMesh::LEVELS];
+    size_t visible;
+
+    explicit SphereCuller(size_t sphereCount) :
+        instances(sphereCount), indices(sphereCount), levels(sphereCount), visible(0) {
+        const SphereMesh& mesh = SphereMesh::shared();
+        for (int level = 0; level < SphereMesh::LEVELS; level++)
+            commands[level] = DrawArraysIndirectCommand{ (GLuint)mesh.count[level], 0, (GLuint)mesh.first[level], 0 };
     }
-    
-    bool intersectsSphere(float sphereX, float sphereY, float sphereZ, float sphereRadius) {
-        // Calculate distance from current ray point to sphere center
-        float dx = x - sphereX;
-        float dy = y - sphereY;
-        float dz = z - sphereZ;
-        float distanceSquared = dx*dx + dy*dy + dz*dz;
-        
-        // If distance is less than sphere radius, we've hit it
-        return distanceSquared <= (sphereRadius * sphereRadius);
-    }
-
-
-    void update(const std::vector<Sphere>& spheres) {  // Modified to take spheres as parameter
-        currentLength += speed;
-        updatePosition();
-        
-        // Check for sphere collisions
-        for(const Sphere& sphere : spheres) {
-            if(intersectsSphere(sphere.x, sphere.y, sphere.z, sphere.radius)) {
-                std::cout << "Hit sphere at (" << sphere.x << ", " << sphere.y << ", " << sphere.z << ")" << std::endl;
-                currentLength = 0.0f;
-                x = y = z = 0.0f;  // Reset position to center
-                zenith = rand() % 180;  // Random angle 0-180
-                azimuth = rand() % 360; // Random angle 0-360
-                return;  // Exit early since we hit a sphere
+
+    // pixelsPerUnit: screen pixels covered by one unit of length at distance 1
+    void cull(const Scene& scene, const glm::mat4& viewProjection, const glm::vec3& camera, float pixelsPerUnit) {
+        // Frustum planes (a, b, c, d) from the rows of the clip transform,
+        // normalized so a plane test gives a signed distance
+        float planes[6][4];
+        for (int k = 0; k < 6; k++) {
+            int row = k / 2;
+            float sign = (k % 2) ? -1.0f : 1.0f;
+            float length = 0.0f;
+            for (int column = 0; column < 4; column++) {
+                planes[k][column] = viewProjection[column][3] + sign * viewProjection[column][row];
+                if (column < 3)
+                    length += planes[k][column] * planes[k][column];
             }
+            length = std::sqrt(length);
+            for (int column = 0; column < 4; column++)
+                planes[k][column] /= length;
         }
-        
-        // Reset if ray hits cube boundary
-        if (isOutsideCube()) {
-            std::cout << "Position at boundary: (" << x << ", " << y << ", " << z << "), halfsize: " << gridHalfSize << std::endl;
-            currentLength = 0.0f;
-            x = y = z = 0.0f;  // Reset position to center
-            zenith = rand() % 180;  // Random angle 0-180
-            azimuth = rand() % 360; // Random angle 0-360
+
+        GLuint levelCount[SphereMesh::LEVELS] = {};
+        for (size_t i = 0; i < scene.count; i++) {
+            const Sphere& sphere = scene.records[i];
+            bool inside = true;
+            for (int k = 0; k < 6 && inside; k++) {
+                float distance = planes[k][0] * sphere.x + planes[k][1] * sphere.y + planes[k][2] * sphere.z + planes[k][3];
+                inside = distance >= -sphere.radius;
+            }
+            if (!inside) {
+                levels[i] = SphereMesh::LEVELS;  // Culled
+                continue;
+            }
+            float distance = std::max(glm::length(camera - glm::vec3(sphere.x, sphere.y, sphere.z)), 1e-3f);
+            levels[i] = (unsigned char)SphereMesh::levelFor(sphere.radius * pixelsPerUnit / distance);
+            levelCount[levels[i]]++;
+        }
+
+        GLuint fill[SphereMesh::LEVELS];
+        GLuint start = 0;
+        for (int level = 0; level < SphereMesh::LEVELS; level++) {
+            commands[level].instanceCount = levelCount[level];
+            commands[level].baseInstance = start;
+            fill[level] = start;
+            start += levelCount[level];
+        }
+        visible = start;
+        for (size_t i = 0; i < scene.count; i++) {
+            if (levels[i] == SphereMesh::LEVELS)
+                continue;
+            GLuint slot = fill[levels[i]]++;
+            instances[slot] = scene.records[i];
+            indices[slot] = (float)i;
         }
     }
-    
-    void updatePosition() {
-        float phi = glm::radians(zenith);
-        float theta = glm::radians(azimuth);
-        
-        x = currentLength * sin(phi) * cos(theta);
-        y = currentLength * cos(phi);
-        z = currentLength * sin(phi) * sin(theta);
+};
+
+// Streaming vertex buffer for photon trails. Three regions rotate between
+// the simulation thread (writing), a hand-off slot (ready) and the renderer
+// (drawing), so neither side ever waits for the other. With GL 4.4 /
+// ARB_buffer_storage the buffer is persistently and coherently mapped and the
+// simulation writes vertices straight into it; the renderer fences each
+// region it draws and waits on that fence before handing the region back.
+// Without buffer storage the regions live in client memory and the drawn
+// region is uploaded with glBufferSubData.
+class TrailRing {
+public:
+    static const int REGIONS = 3;
+    size_t regionVertices;   // Capacity of one region
+    GLuint vao, vbo;
+    float* mapped;           // Persistent mapping, nullptr on the fallback path
+    std::vector<float> fallback;
+    GLsync fences[REGIONS];
+    size_t vertexCount[REGIONS];
+    std::mutex mutex;        // Guards ready, fresh and vertexCount
+    int writing, ready, drawing;
+    bool fresh;              // ready holds a frame the renderer has not taken
+
+    TrailRing() : regionVertices(0), vao(0), vbo(0), mapped(nullptr), writing(0), ready(1), drawing(2), fresh(false) {
+        for (int r = 0; r < REGIONS; r++) {
+            fences[r] = nullptr;
+            vertexCount[r] = 0;
+        }
     }
-    
-    // For rendering
-    void getEndPoint(float& outX, float& outY, float& outZ) {
-        outX = x;
-        outY = y;
-        outZ = z;
+
+    // Needs the GL context; maxVertices is the capacity of each region
+    void init(size_t maxVertices) {
+        regionVertices = maxVertices;
+        size_t bytes = REGIONS * regionVertices * 3 * sizeof(float);
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &vbo);
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) {
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_ARRAY_BUFFER, bytes, nullptr, flags);
+            mapped = (float*)glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, flags);
+        }
+        if (!mapped) {
+            glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+            fallback.assign(REGIONS * regionVertices * 3, 0.0f);
+        }
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(0);
+    }
+
+    // Needs the GL context
+    void release() {
+        if (!vbo)
+            return;
+        for (GLsync& fence : fences) {
+            if (fence)
+                glDeleteSync(fence);
+            fence = nullptr;
+        }
+        if (mapped) {
+            glBindBuffer(GL_ARRAY_BUFFER, vbo);
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+            mapped = nullptr;
+        }
+        glDeleteBuffers(1, &vbo);
+        glDeleteVertexArrays(1, &vao);
+        vbo = vao = 0;
+    }
+
+    float* region(int r) {
+        return (mapped ? mapped : fallback.data()) + (size_t)r * regionVertices * 3;
+    }
+
+    // Simulation side: the region to fill. Owned by the caller until publish().
+    float* writeRegion() {
+        return region(writing);
+    }
+
+    void publish(size_t vertices) {
+        std::lock_guard<std::mutex> lock(mutex);
+        vertexCount[writing] = vertices;
+        std::swap(writing, ready);
+        fresh = true;
+    }
+
+    // Render side: take the newest frame if there is one and draw the
+    // current region with a single GL_LINES call
+    void draw() {
+        if (!vbo)
+            return;
+        bool taken = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (fresh) {
+                // The region going back to the simulation was fenced when it
+                // was drawn; it must be idle before it can be rewritten
+                if (fences[drawing]) {
+                    glClientWaitSync(fences[drawing], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+                    glDeleteSync(fences[drawing]);
+                    fences[drawing] = nullptr;
+                }
+                std::swap(drawing, ready);
+                fresh = false;
+                taken = true;
+            }
+        }
+        size_t vertices = vertexCount[drawing];
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        GLint first = (GLint)(drawing * regionVertices);
+        if (!mapped && taken)
+            glBufferSubData(GL_ARRAY_BUFFER, first * 3 * sizeof(float), vertices * 3 * sizeof(float), region(drawing));
+        glDrawArrays(GL_LINES, first, (GLsizei)vertices);
+        if (fences[drawing])
+            glDeleteSync(fences[drawing]);
+        fences[drawing] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+};
+
+// GL_TIME_ELAPSED query around one stretch of GPU work per frame. Results are
+// collected QUERY_FRAMES frames later, by which time they are normally ready,
+// so timing never stalls the pipeline. Does nothing without profiling.
+class GpuTimer {
+public:
+    static const int QUERY_FRAMES = 4;
+    const char* name;
+    GLuint queries[QUERY_FRAMES];
+    bool pending[QUERY_FRAMES];
+    int current;
+
+    GpuTimer() : name(nullptr), current(0) {
+        std::fill(queries, queries + QUERY_FRAMES, 0);
+        std::fill(pending, pending + QUERY_FRAMES, false);
+    }
+
+    void init(const char* timerName) {
+        name = timerName;
+        if (PROFILING_ENABLED)
+            glGenQueries(QUERY_FRAMES, queries);
+    }
+
+    void release() {
+        if (PROFILING_ENABLED && queries[0])
+            glDeleteQueries(QUERY_FRAMES, queries);
+        std::fill(queries, queries + QUERY_FRAMES, 0);
+    }
+
+    void begin() {
+        if (!PROFILING_ENABLED)
+            return;
+        if (pending[current])
+            collect(current, true);  // Only if the GPU is QUERY_FRAMES frames behind
+        glBeginQuery(GL_TIME_ELAPSED, queries[current]);
+    }
+
+    void end() {
+        if (!PROFILING_ENABLED)
+            return;
+        glEndQuery(GL_TIME_ELAPSED);
+        pending[current] = true;
+        current = (current + 1) % QUERY_FRAMES;
+        for (int k = 0; k < QUERY_FRAMES; k++)
+            if (pending[k])
+                collect(k, false);
+    }
+
+private:
+    void collect(int k, bool wait) {
+        GLint available = 0;
+        if (!wait) {
+            glGetQueryObjectiv(queries[k], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                return;
+        }
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(queries[k], GL_QUERY_RESULT, &nanoseconds);
+        Profiler::instance().recordGpu(name, nanoseconds / 1000.0);
+        pending[k] = false;
+    }
+};
+
+// Timing HUD: one bar per profiled section in the top-left corner, scaled so
+// a 60 Hz frame budget spans a quarter of the window, plus the numbers in the
+// window title. Bars are quads in normalized device coordinates.
+class TimingHud {
+public:
+    static constexpr double BUDGET_MS = 1000.0 / 60.0;
+    static constexpr double TITLE_INTERVAL = 0.5;  // Seconds between title refreshes
+
+    struct Bar {
+        const char* section;
+        const char* label;
+        glm::vec3 color;
+    };
+
+    std::vector<Bar> bars;
+    GLuint vao, vbo;
+    double lastTitle;
+
+    TimingHud() : vao(0), vbo(0), lastTitle(0.0) {
+        bars.push_back(Bar{ "frame", "frame", glm::vec3(0.8f, 0.8f, 0.8f) });
+        bars.push_back(Bar{ "sim.update", "sim", glm::vec3(0.2f, 0.8f, 0.2f) });
+        bars.push_back(Bar{ "frame.upload", "upload", glm::vec3(0.9f, 0.6f, 0.1f) });
+        bars.push_back(Bar{ "frame.draw", "draw", glm::vec3(0.2f, 0.6f, 1.0f) });
+        bars.push_back(Bar{ "gpu.draw", "gpu draw", glm::vec3(0.8f, 0.2f, 0.8f) });
+        bars.push_back(Bar{ "gpu.compute", "gpu compute", glm::vec3(1.0f, 0.3f, 0.3f) });
+    }
+
+    void init() {
+        if (!PROFILING_ENABLED)
+            return;
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &vbo);
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, (bars.size() + 1) * 6 * 3 * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(0);
+    }
+
+    void release() {
+        if (!vao)
+            return;
+        glDeleteVertexArrays(1, &vao);
+        glDeleteBuffers(1, &vbo);
+        vao = vbo = 0;
+    }
+
+    // Expects the scene shader bound; leaves overlay mode switched off
+    void draw(GLint isOverlayLocation, GLint overlayColorLocation) {
+        if (!vao)
+            return;
+        Profiler& profiler = Profiler::instance();
+        std::vector<float> quads;
+        const float left = -0.97f, top = 0.97f, height = 0.025f, gap = 0.01f;
+        const float scale = 0.5f / (float)BUDGET_MS;  // NDC per millisecond
+        for (size_t k = 0; k < bars.size(); k++) {
+            float y = top - k * (height + gap);
+            float width = std::min(1.9f, scale * (float)profiler.averageMs(bars[k].section));
+            addQuad(quads, left, y - height, left + width, y);
+        }
+        // Thin marker at the frame budget
+        addQuad(quads, left + 0.5f, top - bars.size() * (height + gap), left + 0.505f, top);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, quads.size() * sizeof(float), quads.data());
+
+        glDisable(GL_DEPTH_TEST);
+        glUniform1i(isOverlayLocation, 1);
+        glBindVertexArray(vao);
+        for (size_t k = 0; k <= bars.size(); k++) {
+            glm::vec3 color = k < bars.size() ? bars[k].color : glm::vec3(1.0f);
+            glUniform3f(overlayColorLocation, color.x, color.y, color.z);
+            glDrawArrays(GL_TRIANGLES, (GLint)(k * 6), 6);
+        }
+        glUniform1i(isOverlayLocation, 0);
+        glEnable(GL_DEPTH_TEST);
+    }
+
+    void updateTitle(GLFWwindow* window, double now) {
+        if (!PROFILING_ENABLED || now - lastTitle < TITLE_INTERVAL)
+            return;
+        lastTitle = now;
+        Profiler& profiler = Profiler::instance();
+        std::ostringstream title;
+        title << std::fixed << std::setprecision(2) << "3D Grid";
+        for (const Bar& bar : bars)
+            title << " | " << bar.label << " " << profiler.averageMs(bar.section) << " ms";
+        glfwSetWindowTitle(window, title.str().c_str());
+    }
+
+private:
+    static void addQuad(std::vector<float>& quads, float x0, float y0, float x1, float y1) {
+        const float quad[] = { x0, y0, 0, x1, y0, 0, x1, y1, 0, x0, y0, 0, x1, y1, 0, x0, y1, 0 };
+        quads.insert(quads.end(), quad, quad + 18);
     }
 };
 
@@ -168,7 +610,741 @@ void addGridLines(std::vector<float>& vertices, float x, float y, float z, char
     }
 }
 
-int main() {
+// Two triangles per exit-tally cell on each cube face, 4 floats per vertex:
+// position and the cell's index in Tally::faceExits
+void addFaceCells(std::vector<float>& vertices, float halfSize) {
+    const float corners[6][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 0 }, { 1, 1 }, { 0, 1 } };
+    for (int face = 0; face < FACE_COUNT; face++) {
+        int axis = face / 2;
+        float side = (face % 2) ? halfSize : -halfSize;
+        for (int v = 0; v < GRID_SIZE; v++) {
+            for (int u = 0; u < GRID_SIZE; u++) {
+                for (const float* corner : corners) {
+                    float p[3];
+                    p[axis] = side;
+                    p[(axis + 1) % 3] = -halfSize + (u + corner[0]) * CELL_SIZE;
+                    p[(axis + 2) % 3] = -halfSize + (v + corner[1]) * CELL_SIZE;
+                    vertices.insert(vertices.end(), p, p + 3);
+                    vertices.push_back((float)((face * GRID_SIZE + v) * GRID_SIZE + u));
+                }
+            }
+        }
+    }
+}
+
+// Compare the acceleration structures on the loaded scene and on a clustered
+// one. Prints one line per scene/structure/mode with build time and throughput.
+int runAccelerationBenchmark(const Scene& loaded, int gridResolution, ThreadPool& pool) {
+    const size_t batchSize = 1 << 16;
+    const double minSeconds = 0.5;
+    Scene clustered(createClusteredSpheres(16, 625, 1234));
+    struct BenchScene {
+        const char* name;
+        const Scene* scene;
+    };
+    const BenchScene benchScenes[] = { { "loaded", &loaded }, { "clustered", &clustered } };
+
+    std::cout << "threads: " << pool.size() << std::endl;
+    std::cout << std::left << std::setw(11) << "scene" << std::setw(9) << "spheres"
+              << std::setw(8) << "accel" << std::setw(7) << "mode" << std::right
+              << std::setw(11) << "build ms" << std::setw(14) << "histories/s"
+              << std::setw(16) << "ns/photon-tick" << std::endl;
+
+    const AccelerationKind kinds[] = { ACCEL_LINEAR, ACCEL_GRID, ACCEL_BVH, ACCEL_LATTICE };
+    const PropagationMode modes[] = { STEP_MARCHING, EVENT_DRIVEN };
+    for (const BenchScene& benchScene : benchScenes) {
+        for (AccelerationKind kind : kinds) {
+            if (!SphereScene::supports(*benchScene.scene, kind))
+                continue;
+            auto buildStart = std::chrono::steady_clock::now();
+            SphereScene scene(*benchScene.scene, kind, gridResolution);
+            double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+
+            for (PropagationMode mode : modes) {
+                PhotonBatch photons(batchSize, mode);
+                photons.update(scene, &pool);  // Warm up caches
+
+                unsigned long long startHistories = photons.histories;
+                unsigned long long ticks = 0;
+                double seconds = 0.0;
+                auto start = std::chrono::steady_clock::now();
+                while (seconds < minSeconds) {
+                    photons.update(scene, &pool);
+                    ticks++;
+                    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                }
+                double historiesPerSecond = (photons.histories - startHistories) / seconds;
+                double nsPerPhotonTick = seconds * 1e9 / ((double)ticks * batchSize);
+
+                std::cout << std::left << std::setw(11) << benchScene.name << std::setw(9) << benchScene.scene->count
+                          << std::setw(8) << accelerationName(kind) << std::setw(7) << (mode == EVENT_DRIVEN ? "event" : "step")
+                          << std::right << std::fixed << std::setprecision(2) << std::setw(11) << buildMs
+                          << std::setprecision(0) << std::setw(14) << historiesPerSecond
+                          << std::setprecision(2) << std::setw(16) << nsPerPhotonTick << std::endl;
+            }
+        }
+    }
+    return 0;
+}
+
+// Command-line options shared by the interactive and headless modes
+struct RunOptions {
+    PropagationMode mode;
+    InteractionSettings interaction;  // What photons do at sphere hits
+    AccelerationKind accel;
+    int gridResolution;
+    unsigned threads;
+    size_t batchSize;               // 0 picks the default for the mode
+    unsigned regroupInterval;       // Ticks between photon regroup passes (0 = off)
+    bool benchAccel;
+    bool headless;
+    bool gpu;                       // Propagate with the GL 4.3 compute backend
+    unsigned long long photonCount; // Headless: stop after this many histories (0 = no limit)
+    double seconds;                 // Headless: stop after this much wall time (0 = no limit)
+    double targetError;             // Headless: stop once the deposits reach this relative error (0 = off)
+    std::vector<std::pair<uint32_t, uint32_t>> targetSpheres; // Inclusive index ranges the error target covers (empty = all)
+    unsigned long long unscoredAfter; // Histories before never-scored spheres leave the target (0 = never)
+    double tickRate;                // Interactive: simulation ticks per second (0 = flat out)
+    uint64_t seed;                  // Key of the photon random streams
+    std::string outputPath;         // Headless: where the run summary goes (empty = stdout)
+    std::string scenePath;          // Text or binary scene to load
+    std::vector<std::string> convertScene;  // --convert-scene IN OUT
+    std::string eventsPath;         // Binary event stream (empty = off)
+    std::string eventTextPath;      // Sampled text event log, "-" for stdout (empty = off)
+    unsigned long long eventTextSample; // Text log keeps every Nth event
+    std::string tallyPath;          // Per-sphere / per-face / path-length tallies (empty = off)
+    std::string tracePath;          // Chrome trace of the profiled scopes (empty = off)
+    std::string hdf5Path;           // Headless: columnar events and tallies (empty = off)
+    std::string checkpointPath;     // Headless: periodic snapshot of the batch (empty = off)
+    double checkpointInterval;      // Seconds between checkpoints
+    std::string restartPath;        // Headless: checkpoint to resume from
+    int rank;                       // This process's share of a distributed run
+    int ranks;
+
+    RunOptions() :
+        mode(STEP_MARCHING),
+        interaction(DEFAULT_INTERACTION),
+        accel(ACCEL_GRID),
+        gridResolution(DEFAULT_ACCEL_GRID_RESOLUTION),
+        threads(std::max(1u, std::thread::hardware_concurrency())),
+        batchSize(0),
+        regroupInterval(0),
+        benchAccel(false),
+        headless(false),
+        gpu(false),
+        photonCount(0),
+        seconds(0.0),
+        targetError(0.0),
+        unscoredAfter(ERROR_TARGET_UNSCORED_HISTORIES),
+        tickRate(60.0),
+        seed(DEFAULT_PHOTON_SEED),
+        eventTextSample(1),
+        checkpointInterval(60.0),
+        rank(0),
+        ranks(1) {}
+};
+
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  --scene FILE              scene to load (default: generated detector lattice)\n"
+              << "  --convert-scene IN OUT    convert a scene; OUT ending in .psb is binary, else text\n"
+              << "  --step | --event          propagation mode (default: step)\n"
+              << "  --accel KIND              linear|grid|bvh|lattice collision structure (default: grid)\n"
+              << "  --interaction MODEL       absorb|specular|lambertian|isotropic at sphere hits (default: absorb)\n"
+              << "  --absorption P            scattering models: absorption chance per hit (default 0.1)\n"
+              << "  --roulette W              weighted transport, Russian roulette below weight W\n"
+              << "  --max-bounces N           end a history at its Nth scatter (default 64)\n"
+              << "  --grid-res N              grid cells per axis\n"
+              << "  --threads N               propagation threads\n"
+              << "  --batch N                 photons propagated together\n"
+              << "  --regroup K               sort photons by cell and direction every K ticks\n"
+              << "  --tick-rate HZ            interactive simulation rate, 0 = unthrottled\n"
+              << "  --seed N                  random stream key; equal seeds reproduce runs exactly\n"
+              << "  --gpu                     propagate on the GPU (needs OpenGL 4.3)\n"
+              << "  --headless                run without a window\n"
+              << "  --photons N               headless: number of photon histories\n"
+              << "  --seconds T               headless: wall-clock time limit\n"
+              << "  --target-error E          headless: stop once every sphere's deposit has relative\n"
+              << "                            error E or less; needs --photons and/or --seconds as a cap.\n"
+              << "  --target-spheres LIST     only these spheres must reach the target, e.g. 0,4,10-20\n"
+              << "  --unscored-after N        leave target spheres that never scored out of the target\n"
+              << "                            after N histories (default 2^20; 0 = never, so a shadowed\n"
+              << "                            sphere keeps the run going until the cap)\n"
+              << "  --output FILE             headless: write the run summary to FILE\n"
+              << "  --events FILE             write hit/exit events as a binary stream\n"
+              << "  --event-text FILE|-       write a text log of sampled events\n"
+              << "  --event-sample N          text log keeps every Nth event (default 1)\n"
+              << "  --tally FILE              write hit, exit-face and path-length tallies at the end\n"
+              << "  --trace FILE              write profiled scopes as a Chrome trace (profiling builds)\n"
+              << "  --hdf5 FILE               headless: every event and the tallies as compressed HDF5\n"
+              << "                            columns (PHOTON_ENABLE_HDF5 builds)\n"
+              << "  --checkpoint FILE         headless: snapshot the batch to FILE periodically and on exit\n"
+              << "  --checkpoint-interval T   seconds between checkpoints (default 60)\n"
+              << "  --restart FILE            headless: resume a checkpoint; its batch, mode, seed and\n"
+              << "                            photon budget replace the command line's\n"
+              << "  --bench-accel             benchmark the acceleration structures" << std::endl;
+}
+
+// Comma-separated sphere indices and inclusive ranges, e.g. "0,4,10-20".
+// Ranges stay unexpanded until the scene's sphere count is known.
+bool parseSphereList(const std::string& list, std::vector<std::pair<uint32_t, uint32_t>>& ranges) {
+    std::stringstream items(list);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+        if (item.empty() || !std::isdigit((unsigned char)item[0]))
+            return false;
+        char* end = nullptr;
+        unsigned long long first = strtoull(item.c_str(), &end, 10);
+        unsigned long long last = first;
+        if (*end == '-') {
+            if (!std::isdigit((unsigned char)end[1]))
+                return false;
+            last = strtoull(end + 1, &end, 10);
+        }
+        if (*end != '\0' || last < first || last > UINT32_MAX)
+            return false;
+        ranges.push_back(std::make_pair((uint32_t)first, (uint32_t)last));
+    }
+    return !ranges.empty();
+}
+
+// The sphere indices of ranges, or false (after printing why) if one is
+// past the scene's sphereCount spheres
+bool expandSphereRanges(const std::vector<std::pair<uint32_t, uint32_t>>& ranges, size_t sphereCount,
+                        std::vector<uint32_t>& spheres) {
+    for (const std::pair<uint32_t, uint32_t>& range : ranges) {
+        if (range.second >= sphereCount) {
+            std::cerr << "--target-spheres index " << range.second << " is past the scene's " << sphereCount
+                      << " spheres" << std::endl;
+            return false;
+        }
+    }
+    for (const std::pair<uint32_t, uint32_t>& range : ranges) {
+        for (uint64_t i = range.first; i <= range.second; i++)
+            spheres.push_back((uint32_t)i);
+    }
+    return true;
+}
+
+// Returns false (after printing why) on a bad command line
+bool parseArguments(int argc, char** argv, RunOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--scene" && hasValue)
+            options.scenePath = argv[++i];
+        else if (arg == "--convert-scene" && i + 2 < argc) {
+            options.convertScene.assign(argv + i + 1, argv + i + 3);
+            i += 2;
+        }
+        else if (arg == "--event")
+            options.mode = EVENT_DRIVEN;
+        else if (arg == "--step")
+            options.mode = STEP_MARCHING;
+        else if (arg == "--accel" && hasValue) {
+            std::string kind = argv[++i];
+            if (kind == "linear")
+                options.accel = ACCEL_LINEAR;
+            else if (kind == "grid")
+                options.accel = ACCEL_GRID;
+            else if (kind == "bvh")
+                options.accel = ACCEL_BVH;
+            else if (kind == "lattice")
+                options.accel = ACCEL_LATTICE;
+            else {
+                std::cerr << "Unknown acceleration structure: " << kind << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--interaction" && hasValue) {
+            std::string model = argv[++i];
+            if (!parseInteractionModel(model, options.interaction.model)) {
+                std::cerr << "Unknown interaction model: " << model << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--absorption" && hasValue)
+            options.interaction.absorption = (float)std::min(1.0, std::max(0.0, atof(argv[++i])));
+        else if (arg == "--roulette" && hasValue)
+            options.interaction.rouletteWeight = (float)std::min(1.0, std::max(0.0, atof(argv[++i])));
+        else if (arg == "--max-bounces" && hasValue)
+            options.interaction.maxBounces = (uint32_t)std::max(0LL, atoll(argv[++i]));
+        else if (arg == "--grid-res" && hasValue)
+            options.gridResolution = std::max(1, atoi(argv[++i]));
+        else if (arg == "--threads" && hasValue)
+            options.threads = (unsigned)std::max(1, atoi(argv[++i]));
+        else if (arg == "--batch" && hasValue)
+            options.batchSize = (size_t)std::max(1LL, atoll(argv[++i]));
+        else if (arg == "--regroup" && hasValue)
+            options.regroupInterval = (unsigned)std::max(0, atoi(argv[++i]));
+        else if (arg == "--tick-rate" && hasValue)
+            options.tickRate = std::max(0.0, atof(argv[++i]));
+        else if (arg == "--seed" && hasValue)
+            options.seed = strtoull(argv[++i], nullptr, 0);
+        else if (arg == "--headless")
+            options.headless = true;
+        else if (arg == "--gpu")
+            options.gpu = true;
+        else if (arg == "--photons" && hasValue)
+            options.photonCount = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--seconds" && hasValue)
+            options.seconds = std::max(0.0, atof(argv[++i]));
+        else if (arg == "--target-error" && hasValue)
+            options.targetError = std::max(0.0, atof(argv[++i]));
+        else if (arg == "--target-spheres" && hasValue) {
+            std::string list = argv[++i];
+            if (!parseSphereList(list, options.targetSpheres)) {
+                std::cerr << "Bad sphere list: " << list << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--unscored-after" && hasValue)
+            options.unscoredAfter = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--output" && hasValue)
+            options.outputPath = argv[++i];
+        else if (arg == "--events" && hasValue)
+            options.eventsPath = argv[++i];
+        else if (arg == "--event-text" && hasValue)
+            options.eventTextPath = argv[++i];
+        else if (arg == "--event-sample" && hasValue)
+            options.eventTextSample = std::max(1ull, strtoull(argv[++i], nullptr, 10));
+        else if (arg == "--tally" && hasValue)
+            options.tallyPath = argv[++i];
+        else if (arg == "--trace" && hasValue)
+            options.tracePath = argv[++i];
+        else if (arg == "--hdf5" && hasValue)
+            options.hdf5Path = argv[++i];
+        else if (arg == "--checkpoint" && hasValue)
+            options.checkpointPath = argv[++i];
+        else if (arg == "--checkpoint-interval" && hasValue)
+            options.checkpointInterval = std::max(0.0, atof(argv[++i]));
+        else if (arg == "--restart" && hasValue)
+            options.restartPath = argv[++i];
+        else if (arg == "--bench-accel")
+            options.benchAccel = true;
+        else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+    if (options.gpu && options.interaction.model != INTERACT_ABSORB) {
+        std::cerr << "The GPU backend only supports --interaction absorb" << std::endl;
+        return false;
+    }
+    if (options.gpu && options.regroupInterval) {
+        std::cerr << "--regroup applies to the CPU backend only" << std::endl;
+        return false;
+    }
+    bool checkpointing = !options.checkpointPath.empty() || !options.restartPath.empty();
+    if (checkpointing && (!options.headless || options.gpu)) {
+        std::cerr << "--checkpoint and --restart need a headless run on the CPU backend" << std::endl;
+        return false;
+    }
+    if (options.ranks > 1 && (!options.headless || options.gpu || (options.photonCount == 0 && options.restartPath.empty()))) {
+        std::cerr << "Runs on several MPI ranks must be headless, on the CPU backend, with --photons N" << std::endl;
+        return false;
+    }
+    if (options.headless && options.photonCount == 0 && options.seconds <= 0.0 && options.restartPath.empty()) {
+        std::cerr << "Headless mode needs --photons N and/or --seconds T" << std::endl;
+        return false;
+    }
+    if (options.targetError > 0.0 && (!options.headless || options.gpu)) {
+        std::cerr << "--target-error needs a headless run on the CPU backend" << std::endl;
+        return false;
+    }
+    if (options.targetError > 0.0 && options.photonCount == 0 && options.seconds <= 0.0) {
+        std::cerr << "--target-error needs --photons N and/or --seconds T as a cap" << std::endl;
+        return false;
+    }
+    if (!options.targetSpheres.empty() && options.targetError <= 0.0) {
+        std::cerr << "--target-spheres needs --target-error E" << std::endl;
+        return false;
+    }
+    if (options.unscoredAfter != ERROR_TARGET_UNSCORED_HISTORIES && options.targetError <= 0.0) {
+        std::cerr << "--unscored-after needs --target-error E" << std::endl;
+        return false;
+    }
+    if (!options.tracePath.empty() && !PROFILING_ENABLED) {
+        std::cerr << "--trace needs a build with PHOTON_ENABLE_PROFILING" << std::endl;
+        return false;
+    }
+#ifndef PHOTON_ENABLE_HDF5
+    if (!options.hdf5Path.empty()) {
+        std::cerr << "--hdf5 needs a build with PHOTON_ENABLE_HDF5" << std::endl;
+        return false;
+    }
+#endif
+    if (!options.hdf5Path.empty() && (!options.headless || options.gpu)) {
+        std::cerr << "--hdf5 needs a headless run on the CPU backend" << std::endl;
+        return false;
+    }
+    if (options.batchSize == 0)
+        options.batchSize = (options.headless || options.gpu) ? HEADLESS_BATCH_SIZE : PHOTON_BATCH_SIZE;
+    return true;
+}
+
+// Open the event outputs requested on the command line
+bool openEventLog(const RunOptions& options, EventLog& eventLog) {
+    if (!options.eventsPath.empty() && !eventLog.openBinary(options.eventsPath)) {
+        std::cerr << "Failed to open " << options.eventsPath << " for writing" << std::endl;
+        return false;
+    }
+    if (!options.eventTextPath.empty() && !eventLog.openText(options.eventTextPath, options.eventTextSample)) {
+        std::cerr << "Failed to open " << options.eventTextPath << " for writing" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Does nothing without --tally; returns false if the file cannot be written
+bool writeTally(const RunOptions& options, const Tally& tally) {
+    if (options.tallyPath.empty())
+        return true;
+    std::ofstream file(options.tallyPath);
+    tally.write(file);
+    if (!file) {
+        std::cerr << "Failed to write " << options.tallyPath << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Does nothing without --trace; returns false if the file cannot be written
+bool writeTrace(const RunOptions& options) {
+    if (options.tracePath.empty())
+        return true;
+    if (!Profiler::instance().writeChromeTrace(options.tracePath)) {
+        std::cerr << "Failed to write " << options.tracePath << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// The run summary goes to --output FILE, or stdout. Returns nullptr on failure.
+std::ostream* openSummaryOutput(const RunOptions& options, std::ofstream& file) {
+    if (options.outputPath.empty())
+        return &std::cout;
+    file.open(options.outputPath);
+    if (!file) {
+        std::cerr << "Failed to open " << options.outputPath << " for writing" << std::endl;
+        return nullptr;
+    }
+    return &file;
+}
+
+// Headless run on the GPU backend. Compute needs a GL context, so this opens
+// an invisible window; it still needs a display, unlike the CPU path.
+int runHeadlessGpu(const RunOptions& options, const Scene& sceneFile) {
+    if (!glfwInit()) {
+        std::cerr << "Failed to initialize GLFW (the GPU backend needs a display)" << std::endl;
+        return -1;
+    }
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow* window = glfwCreateWindow(64, 64, "photon compute", nullptr, nullptr);
+    if (!window) {
+        std::cerr << "Failed to create an OpenGL 4.3 context" << std::endl;
+        glfwTerminate();
+        return -1;
+    }
+    glfwMakeContextCurrent(window);
+    glewExperimental = GL_TRUE;
+    if (glewInit() != GLEW_OK) {
+        std::cerr << "Failed to initialize GLEW" << std::endl;
+        glfwTerminate();
+        return -1;
+    }
+
+    int result = 0;
+    {
+        SphereTable table(sceneFile.records, sceneFile.count);
+        GpuPhotonEngine gpu;
+        if (!gpu.init(table, options.batchSize, options.mode, options.gridResolution,
+                      options.photonCount ? options.photonCount : PhotonBatch::UNLIMITED, options.seed)) {
+            result = -1;
+        } else {
+            auto start = std::chrono::steady_clock::now();
+            double elapsed = 0.0;
+            while (!gpu.finished() && (options.seconds <= 0.0 || elapsed < options.seconds)) {
+                PHOTON_PROFILE_SCOPE("gpu.dispatch");
+                gpu.dispatch(GPU_STEPS_PER_DISPATCH);
+                gpu.readCounters();
+                elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            }
+
+            std::ofstream file;
+            std::ostream* out = openSummaryOutput(options, file);
+            if (!out) {
+                result = -1;
+            } else {
+                *out << "mode " << (options.mode == EVENT_DRIVEN ? "event" : "step") << "\n"
+                     << "accel gpu\n"
+                     << "seed " << options.seed << "\n"
+                     << "batch " << gpu.photonCount << "\n"
+                     << "spheres " << gpu.sphereCount << "\n"
+                     << "ticks " << gpu.ticks << "\n"
+                     << "histories " << gpu.histories() << "\n"
+                     << "sphere_hits " << gpu.sphereHits << "\n"
+                     << "boundary_exits " << gpu.boundaryExits << "\n"
+                     << "seconds " << elapsed << "\n"
+                     << "histories_per_second " << (elapsed > 0.0 ? gpu.histories() / elapsed : 0.0) << std::endl;
+            }
+            if (!writeTrace(options))
+                result = -1;
+        }
+    }
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    return result;
+}
+
+// Set by SIGTERM / SIGINT so a headless run (e.g. on a preempted node) stops
+// cleanly and leaves its last checkpoint
+volatile std::sig_atomic_t stopRequested = 0;
+
+void requestStop(int) {
+    stopRequested = 1;
+}
+
+// Propagate flat out with no window until the photon budget or the time
+// limit is reached, then write a summary of the run
+int runHeadless(const RunOptions& options, const Scene& sceneFile, ThreadPool& pool) {
+    if (options.gpu)
+        return runHeadlessGpu(options, sceneFile);
+
+    // A distributed run gives each rank a contiguous slice of the photon IDs
+    SphereScene scene(sceneFile, options.accel, options.gridResolution);
+    PhotonShard shard = photonShard(options.photonCount, options.rank, options.ranks);
+    PhotonBatch photons(options.batchSize, options.mode,
+                        options.photonCount ? shard.count : PhotonBatch::UNLIMITED, options.seed, shard.first);
+    photons.interaction = options.interaction;
+    photons.regroupInterval = options.regroupInterval;
+    uint64_t sceneHash = sceneFile.fingerprint();
+    if (!options.restartPath.empty() && !photons.loadState(options.restartPath, scene.table.count, sceneHash))
+        return -1;
+    unsigned long long startHistories = photons.histories;
+    unsigned long long startTicks = photons.ticks;
+
+    // After each tick the target is judged on the batch's own tally, or in a
+    // distributed run on every rank's moments merged
+    ErrorTarget errorTarget(options.targetError, {}, options.unscoredAfter);
+    if (!expandSphereRanges(options.targetSpheres, scene.table.count, errorTarget.spheres))
+        return -1;
+    unsigned long long convergedTick = 0;  // Tick the error target was met, 0 = not met
+    bool reportedUnscored = false;
+    size_t batchSize = photons.size();  // Regrouping drops retired slots near the end
+#ifdef PHOTON_ENABLE_MPI
+    bool distributed = options.ranks > 1 && errorTarget.target > 0.0;
+    DistributedProgress progress(scene.table.count, photons.gridHalfSize);
+#endif
+
+    EventLog eventLog(pool.size());
+    if (!openEventLog(options, eventLog))
+        return -1;
+#ifdef PHOTON_ENABLE_HDF5
+    // Columns are appended a row group at a time from the event writer thread
+    Hdf5Export columns;
+    if (!options.hdf5Path.empty()) {
+        if (!columns.open(options.hdf5Path))
+            return -1;
+        eventLog.sink = &columns;
+    }
+#endif
+    if (eventLog.enabled()) {
+        photons.eventLog = &eventLog;
+        eventLog.start();
+    }
+
+    // Snapshots are copied between ticks and written in the background
+    bool checkpointing = !options.checkpointPath.empty();
+    CheckpointWriter checkpoints;
+    if (checkpointing)
+        checkpoints.start(options.checkpointPath);
+    std::signal(SIGTERM, requestStop);
+    std::signal(SIGINT, requestStop);
+
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0.0;
+    double lastCheckpoint = 0.0;
+    for (;;) {
+        bool running = !photons.finished() && (options.seconds <= 0.0 || elapsed < options.seconds) && !stopRequested;
+        if (running)
+            photons.update(scene, &pool);
+        const Tally* judged = &photons.tally;
+        unsigned long long judgedHistories = photons.histories;
+#ifdef PHOTON_ENABLE_MPI
+        if (distributed) {
+            // A rank that is done keeps checking, waiting for the rest
+            progress.check(errorTarget, photons, running, MPI_COMM_WORLD);
+            if (!progress.anyRunning)
+                break;
+            judged = &progress.merged;
+            judgedHistories = progress.histories;
+        } else
+#endif
+        if (!running)
+            break;
+        if (!convergedTick && errorTarget.met(*judged, judgedHistories)) {
+            convergedTick = photons.ticks;
+            photons.stopEmitting();  // Photons in flight still finish, so no history is cut short
+        }
+        if (errorTarget.target > 0.0 && errorTarget.unscoredAfter && !reportedUnscored &&
+            judgedHistories >= errorTarget.unscoredAfter) {
+            size_t unscored = errorTarget.unscoredCount(*judged, judgedHistories);
+            if (unscored && options.rank == 0)
+                std::cerr << "Warning: " << unscored << " target spheres have not scored after " << judgedHistories
+                          << " histories; the error target leaves them out until they do (see --unscored-after)" << std::endl;
+            reportedUnscored = true;
+        }
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (checkpointing && running && elapsed - lastCheckpoint >= options.checkpointInterval) {
+            checkpoints.submit(photons, sceneHash);
+            lastCheckpoint = elapsed;
+        }
+    }
+    if (checkpointing) {
+        // The final state always reaches the disk, so a run stopped by the
+        // time limit or a signal resumes exactly where it ended
+        checkpoints.flush();
+        checkpoints.submit(photons, sceneHash);
+        checkpoints.stop();
+    }
+
+    eventLog.stop();
+#ifdef PHOTON_ENABLE_MPI
+    if (options.ranks > 1) {
+        reduceBatch(photons, scene.table.count, MPI_COMM_WORLD);
+        elapsed = reduceMaxSeconds(elapsed, MPI_COMM_WORLD);
+        unsigned long long resumed = startHistories;
+        MPI_Reduce(&resumed, &startHistories, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    }
+#endif
+#ifdef PHOTON_ENABLE_HDF5
+    // Every rank exports its own events; rank 0 adds the reduced tallies
+    if (!options.hdf5Path.empty()) {
+        if (options.rank == 0)
+            columns.writeTally(photons.tally);
+        if (!columns.close()) {
+            std::cerr << "HDF5 export to " << options.hdf5Path << " is incomplete" << std::endl;
+            return -1;
+        }
+    }
+#endif
+    if (!writeTrace(options))
+        return -1;
+    if (options.rank != 0)  // Rank 0 reports for the whole run
+        return checkpoints.failed == 0 ? 0 : -1;
+    if (!writeTally(options, photons.tally))
+        return -1;
+
+    std::ofstream file;
+    std::ostream* out = openSummaryOutput(options, file);
+    if (!out)
+        return -1;
+    *out << "mode " << (photons.mode == EVENT_DRIVEN ? "event" : "step") << "\n"
+         << "accel " << accelerationName(options.accel) << "\n"
+         << "interaction " << interactionName(photons.interaction.model) << "\n"
+         << "threads " << pool.size() << "\n"
+         << "ranks " << options.ranks << "\n"
+         << "seed " << photons.seed << "\n"
+         << "batch " << batchSize << "\n"
+         << "spheres " << scene.table.count << "\n"
+         << "ticks " << photons.ticks << "\n"
+         << "histories " << photons.histories << "\n"
+         << "sphere_hits " << photons.sphereHits << "\n"
+         << "boundary_exits " << photons.boundaryExits << "\n"
+         << "scatters " << photons.scatters << "\n"
+         << "events_written " << eventLog.written << "\n"
+         << "event_stalls " << eventLog.stalls.load() << "\n";
+#ifdef PHOTON_ENABLE_HDF5
+    if (!options.hdf5Path.empty())
+        *out << "hdf5_events " << columns.rows << "\n";
+#endif
+    if (photons.regroupInterval)
+        *out << "regroup " << photons.regroupInterval << "\n";
+    if (options.targetError > 0.0) {
+        // Judged on the moments reduced over all ranks
+        *out << "target_error " << errorTarget.target << "\n"
+             << "target_spheres " << (errorTarget.spheres.empty() ? scene.table.count : errorTarget.spheres.size()) << "\n"
+             << "max_relative_error " << errorTarget.worst(photons.tally, photons.histories) << "\n"
+             << "unconverged_spheres " << errorTarget.unconverged(photons.tally, photons.histories) << "\n"
+             << "unscored_spheres " << errorTarget.unscoredCount(photons.tally, photons.histories) << "\n"
+             << "unscored_after " << errorTarget.unscoredAfter << "\n"
+             << "converged_tick " << convergedTick << "\n";
+    }
+    if (!options.restartPath.empty())
+        *out << "resumed_ticks " << startTicks << "\n";
+    if (checkpointing) {
+        *out << "checkpoints_written " << checkpoints.written << "\n"
+             << "checkpoints_skipped " << checkpoints.skipped << "\n";
+    }
+    *out << "seconds " << elapsed << "\n"
+         << "histories_per_second " << (elapsed > 0.0 ? (photons.histories - startHistories) / elapsed : 0.0) << std::endl;
+    return checkpoints.failed == 0 ? 0 : -1;
+}
+
+// Per-rank outputs get a ".rankN" suffix so ranks never share a file
+std::string rankPath(const std::string& path, int rank) {
+    return path.empty() || path == "-" ? path : path + ".rank" + std::to_string(rank);
+}
+
+int main(int argc, char** argv) {
+    RunOptions options;
+#ifdef PHOTON_ENABLE_MPI
+    MpiSession mpi(argc, argv);
+    options.rank = mpi.rank;
+    options.ranks = mpi.ranks;
+#endif
+    if (!parseArguments(argc, argv, options))
+        return -1;
+    if (options.ranks > 1) {
+        for (std::string* path : { &options.checkpointPath, &options.restartPath, &options.eventsPath,
+                                   &options.eventTextPath, &options.tracePath, &options.hdf5Path })
+            *path = rankPath(*path, options.rank);
+    }
+
+    // Propagation runs on the pool; the render thread only reads snapshots
+    ThreadPool pool(options.threads);
+
+    if (!options.convertScene.empty()) {
+        Scene input;
+        if (!input.load(options.convertScene[0]))
+            return -1;
+        const std::string& output = options.convertScene[1];
+        bool binary = output.size() >= 4 && output.compare(output.size() - 4, 4, ".psb") == 0;
+        if (!(binary ? input.saveBinary(output) : input.saveText(output))) {
+            std::cerr << "Failed to write " << output << std::endl;
+            return -1;
+        }
+        std::cout << "Wrote " << input.count << " spheres to " << output << std::endl;
+        return 0;
+    }
+
+    Scene scene;
+    if (options.scenePath.empty())
+        scene.generate(DEFAULT_DETECTOR_LATTICE);
+    else if (!scene.load(options.scenePath))
+        return -1;
+    if (!SphereScene::supports(scene, options.accel)) {
+        std::cerr << "--accel lattice needs a scene made of a single lattice whose spheres fit inside their cells" << std::endl;
+        return -1;
+    }
+
+    // Benchmarks and headless runs never touch GLFW
+    if (options.benchAccel)
+        return runAccelerationBenchmark(scene, options.gridResolution, pool);
+    if (options.headless) {
+        int result = runHeadless(options, scene, pool);
+#ifdef PHOTON_ENABLE_MPI
+        if (result != 0 && options.ranks > 1)
+            MPI_Abort(MPI_COMM_WORLD, 1);  // The other ranks would wait in the reduction forever
+#endif
+        return result;
+    }
+
     // Initialize GLFW
     if (!glfwInit()) {
         std::cerr << "Failed to initialize GLFW" << std::endl;
@@ -176,7 +1352,8 @@ int main() {
     }
 
     // Configure GLFW
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    // The GPU backend needs compute shaders (4.3); otherwise 3.3 is enough
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, options.gpu ? 4 : 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
@@ -190,27 +1367,18 @@ int main() {
     glfwMakeContextCurrent(window);
 
     // Initialize GLEW
+    glewExperimental = GL_TRUE;  // Core profiles need this for the 4.x entry points
     if (glewInit() != GLEW_OK) {
         std::cerr << "Failed to initialize GLEW" << std::endl;
         return -1;
     }
 
-    // Create and compile shaders
-    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &vertexShaderSource, nullptr);
-    glCompileShader(vertexShader);
-
-    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &fragmentShaderSource, nullptr);
-    glCompileShader(fragmentShader);
-
-    GLuint shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glLinkProgram(shaderProgram);
-
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
+    Renderer renderer;
+    if (!renderer.init()) {
+        renderer.release();
+        glfwTerminate();
+        return -1;
+    }
 
     // Create grid vertices
     std::vector<float> vertices;
@@ -255,552 +1423,167 @@ int main() {
     float cameraPhi = 45.0f;    // vertical angle
     const float rotationSpeed = 2.0f;
 
-    Ray ray;
-    GLuint isRayLocation = glGetUniformLocation(shaderProgram, "isRay");
-
-    // Create ray vertices buffer
-    GLuint rayVAO, rayVBO;
-    glGenVertexArrays(1, &rayVAO);
-    glGenBuffers(1, &rayVBO);
-    
-    glBindVertexArray(rayVAO);
-    glBindBuffer(GL_ARRAY_BUFFER, rayVBO);
-    // We'll update this buffer every frame
-    glBufferData(GL_ARRAY_BUFFER, 6 * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-
-
-        // Create three spheres
-    std::vector<Sphere> spheres = {
-
-
-
-
-        Sphere(0.100, -0.1000f, 0.4, 0.02f),
-        Sphere(0.100, -0.1000f, -0.4f, 0.02f),
-        Sphere(0.100, -0.1000f, 0.35f, 0.02f),
-        Sphere(0.100, -0.1000f, 0.30f, 0.02f),
-        Sphere(0.100, -0.1000f, 0.25f, 0.02f),
-        Sphere(0.100, -0.1000f, 0.20f, 0.02f),
-        Sphere(0.100, -0.1000f, 0.15f, 0.02f),
-        Sphere(0.100, -0.1000f, 0.10f, 0.02f),
-        Sphere(0.100, -0.1000f, 0.05f, 0.02f),
-        Sphere(0.100, -0.1000f, 0.00f, 0.02f),
-        Sphere(0.100, -0.1000f, -0.05f, 0.02f),
-        Sphere(0.100, -0.1000f, -0.10f, 0.02f),
-        Sphere(0.100, -0.1000f, -0.15f, 0.02f),
-        Sphere(0.100, -0.1000f, -0.2f, 0.02f),
-        Sphere(0.100, -0.1000f, -0.25f, 0.02f),
-        Sphere(0.100, -0.1000f, -0.30f, 0.02f),
-        Sphere(0.100, -0.1000f, -0.35f, 0.02f),
-        Sphere(0.100, -0.1000f, -0.40f, 0.02f),
-
-        Sphere(0.2f, -0.1000f, 0.4, 0.02f),
-        Sphere(0.2f, -0.1000f, -0.4f, 0.02f),
-        Sphere(0.2f, -0.1000f, 0.35f, 0.02f),
-        Sphere(0.2f, -0.1000f, 0.30f, 0.02f),
-        Sphere(0.2f, -0.1000f, 0.25f, 0.02f),
-        Sphere(0.2f, -0.1000f, 0.20f, 0.02f),
-        Sphere(0.2f, -0.1000f, 0.15f, 0.02f),
-        Sphere(0.2f, -0.1000f, 0.10f, 0.02f),
-        Sphere(0.2f, -0.1000f, 0.05f, 0.02f),
-        Sphere(0.2f, -0.1000f, 0.00f, 0.02f),
-        Sphere(0.2f, -0.1000f, -0.05f, 0.02f),
-        Sphere(0.2f, -0.1000f, -0.10f, 0.02f),
-        Sphere(0.2f, -0.1000f, -0.15f, 0.02f),
-        Sphere(0.2f, -0.1000f, -0.2f, 0.02f),
-        Sphere(0.2f, -0.1000f, -0.25f, 0.02f),
-        Sphere(0.2f, -0.1000f, -0.30f, 0.02f),
-        Sphere(0.2f, -0.1000f, -0.35f, 0.02f),
-        Sphere(0.2f, -0.1000f, -0.40f, 0.02f),
-
-        Sphere(0.300f, -0.1000f, 0.4, 0.02f),
-        Sphere(0.300f, -0.1000f, -0.4f, 0.02f),
-        Sphere(0.300f, -0.1000f, 0.35f, 0.02f),
-        Sphere(0.300f, -0.1000f, 0.30f, 0.02f),
-        Sphere(0.300f, -0.1000f, 0.25f, 0.02f),
-        Sphere(0.300f, -0.1000f, 0.20f, 0.02f),
-        Sphere(0.300f, -0.1000f, 0.15f, 0.02f),
-        Sphere(0.300f, -0.1000f, 0.10f, 0.02f),
-        Sphere(0.300f, -0.1000f, 0.05f, 0.02f),
-        Sphere(0.300f, -0.1000f, 0.00f, 0.02f),
-        Sphere(0.300f, -0.1000f, -0.05f, 0.02f),
-        Sphere(0.300f, -0.1000f, -0.10f, 0.02f),
-        Sphere(0.300f, -0.1000f, -0.15f, 0.02f),
-        Sphere(0.300f, -0.1000f, -0.2f, 0.02f),
-        Sphere(0.300f, -0.1000f, -0.25f, 0.02f),
-        Sphere(0.300f, -0.1000f, -0.30f, 0.02f),
-        Sphere(0.300f, -0.1000f, -0.35f, 0.02f),
-        Sphere(0.300f, -0.1000f, -0.40f, 0.02f),
-
-        Sphere(0.400f, -0.1000f, 0.4, 0.02f),
-        Sphere(0.400f, -0.1000f, -0.4f, 0.02f),
-        Sphere(0.400f, -0.1000f, 0.35f, 0.02f),
-        Sphere(0.400f, -0.1000f, 0.30f, 0.02f),
-        Sphere(0.400f, -0.1000f, 0.25f, 0.02f),
-        Sphere(0.400f, -0.1000f, 0.20f, 0.02f),
-        Sphere(0.400f, -0.1000f, 0.15f, 0.02f),
-        Sphere(0.400f, -0.1000f, 0.10f, 0.02f),
-        Sphere(0.400f, -0.1000f, 0.05f, 0.02f),
-        Sphere(0.400f, -0.1000f, 0.00f, 0.02f),
-        Sphere(0.400f, -0.1000f, -0.05f, 0.02f),
-        Sphere(0.400f, -0.1000f, -0.10f, 0.02f),
-        Sphere(0.400f, -0.1000f, -0.15f, 0.02f),
-        Sphere(0.400f, -0.1000f, -0.2f, 0.02f),
-        Sphere(0.400f, -0.1000f, -0.25f, 0.02f),
-        Sphere(0.400f, -0.1000f, -0.30f, 0.02f),
-        Sphere(0.400f, -0.1000f, -0.35f, 0.02f),
-        Sphere(0.400f, -0.1000f, -0.40f, 0.02f),
- 
-        
-
-
-
-
-
-
-
-        Sphere(0.100, 0.0000, 0.4, 0.02f),
-        Sphere(0.100, 0.0000, -0.4f, 0.02f),
-        Sphere(0.100, 0.0000, 0.35f, 0.02f),
-        Sphere(0.100, 0.0000, 0.30f, 0.02f),
-        Sphere(0.100, 0.0000, 0.25f, 0.02f),
-        Sphere(0.100, 0.0000, 0.20f, 0.02f),
-        Sphere(0.100, 0.0000, 0.15f, 0.02f),
-        Sphere(0.100, 0.0000, 0.10f, 0.02f),
-        Sphere(0.100, 0.0000, 0.05f, 0.02f),
-        Sphere(0.100, 0.0000, 0.00f, 0.02f),
-        Sphere(0.100, 0.0000, -0.05f, 0.02f),
-        Sphere(0.100, 0.0000, -0.10f, 0.02f),
-        Sphere(0.100, 0.0000, -0.15f, 0.02f),
-        Sphere(0.100, 0.0000, -0.2f, 0.02f),
-        Sphere(0.100, 0.0000, -0.25f, 0.02f),
-        Sphere(0.100, 0.0000, -0.30f, 0.02f),
-        Sphere(0.100, 0.0000, -0.35f, 0.02f),
-        Sphere(0.100, 0.0000, -0.40f, 0.02f),
-
-        Sphere(0.2f, 0.0000, 0.4, 0.02f),
-        Sphere(0.2f, 0.0000, -0.4f, 0.02f),
-        Sphere(0.2f, 0.0000, 0.35f, 0.02f),
-        Sphere(0.2f, 0.0000, 0.30f, 0.02f),
-        Sphere(0.2f, 0.0000, 0.25f, 0.02f),
-        Sphere(0.2f, 0.0000, 0.20f, 0.02f),
-        Sphere(0.2f, 0.0000, 0.15f, 0.02f),
-        Sphere(0.2f, 0.0000, 0.10f, 0.02f),
-        Sphere(0.2f, 0.0000, 0.05f, 0.02f),
-        Sphere(0.2f, 0.0000, 0.00f, 0.02f),
-        Sphere(0.2f, 0.0000, -0.05f, 0.02f),
-        Sphere(0.2f, 0.0000, -0.10f, 0.02f),
-        Sphere(0.2f, 0.0000, -0.15f, 0.02f),
-        Sphere(0.2f, 0.0000, -0.2f, 0.02f),
-        Sphere(0.2f, 0.0000, -0.25f, 0.02f),
-        Sphere(0.2f, 0.0000, -0.30f, 0.02f),
-        Sphere(0.2f, 0.0000, -0.35f, 0.02f),
-        Sphere(0.2f, 0.0000, -0.40f, 0.02f),
-
-        Sphere(0.300f, 0.0000, 0.4, 0.02f),
-        Sphere(0.300f, 0.0000, -0.4f, 0.02f),
-        Sphere(0.300f, 0.0000, 0.35f, 0.02f),
-        Sphere(0.300f, 0.0000, 0.30f, 0.02f),
-        Sphere(0.300f, 0.0000, 0.25f, 0.02f),
-        Sphere(0.300f, 0.0000, 0.20f, 0.02f),
-        Sphere(0.300f, 0.0000, 0.15f, 0.02f),
-        Sphere(0.300f, 0.0000, 0.10f, 0.02f),
-        Sphere(0.300f, 0.0000, 0.05f, 0.02f),
-        Sphere(0.300f, 0.0000, 0.00f, 0.02f),
-        Sphere(0.300f, 0.0000, -0.05f, 0.02f),
-        Sphere(0.300f, 0.0000, -0.10f, 0.02f),
-        Sphere(0.300f, 0.0000, -0.15f, 0.02f),
-        Sphere(0.300f, 0.0000, -0.2f, 0.02f),
-        Sphere(0.300f, 0.0000, -0.25f, 0.02f),
-        Sphere(0.300f, 0.0000, -0.30f, 0.02f),
-        Sphere(0.300f, 0.0000, -0.35f, 0.02f),
-        Sphere(0.300f, 0.0000, -0.40f, 0.02f),
-
-        Sphere(0.400f, 0.0000, 0.4, 0.02f),
-        Sphere(0.400f, 0.0000, -0.4f, 0.02f),
-        Sphere(0.400f, 0.0000, 0.35f, 0.02f),
-        Sphere(0.400f, 0.0000, 0.30f, 0.02f),
-        Sphere(0.400f, 0.0000, 0.25f, 0.02f),
-        Sphere(0.400f, 0.0000, 0.20f, 0.02f),
-        Sphere(0.400f, 0.0000, 0.15f, 0.02f),
-        Sphere(0.400f, 0.0000, 0.10f, 0.02f),
-        Sphere(0.400f, 0.0000, 0.05f, 0.02f),
-        Sphere(0.400f, 0.0000, 0.00f, 0.02f),
-        Sphere(0.400f, 0.0000, -0.05f, 0.02f),
-        Sphere(0.400f, 0.0000, -0.10f, 0.02f),
-        Sphere(0.400f, 0.0000, -0.15f, 0.02f),
-        Sphere(0.400f, 0.0000, -0.2f, 0.02f),
-        Sphere(0.400f, 0.0000, -0.25f, 0.02f),
-        Sphere(0.400f, 0.0000, -0.30f, 0.02f),
-        Sphere(0.400f, 0.0000, -0.35f, 0.02f),
-        Sphere(0.400f, 0.0000, -0.40f, 0.02f),
- 
-        
-
-
-
-        
-
-
-
-
-
-        Sphere(0.100, 0.1000f, 0.4, 0.02f),
-        Sphere(0.100, 0.1000f, -0.4f, 0.02f),
-        Sphere(0.100, 0.1000f, 0.35f, 0.02f),
-        Sphere(0.100, 0.1000f, 0.30f, 0.02f),
-        Sphere(0.100, 0.1000f, 0.25f, 0.02f),
-        Sphere(0.100, 0.1000f, 0.20f, 0.02f),
-        Sphere(0.100, 0.1000f, 0.15f, 0.02f),
-        Sphere(0.100, 0.1000f, 0.10f, 0.02f),
-        Sphere(0.100, 0.1000f, 0.05f, 0.02f),
-        Sphere(0.100, 0.1000f, 0.00f, 0.02f),
-        Sphere(0.100, 0.1000f, -0.05f, 0.02f),
-        Sphere(0.100, 0.1000f, -0.10f, 0.02f),
-        Sphere(0.100, 0.1000f, -0.15f, 0.02f),
-        Sphere(0.100, 0.1000f, -0.2f, 0.02f),
-        Sphere(0.100, 0.1000f, -0.25f, 0.02f),
-        Sphere(0.100, 0.1000f, -0.30f, 0.02f),
-        Sphere(0.100, 0.1000f, -0.35f, 0.02f),
-        Sphere(0.100, 0.1000f, -0.40f, 0.02f),
-
-        Sphere(0.2f, 0.1000f, 0.4, 0.02f),
-        Sphere(0.2f, 0.1000f, -0.4f, 0.02f),
-        Sphere(0.2f, 0.1000f, 0.35f, 0.02f),
-        Sphere(0.2f, 0.1000f, 0.30f, 0.02f),
-        Sphere(0.2f, 0.1000f, 0.25f, 0.02f),
-        Sphere(0.2f, 0.1000f, 0.20f, 0.02f),
-        Sphere(0.2f, 0.1000f, 0.15f, 0.02f),
-        Sphere(0.2f, 0.1000f, 0.10f, 0.02f),
-        Sphere(0.2f, 0.1000f, 0.05f, 0.02f),
-        Sphere(0.2f, 0.1000f, 0.00f, 0.02f),
-        Sphere(0.2f, 0.1000f, -0.05f, 0.02f),
-        Sphere(0.2f, 0.1000f, -0.10f, 0.02f),
-        Sphere(0.2f, 0.1000f, -0.15f, 0.02f),
-        Sphere(0.2f, 0.1000f, -0.2f, 0.02f),
-        Sphere(0.2f, 0.1000f, -0.25f, 0.02f),
-        Sphere(0.2f, 0.1000f, -0.30f, 0.02f),
-        Sphere(0.2f, 0.1000f, -0.35f, 0.02f),
-        Sphere(0.2f, 0.1000f, -0.40f, 0.02f),
-
-        Sphere(0.300f, 0.1000f, 0.4, 0.02f),
-        Sphere(0.300f, 0.1000f, -0.4f, 0.02f),
-        Sphere(0.300f, 0.1000f, 0.35f, 0.02f),
-        Sphere(0.300f, 0.1000f, 0.30f, 0.02f),
-        Sphere(0.300f, 0.1000f, 0.25f, 0.02f),
-        Sphere(0.300f, 0.1000f, 0.20f, 0.02f),
-        Sphere(0.300f, 0.1000f, 0.15f, 0.02f),
-        Sphere(0.300f, 0.1000f, 0.10f, 0.02f),
-        Sphere(0.300f, 0.1000f, 0.05f, 0.02f),
-        Sphere(0.300f, 0.1000f, 0.00f, 0.02f),
-        Sphere(0.300f, 0.1000f, -0.05f, 0.02f),
-        Sphere(0.300f, 0.1000f, -0.10f, 0.02f),
-        Sphere(0.300f, 0.1000f, -0.15f, 0.02f),
-        Sphere(0.300f, 0.1000f, -0.2f, 0.02f),
-        Sphere(0.300f, 0.1000f, -0.25f, 0.02f),
-        Sphere(0.300f, 0.1000f, -0.30f, 0.02f),
-        Sphere(0.300f, 0.1000f, -0.35f, 0.02f),
-        Sphere(0.300f, 0.1000f, -0.40f, 0.02f),
-
-        Sphere(0.400f, 0.1000f, 0.4, 0.02f),
-        Sphere(0.400f, 0.1000f, -0.4f, 0.02f),
-        Sphere(0.400f, 0.1000f, 0.35f, 0.02f),
-        Sphere(0.400f, 0.1000f, 0.30f, 0.02f),
-        Sphere(0.400f, 0.1000f, 0.25f, 0.02f),
-        Sphere(0.400f, 0.1000f, 0.20f, 0.02f),
-        Sphere(0.400f, 0.1000f, 0.15f, 0.02f),
-        Sphere(0.400f, 0.1000f, 0.10f, 0.02f),
-        Sphere(0.400f, 0.1000f, 0.05f, 0.02f),
-        Sphere(0.400f, 0.1000f, 0.00f, 0.02f),
-        Sphere(0.400f, 0.1000f, -0.05f, 0.02f),
-        Sphere(0.400f, 0.1000f, -0.10f, 0.02f),
-        Sphere(0.400f, 0.1000f, -0.15f, 0.02f),
-        Sphere(0.400f, 0.1000f, -0.2f, 0.02f),
-        Sphere(0.400f, 0.1000f, -0.25f, 0.02f),
-        Sphere(0.400f, 0.1000f, -0.30f, 0.02f),
-        Sphere(0.400f, 0.1000f, -0.35f, 0.02f),
-        Sphere(0.400f, 0.1000f, -0.40f, 0.02f),
- 
-        
-
-
-
-
-
-        Sphere(0.100, 0.2000f, 0.4, 0.02f),
-        Sphere(0.100, 0.2000f, -0.4f, 0.02f),
-        Sphere(0.100, 0.2000f, 0.35f, 0.02f),
-        Sphere(0.100, 0.2000f, 0.30f, 0.02f),
-        Sphere(0.100, 0.2000f, 0.25f, 0.02f),
-        Sphere(0.100, 0.2000f, 0.20f, 0.02f),
-        Sphere(0.100, 0.2000f, 0.15f, 0.02f),
-        Sphere(0.100, 0.2000f, 0.10f, 0.02f),
-        Sphere(0.100, 0.2000f, 0.05f, 0.02f),
-        Sphere(0.100, 0.2000f, 0.00f, 0.02f),
-        Sphere(0.100, 0.2000f, -0.05f, 0.02f),
-        Sphere(0.100, 0.2000f, -0.10f, 0.02f),
-        Sphere(0.100, 0.2000f, -0.15f, 0.02f),
-        Sphere(0.100, 0.2000f, -0.2f, 0.02f),
-        Sphere(0.100, 0.2000f, -0.25f, 0.02f),
-        Sphere(0.100, 0.2000f, -0.30f, 0.02f),
-        Sphere(0.100, 0.2000f, -0.35f, 0.02f),
-        Sphere(0.100, 0.2000f, -0.40f, 0.02f),
-
-        Sphere(0.2f, 0.2000f, 0.4, 0.02f),
-        Sphere(0.2f, 0.2000f, -0.4f, 0.02f),
-        Sphere(0.2f, 0.2000f, 0.35f, 0.02f),
-        Sphere(0.2f, 0.2000f, 0.30f, 0.02f),
-        Sphere(0.2f, 0.2000f, 0.25f, 0.02f),
-        Sphere(0.2f, 0.2000f, 0.20f, 0.02f),
-        Sphere(0.2f, 0.2000f, 0.15f, 0.02f),
-        Sphere(0.2f, 0.2000f, 0.10f, 0.02f),
-        Sphere(0.2f, 0.2000f, 0.05f, 0.02f),
-        Sphere(0.2f, 0.2000f, 0.00f, 0.02f),
-        Sphere(0.2f, 0.2000f, -0.05f, 0.02f),
-        Sphere(0.2f, 0.2000f, -0.10f, 0.02f),
-        Sphere(0.2f, 0.2000f, -0.15f, 0.02f),
-        Sphere(0.2f, 0.2000f, -0.2f, 0.02f),
-        Sphere(0.2f, 0.2000f, -0.25f, 0.02f),
-        Sphere(0.2f, 0.2000f, -0.30f, 0.02f),
-        Sphere(0.2f, 0.2000f, -0.35f, 0.02f),
-        Sphere(0.2f, 0.2000f, -0.40f, 0.02f),
-
-        Sphere(0.300f, 0.2000f, 0.4, 0.02f),
-        Sphere(0.300f, 0.2000f, -0.4f, 0.02f),
-        Sphere(0.300f, 0.2000f, 0.35f, 0.02f),
-        Sphere(0.300f, 0.2000f, 0.30f, 0.02f),
-        Sphere(0.300f, 0.2000f, 0.25f, 0.02f),
-        Sphere(0.300f, 0.2000f, 0.20f, 0.02f),
-        Sphere(0.300f, 0.2000f, 0.15f, 0.02f),
-        Sphere(0.300f, 0.2000f, 0.10f, 0.02f),
-        Sphere(0.300f, 0.2000f, 0.05f, 0.02f),
-        Sphere(0.300f, 0.2000f, 0.00f, 0.02f),
-        Sphere(0.300f, 0.2000f, -0.05f, 0.02f),
-        Sphere(0.300f, 0.2000f, -0.10f, 0.02f),
-        Sphere(0.300f, 0.2000f, -0.15f, 0.02f),
-        Sphere(0.300f, 0.2000f, -0.2f, 0.02f),
-        Sphere(0.300f, 0.2000f, -0.25f, 0.02f),
-        Sphere(0.300f, 0.2000f, -0.30f, 0.02f),
-        Sphere(0.300f, 0.2000f, -0.35f, 0.02f),
-        Sphere(0.300f, 0.2000f, -0.40f, 0.02f),
-
-        Sphere(0.400f, 0.2000f, 0.4, 0.02f),
-        Sphere(0.400f, 0.2000f, -0.4f, 0.02f),
-        Sphere(0.400f, 0.2000f, 0.35f, 0.02f),
-        Sphere(0.400f, 0.2000f, 0.30f, 0.02f),
-        Sphere(0.400f, 0.2000f, 0.25f, 0.02f),
-        Sphere(0.400f, 0.2000f, 0.20f, 0.02f),
-        Sphere(0.400f, 0.2000f, 0.15f, 0.02f),
-        Sphere(0.400f, 0.2000f, 0.10f, 0.02f),
-        Sphere(0.400f, 0.2000f, 0.05f, 0.02f),
-        Sphere(0.400f, 0.2000f, 0.00f, 0.02f),
-        Sphere(0.400f, 0.2000f, -0.05f, 0.02f),
-        Sphere(0.400f, 0.2000f, -0.10f, 0.02f),
-        Sphere(0.400f, 0.2000f, -0.15f, 0.02f),
-        Sphere(0.400f, 0.2000f, -0.2f, 0.02f),
-        Sphere(0.400f, 0.2000f, -0.25f, 0.02f),
-        Sphere(0.400f, 0.2000f, -0.30f, 0.02f),
-        Sphere(0.400f, 0.2000f, -0.35f, 0.02f),
-        Sphere(0.400f, 0.2000f, -0.40f, 0.02f),
-
-
-
-
-
-
-
-
-
-
-
-
-        Sphere(0.100, 0.30000, 0.4, 0.02f),
-        Sphere(0.100, 0.30000, -0.4f, 0.02f),
-        Sphere(0.100, 0.30000, 0.35f, 0.02f),
-        Sphere(0.100, 0.30000, 0.30f, 0.02f),
-        Sphere(0.100, 0.30000, 0.25f, 0.02f),
-        Sphere(0.100, 0.30000, 0.20f, 0.02f),
-        Sphere(0.100, 0.30000, 0.15f, 0.02f),
-        Sphere(0.100, 0.30000, 0.10f, 0.02f),
-        Sphere(0.100, 0.30000, 0.05f, 0.02f),
-        Sphere(0.100, 0.30000, 0.00f, 0.02f),
-        Sphere(0.100, 0.30000, -0.05f, 0.02f),
-        Sphere(0.100, 0.30000, -0.10f, 0.02f),
-        Sphere(0.100, 0.30000, -0.15f, 0.02f),
-        Sphere(0.100, 0.30000, -0.2f, 0.02f),
-        Sphere(0.100, 0.30000, -0.25f, 0.02f),
-        Sphere(0.100, 0.30000, -0.30f, 0.02f),
-        Sphere(0.100, 0.30000, -0.35f, 0.02f),
-        Sphere(0.100, 0.30000, -0.40f, 0.02f),
-
-        Sphere(0.2f, 0.30000, 0.4, 0.02f),
-        Sphere(0.2f, 0.30000, -0.4f, 0.02f),
-        Sphere(0.2f, 0.30000, 0.35f, 0.02f),
-        Sphere(0.2f, 0.30000, 0.30f, 0.02f),
-        Sphere(0.2f, 0.30000, 0.25f, 0.02f),
-        Sphere(0.2f, 0.30000, 0.20f, 0.02f),
-        Sphere(0.2f, 0.30000, 0.15f, 0.02f),
-        Sphere(0.2f, 0.30000, 0.10f, 0.02f),
-        Sphere(0.2f, 0.30000, 0.05f, 0.02f),
-        Sphere(0.2f, 0.30000, 0.00f, 0.02f),
-        Sphere(0.2f, 0.30000, -0.05f, 0.02f),
-        Sphere(0.2f, 0.30000, -0.10f, 0.02f),
-        Sphere(0.2f, 0.30000, -0.15f, 0.02f),
-        Sphere(0.2f, 0.30000, -0.2f, 0.02f),
-        Sphere(0.2f, 0.30000, -0.25f, 0.02f),
-        Sphere(0.2f, 0.30000, -0.30f, 0.02f),
-        Sphere(0.2f, 0.30000, -0.35f, 0.02f),
-        Sphere(0.2f, 0.30000, -0.40f, 0.02f),
-
-        Sphere(0.300f, 0.30000, 0.4, 0.02f),
-        Sphere(0.300f, 0.30000, -0.4f, 0.02f),
-        Sphere(0.300f, 0.30000, 0.35f, 0.02f),
-        Sphere(0.300f, 0.30000, 0.30f, 0.02f),
-        Sphere(0.300f, 0.30000, 0.25f, 0.02f),
-        Sphere(0.300f, 0.30000, 0.20f, 0.02f),
-        Sphere(0.300f, 0.30000, 0.15f, 0.02f),
-        Sphere(0.300f, 0.30000, 0.10f, 0.02f),
-        Sphere(0.300f, 0.30000, 0.05f, 0.02f),
-        Sphere(0.300f, 0.30000, 0.00f, 0.02f),
-        Sphere(0.300f, 0.30000, -0.05f, 0.02f),
-        Sphere(0.300f, 0.30000, -0.10f, 0.02f),
-        Sphere(0.300f, 0.30000, -0.15f, 0.02f),
-        Sphere(0.300f, 0.30000, -0.2f, 0.02f),
-        Sphere(0.300f, 0.30000, -0.25f, 0.02f),
-        Sphere(0.300f, 0.30000, -0.30f, 0.02f),
-        Sphere(0.300f, 0.30000, -0.35f, 0.02f),
-        Sphere(0.300f, 0.30000, -0.40f, 0.02f),
-
-        Sphere(0.400f, 0.30000, 0.4, 0.02f),
-        Sphere(0.400f, 0.30000, -0.4f, 0.02f),
-        Sphere(0.400f, 0.30000, 0.35f, 0.02f),
-        Sphere(0.400f, 0.30000, 0.30f, 0.02f),
-        Sphere(0.400f, 0.30000, 0.25f, 0.02f),
-        Sphere(0.400f, 0.30000, 0.20f, 0.02f),
-        Sphere(0.400f, 0.30000, 0.15f, 0.02f),
-        Sphere(0.400f, 0.30000, 0.10f, 0.02f),
-        Sphere(0.400f, 0.30000, 0.05f, 0.02f),
-        Sphere(0.400f, 0.30000, 0.00f, 0.02f),
-        Sphere(0.400f, 0.30000, -0.05f, 0.02f),
-        Sphere(0.400f, 0.30000, -0.10f, 0.02f),
-        Sphere(0.400f, 0.30000, -0.15f, 0.02f),
-        Sphere(0.400f, 0.30000, -0.2f, 0.02f),
-        Sphere(0.400f, 0.30000, -0.25f, 0.02f),
-        Sphere(0.400f, 0.30000, -0.30f, 0.02f),
-        Sphere(0.400f, 0.30000, -0.35f, 0.02f),
-        Sphere(0.400f, 0.30000, -0.40f, 0.02f),
-
-
-
-
-
-
-        Sphere(0.100, 0.4000f, 0.4, 0.02f),
-        Sphere(0.100, 0.4000f, -0.4f, 0.02f),
-        Sphere(0.100, 0.4000f, 0.35f, 0.02f),
-        Sphere(0.100, 0.4000f, 0.30f, 0.02f),
-        Sphere(0.100, 0.4000f, 0.25f, 0.02f),
-        Sphere(0.100, 0.4000f, 0.20f, 0.02f),
-        Sphere(0.100, 0.4000f, 0.15f, 0.02f),
-        Sphere(0.100, 0.4000f, 0.10f, 0.02f),
-        Sphere(0.100, 0.4000f, 0.05f, 0.02f),
-        Sphere(0.100, 0.4000f, 0.00f, 0.02f),
-        Sphere(0.100, 0.4000f, -0.05f, 0.02f),
-        Sphere(0.100, 0.4000f, -0.10f, 0.02f),
-        Sphere(0.100, 0.4000f, -0.15f, 0.02f),
-        Sphere(0.100, 0.4000f, -0.2f, 0.02f),
-        Sphere(0.100, 0.4000f, -0.25f, 0.02f),
-        Sphere(0.100, 0.4000f, -0.30f, 0.02f),
-        Sphere(0.100, 0.4000f, -0.35f, 0.02f),
-        Sphere(0.100, 0.4000f, -0.40f, 0.02f),
-
-        Sphere(0.2f, 0.4000f, 0.4, 0.02f),
-        Sphere(0.2f, 0.4000f, -0.4f, 0.02f),
-        Sphere(0.2f, 0.4000f, 0.35f, 0.02f),
-        Sphere(0.2f, 0.4000f, 0.30f, 0.02f),
-        Sphere(0.2f, 0.4000f, 0.25f, 0.02f),
-        Sphere(0.2f, 0.4000f, 0.20f, 0.02f),
-        Sphere(0.2f, 0.4000f, 0.15f, 0.02f),
-        Sphere(0.2f, 0.4000f, 0.10f, 0.02f),
-        Sphere(0.2f, 0.4000f, 0.05f, 0.02f),
-        Sphere(0.2f, 0.4000f, 0.00f, 0.02f),
-        Sphere(0.2f, 0.4000f, -0.05f, 0.02f),
-        Sphere(0.2f, 0.4000f, -0.10f, 0.02f),
-        Sphere(0.2f, 0.4000f, -0.15f, 0.02f),
-        Sphere(0.2f, 0.4000f, -0.2f, 0.02f),
-        Sphere(0.2f, 0.4000f, -0.25f, 0.02f),
-        Sphere(0.2f, 0.4000f, -0.30f, 0.02f),
-        Sphere(0.2f, 0.4000f, -0.35f, 0.02f),
-        Sphere(0.2f, 0.4000f, -0.40f, 0.02f),
-
-        Sphere(0.300f, 0.4000f, 0.4, 0.02f),
-        Sphere(0.300f, 0.4000f, -0.4f, 0.02f),
-        Sphere(0.300f, 0.4000f, 0.35f, 0.02f),
-        Sphere(0.300f, 0.4000f, 0.30f, 0.02f),
-        Sphere(0.300f, 0.4000f, 0.25f, 0.02f),
-        Sphere(0.300f, 0.4000f, 0.20f, 0.02f),
-        Sphere(0.300f, 0.4000f, 0.15f, 0.02f),
-        Sphere(0.300f, 0.4000f, 0.10f, 0.02f),
-        Sphere(0.300f, 0.4000f, 0.05f, 0.02f),
-        Sphere(0.300f, 0.4000f, 0.00f, 0.02f),
-        Sphere(0.300f, 0.4000f, -0.05f, 0.02f),
-        Sphere(0.300f, 0.4000f, -0.10f, 0.02f),
-        Sphere(0.300f, 0.4000f, -0.15f, 0.02f),
-        Sphere(0.300f, 0.4000f, -0.2f, 0.02f),
-        Sphere(0.300f, 0.4000f, -0.25f, 0.02f),
-        Sphere(0.300f, 0.4000f, -0.30f, 0.02f),
-        Sphere(0.300f, 0.4000f, -0.35f, 0.02f),
-        Sphere(0.300f, 0.4000f, -0.40f, 0.02f),
-
-        Sphere(0.400f, 0.4000f, 0.4, 0.02f),
-        Sphere(0.400f, 0.4000f, -0.4f, 0.02f),
-        Sphere(0.400f, 0.4000f, 0.35f, 0.02f),
-        Sphere(0.400f, 0.4000f, 0.30f, 0.02f),
-        Sphere(0.400f, 0.4000f, 0.25f, 0.02f),
-        Sphere(0.400f, 0.4000f, 0.20f, 0.02f),
-        Sphere(0.400f, 0.4000f, 0.15f, 0.02f),
-        Sphere(0.400f, 0.4000f, 0.10f, 0.02f),
-        Sphere(0.400f, 0.4000f, 0.05f, 0.02f),
-        Sphere(0.400f, 0.4000f, 0.00f, 0.02f),
-        Sphere(0.400f, 0.4000f, -0.05f, 0.02f),
-        Sphere(0.400f, 0.4000f, -0.10f, 0.02f),
-        Sphere(0.400f, 0.4000f, -0.15f, 0.02f),
-        Sphere(0.400f, 0.4000f, -0.2f, 0.02f),
-        Sphere(0.400f, 0.4000f, -0.25f, 0.02f),
-        Sphere(0.400f, 0.4000f, -0.30f, 0.02f),
-        Sphere(0.400f, 0.4000f, -0.35f, 0.02f),
-        Sphere(0.400f, 0.4000f, -0.40f, 0.02f),
-
+    PhotonBatch photons(options.batchSize, options.mode, PhotonBatch::UNLIMITED, options.seed);
+    photons.interaction = options.interaction;
+    photons.regroupInterval = options.regroupInterval;
+    PhotonTrails trails;  // Only touched by the simulation thread
+    TrailRing trailRing;
+    HeatmapSnapshot heatmapSnapshot;
+    EventLog eventLog(pool.size());
+    if (!openEventLog(options, eventLog))
+        return -1;
+    if (eventLog.enabled()) {
+        photons.eventLog = &eventLog;
+        eventLog.start();
+    }
 
+    // Trail segments stream through a triple-buffered ring the simulation
+    // thread writes directly
+    trailRing.init(MAX_TRAIL_PHOTONS * (TRAIL_POINTS - 1) * 2);
 
+    // Packed sphere table plus the acceleration structure used for collisions
+    SphereScene sphereScene(scene, options.accel, options.gridResolution);
 
+    // With --gpu the photons live in GPU buffers and the compute shader is
+    // dispatched from the render loop instead of running the CPU batch
+    GpuPhotonEngine gpu;
+    if (options.gpu && !gpu.init(sphereScene.table, options.batchSize, options.mode, options.gridResolution,
+                                 PhotonBatch::UNLIMITED, options.seed)) {
+        gpu.release();
+        glfwTerminate();
+        return -1;
+    }
+    double gpuStepsOwed = 0.0;
+    double lastFrameTime = glfwGetTime();
+    double lastCounterRead = lastFrameTime;
+
+    // The simulation runs on its own thread at a fixed tick rate, independent
+    // of the display's refresh rate; the render loop only reads the snapshot
+    std::atomic<bool> simulationRunning(!options.gpu);
+    std::thread simulationThread([&]() {
+        const std::chrono::duration<double> tickInterval(options.tickRate > 0.0 ? 1.0 / options.tickRate : 0.0);
+        auto nextTick = std::chrono::steady_clock::now();
+        while (simulationRunning.load(std::memory_order_relaxed)) {
+            if (options.tickRate > 0.0) {
+                std::this_thread::sleep_until(nextTick);
+                nextTick += std::chrono::duration_cast<std::chrono::steady_clock::duration>(tickInterval);
+                // After a stall, resume the fixed rate instead of bursting to catch up
+                auto now = std::chrono::steady_clock::now();
+                if (now - nextTick > std::chrono::milliseconds(250))
+                    nextTick = now;
+            }
+            photons.update(sphereScene, &pool);
+            PHOTON_PROFILE_SCOPE("sim.publish");
+            photons.recordTrails(trails, MAX_TRAIL_PHOTONS);
+            trailRing.publish(trails.write(trailRing.writeRegion()));
+            photons.publish(heatmapSnapshot);
+        }
+    });
+
+    // Upload the shared unit-sphere mesh once. The per-instance buffer holds
+    // the spheres inside the view frustum (already laid out as
+    // vec4(center, radius)) grouped by level of detail; it is rebuilt only
+    // when the camera moves.
+    const SphereMesh& sphereMesh = SphereMesh::shared();
+
+    GLuint sphereVAO, sphereMeshVBO, sphereInstanceVBO;
+    glGenVertexArrays(1, &sphereVAO);
+    glGenBuffers(1, &sphereMeshVBO);
+    glGenBuffers(1, &sphereInstanceVBO);
+
+    glBindVertexArray(sphereVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, sphereMeshVBO);
+    glBufferData(GL_ARRAY_BUFFER, sphereMesh.vertices.size() * sizeof(float),
+                 sphereMesh.vertices.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(0);
 
+    glBindBuffer(GL_ARRAY_BUFFER, sphereInstanceVBO);
+    glBufferData(GL_ARRAY_BUFFER, scene.count * sizeof(Sphere), nullptr, GL_DYNAMIC_DRAW);
+    glVertexAttribDivisor(1, 1);  // Advance once per sphere, not per vertex
+    glEnableVertexAttribArray(1);
+
+    // Scene index of each instance, grouped like the instances, for the heatmap
+    GLuint sphereIndexVBO;
+    glGenBuffers(1, &sphereIndexVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, sphereIndexVBO);
+    glBufferData(GL_ARRAY_BUFFER, scene.count * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
+    glVertexAttribDivisor(2, 1);
+    glEnableVertexAttribArray(2);
+
+    // Heatmap: tally counts live in texture buffers that only receive the
+    // ranges the simulation changed; face cells get their own quads
+    GLuint heatBuffers[2], heatTextures[2];  // Per sphere, per face cell
+    glGenBuffers(2, heatBuffers);
+    glGenTextures(2, heatTextures);
+    const size_t heatSizes[2] = { std::max<size_t>(1, scene.count), (size_t)FACE_COUNT * GRID_SIZE * GRID_SIZE };
+    for (int k = 0; k < 2; k++) {
+        glBindBuffer(GL_TEXTURE_BUFFER, heatBuffers[k]);
+        std::vector<float> zeros(heatSizes[k], 0.0f);
+        glBufferData(GL_TEXTURE_BUFFER, zeros.size() * sizeof(float), zeros.data(), GL_DYNAMIC_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, heatTextures[k]);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, heatBuffers[k]);
+    }
 
+    std::vector<float> faceCellVertices;
+    addFaceCells(faceCellVertices, halfSize);
+    GLuint faceVAO, faceVBO;
+    glGenVertexArrays(1, &faceVAO);
+    glGenBuffers(1, &faceVBO);
+    glBindVertexArray(faceVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, faceVBO);
+    glBufferData(GL_ARRAY_BUFFER, faceCellVertices.size() * sizeof(float), faceCellVertices.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(3 * sizeof(float)));
+    glEnableVertexAttribArray(2);
+
+    bool heatmapEnabled = false;
+    bool heatmapKeyDown = false;
+    float heatScale[2] = { 0.0f, 0.0f };
+
+    // With base instances the per-level draws come straight from an indirect
+    // buffer in one call; GL 3.3 falls back to one instanced draw per level
+    SphereCuller culler(scene.count);
+    glm::vec3 cullCamera(std::numeric_limits<float>::infinity());
+    int cullFramebufferHeight = 0;
+    bool indirectDraw = GLEW_VERSION_4_3 || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance);
+    GLuint sphereDrawBuffer = 0;
+    if (indirectDraw) {
+        glGenBuffers(1, &sphereDrawBuffer);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, sphereDrawBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(culler.commands), culler.commands, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        glBindVertexArray(sphereVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, sphereInstanceVBO);
+        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(Sphere), (void*)0);
+        glBindBuffer(GL_ARRAY_BUFFER, sphereIndexVBO);
+        glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(float), (void*)0);
+    }
 
-    };
 
-    // Create sphere buffers
-    std::vector<GLuint> sphereVAOs(spheres.size());
-    std::vector<GLuint> sphereVBOs(spheres.size());
-    glGenVertexArrays(spheres.size(), sphereVAOs.data());
-    glGenBuffers(spheres.size(), sphereVBOs.data());
-
-    for(size_t i = 0; i < spheres.size(); i++) {
-        glBindVertexArray(sphereVAOs[i]);
-        glBindBuffer(GL_ARRAY_BUFFER, sphereVBOs[i]);
-        glBufferData(GL_ARRAY_BUFFER, spheres[i].vertices.size() * sizeof(float), 
-                    spheres[i].vertices.data(), GL_STATIC_DRAW);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-        glEnableVertexAttribArray(0);
-    }
+    // Profiling builds time the draw and compute work on the GPU and show a
+    // HUD of the section timings (P toggles the bars)
+    GpuTimer gpuDrawTimer, gpuComputeTimer;
+    gpuDrawTimer.init("gpu.draw");
+    gpuComputeTimer.init("gpu.compute");
+    TimingHud hud;
+    hud.init();
+    bool hudEnabled = true;
+    bool hudKeyDown = false;
 
-    GLuint isSphereLocation = glGetUniformLocation(shaderProgram, "isSphere");
+    // The projection never changes; the view only when the arrow keys turn the camera
+    const float fieldOfView = glm::radians(45.0f);
+    renderer.setProjection(glm::perspective(fieldOfView, 1.0f, 0.1f, 100.0f));
+    bool cameraMoved = true;
+    glm::vec3 cameraPosition(0.0f);
 
     // Main loop
     while (!glfwWindowShouldClose(window)) {
+        PHOTON_PROFILE_SCOPE("frame");
+
         // Handle keyboard input
+        float previousTheta = cameraTheta, previousPhi = cameraPhi;
         if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS)
             cameraTheta += rotationSpeed;
         if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS)
@@ -809,85 +1592,213 @@ int main() {
             cameraPhi = std::max(1.0f, cameraPhi - rotationSpeed);
         if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS)
             cameraPhi = std::min(179.0f, cameraPhi + rotationSpeed);
+        cameraMoved = cameraMoved || cameraTheta != previousTheta || cameraPhi != previousPhi;
+        bool heatmapKey = glfwGetKey(window, GLFW_KEY_H) == GLFW_PRESS;
+        if (heatmapKey && !heatmapKeyDown)
+            heatmapEnabled = !heatmapEnabled;  // H toggles the hit-density overlay
+        heatmapKeyDown = heatmapKey;
+        bool hudKey = glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS;
+        if (hudKey && !hudKeyDown)
+            hudEnabled = !hudEnabled;
+        hudKeyDown = hudKey;
+
+        if (heatmapEnabled) {
+            // Upload only what changed since the last frame
+            PHOTON_PROFILE_SCOPE("frame.upload");
+            std::lock_guard<std::mutex> lock(heatmapSnapshot.mutex);
+            if (heatmapSnapshot.dirtyBegin < heatmapSnapshot.dirtyEnd) {
+                glBindBuffer(GL_TEXTURE_BUFFER, heatBuffers[0]);
+                glBufferSubData(GL_TEXTURE_BUFFER, heatmapSnapshot.dirtyBegin * sizeof(float),
+                                (heatmapSnapshot.dirtyEnd - heatmapSnapshot.dirtyBegin) * sizeof(float),
+                                heatmapSnapshot.sphereHits.data() + heatmapSnapshot.dirtyBegin);
+                heatmapSnapshot.dirtyBegin = heatmapSnapshot.dirtyEnd = 0;
+            }
+            if (heatmapSnapshot.facesDirty) {
+                glBindBuffer(GL_TEXTURE_BUFFER, heatBuffers[1]);
+                glBufferSubData(GL_TEXTURE_BUFFER, 0, heatmapSnapshot.faceExits.size() * sizeof(float),
+                                heatmapSnapshot.faceExits.data());
+                heatmapSnapshot.facesDirty = false;
+            }
+            heatScale[0] = 1.0f / std::log(2.0f + heatmapSnapshot.maxSphereHits);
+            heatScale[1] = 1.0f / std::log(2.0f + heatmapSnapshot.maxFaceExits);
+        }
 
-        ray.update(spheres);
+        if (options.gpu) {
+            // Fixed timestep on the GPU too: dispatch as many steps as the
+            // tick rate owes for the time since the last frame
+            double now = glfwGetTime();
+            gpuStepsOwed += options.tickRate > 0.0 ? (now - lastFrameTime) * options.tickRate : GPU_STEPS_PER_DISPATCH;
+            lastFrameTime = now;
+            unsigned steps = (unsigned)std::min<double>(gpuStepsOwed, GPU_STEPS_PER_DISPATCH);
+            gpuStepsOwed = std::min<double>(gpuStepsOwed - steps, GPU_STEPS_PER_DISPATCH);
+            if (steps > 0) {
+                gpuComputeTimer.begin();
+                gpu.dispatch(steps);
+                gpuComputeTimer.end();
+            }
+            if (now - lastCounterRead > 1.0) {
+                gpu.readCounters();  // Stalls on the GPU, so only once a second
+                lastCounterRead = now;
+            }
+        }
 
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
-        glUseProgram(shaderProgram);
-
-        // Create transformation matrices
-        glm::mat4 model = glm::mat4(1.0f);
-        // No translation needed since grid is already centered
-
-        // Calculate camera position using spherical coordinates
-        float x = cameraRadius * sin(glm::radians(cameraPhi)) * cos(glm::radians(cameraTheta));
-        float y = cameraRadius * cos(glm::radians(cameraPhi));
-        float z = cameraRadius * sin(glm::radians(cameraPhi)) * sin(glm::radians(cameraTheta));
-
-        glm::mat4 view = glm::lookAt(
-            glm::vec3(x, y, z),  // Camera position
-            glm::vec3(0.0f, 0.0f, 0.0f),  // Look at center
-            glm::vec3(0.0f, 1.0f, 0.0f)   // Up vector
-        );
-
-        glm::mat4 projection = glm::perspective(glm::radians(45.0f), 1.0f, 0.1f, 100.0f);
-
-        // Set uniforms
-        GLuint modelLoc = glGetUniformLocation(shaderProgram, "model");
-        GLuint viewLoc = glGetUniformLocation(shaderProgram, "view");
-        GLuint projectionLoc = glGetUniformLocation(shaderProgram, "projection");
-
-        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-        glUniformMatrix4fv(projectionLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-        // Draw grid
-        glUniform1i(isRayLocation, 0);  // This is grid, not ray
-        glUniform1i(isSphereLocation, 0);
-        glBindVertexArray(VAO);
-        glDrawArrays(GL_LINES, 0, vertices.size() / 3);
-
-        // Update and draw ray
-        glUniform1i(isRayLocation, 1);  // This is ray
-        glUniform1i(isSphereLocation, 0);  // Not a sphere
-        glBindVertexArray(rayVAO);
-        
-        float endX, endY, endZ;
-        ray.getEndPoint(endX, endY, endZ);
-        
-        float rayVertices[] = {
-            0.0f, 0.0f, 0.0f,     // Start at center
-            endX, endY, endZ      // End at calculated point
-        };
-        
-        glBindBuffer(GL_ARRAY_BUFFER, rayVBO);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(rayVertices), rayVertices);
-        glDrawArrays(GL_LINES, 0, 2);
-
-        // Draw spheres
-        glUniform1i(isRayLocation, 0);  // Not a ray
-        glUniform1i(isSphereLocation, 1);  // This is a sphere
-        for(size_t i = 0; i < sphereVAOs.size(); i++) {
-            glBindVertexArray(sphereVAOs[i]);
-            glDrawArrays(GL_TRIANGLE_STRIP, 0, spheres[i].vertices.size() / 3);
-        }
-
-        glfwSwapBuffers(window);
+        renderer.use();
+
+        if (cameraMoved) {
+            // Calculate camera position using spherical coordinates
+            float x = cameraRadius * sin(glm::radians(cameraPhi)) * cos(glm::radians(cameraTheta));
+            float y = cameraRadius * cos(glm::radians(cameraPhi));
+            float z = cameraRadius * sin(glm::radians(cameraPhi)) * sin(glm::radians(cameraTheta));
+            cameraPosition = glm::vec3(x, y, z);
+            renderer.setView(glm::lookAt(
+                cameraPosition,
+                glm::vec3(0.0f, 0.0f, 0.0f),  // Look at center
+                glm::vec3(0.0f, 1.0f, 0.0f)   // Up vector
+            ));
+            cameraMoved = false;
+        }
+
+        // Cull and regroup the spheres when the camera or the window has changed
+        int framebufferWidth = 0, framebufferHeight = 0;
+        glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+        if (cameraPosition != cullCamera || framebufferHeight != cullFramebufferHeight) {
+            PHOTON_PROFILE_SCOPE("frame.upload");
+            cullCamera = cameraPosition;
+            cullFramebufferHeight = framebufferHeight;
+            float pixelsPerUnit = framebufferHeight / (2.0f * std::tan(fieldOfView / 2.0f));
+            culler.cull(scene, renderer.projection * renderer.view, cameraPosition, pixelsPerUnit);
+
+            if (culler.visible > 0) {
+                glBindBuffer(GL_ARRAY_BUFFER, sphereInstanceVBO);
+                glBufferSubData(GL_ARRAY_BUFFER, 0, culler.visible * sizeof(Sphere), culler.instances.data());
+                glBindBuffer(GL_ARRAY_BUFFER, sphereIndexVBO);
+                glBufferSubData(GL_ARRAY_BUFFER, 0, culler.visible * sizeof(float), culler.indices.data());
+            }
+            if (indirectDraw) {
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, sphereDrawBuffer);
+                glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, sizeof(culler.commands), culler.commands);
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+            }
+        }
+
+        // Draw the scene; the GPU timer measures execution, the scope only submission
+        {
+            PHOTON_PROFILE_SCOPE("frame.draw");
+            gpuDrawTimer.begin();
+
+            // Draw grid
+            glUniform1i(renderer.isRayLocation, 0);  // This is grid, not ray
+            glUniform1i(renderer.isSphereLocation, 0);
+            glBindVertexArray(VAO);
+            glDrawArrays(GL_LINES, 0, vertices.size() / 3);
+
+            // Draw a sample of the batch's rays
+            glUniform1i(renderer.isRayLocation, 1);  // This is ray
+            glUniform1i(renderer.isSphereLocation, 0);  // Not a sphere
+            if (options.gpu) {
+                // Photon positions are drawn straight from the compute buffer
+                renderer.use();
+                gpu.drawPoints();
+            } else {
+                trailRing.draw();
+            }
+
+            // Draw spheres
+            glUniform1i(renderer.isRayLocation, 0);  // Not a ray
+            glUniform1i(renderer.isSphereLocation, 1);  // This is a sphere
+            glUniform1i(renderer.isInstancedLocation, 1);
+            glUniform1i(renderer.isHeatmapLocation, heatmapEnabled);
+            glUniform1f(renderer.heatScaleLocation, heatScale[0]);
+            glUniform1f(renderer.heatAlphaLocation, 1.0f);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_BUFFER, heatTextures[0]);
+            glBindVertexArray(sphereVAO);
+            if (indirectDraw && culler.visible > 0) {
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, sphereDrawBuffer);
+                glMultiDrawArraysIndirect(GL_TRIANGLE_STRIP, nullptr, SphereMesh::LEVELS, 0);
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+            } else if (!indirectDraw) {
+                for (int level = 0; level < SphereMesh::LEVELS; level++) {
+                    const DrawArraysIndirectCommand& command = culler.commands[level];
+                    if (command.instanceCount == 0)
+                        continue;
+                    // GL 3.3 has no base instance, so point the attributes at this level's run
+                    glBindBuffer(GL_ARRAY_BUFFER, sphereInstanceVBO);
+                    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(Sphere), (void*)(command.baseInstance * sizeof(Sphere)));
+                    glBindBuffer(GL_ARRAY_BUFFER, sphereIndexVBO);
+                    glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(float), (void*)(command.baseInstance * sizeof(float)));
+                    glDrawArraysInstanced(GL_TRIANGLE_STRIP, command.first, command.count, command.instanceCount);
+                }
+            }
+            glUniform1i(renderer.isInstancedLocation, 0);
+
+            // Translucent exit-count cells over the cube faces
+            if (heatmapEnabled) {
+                glUniform1f(renderer.heatScaleLocation, heatScale[1]);
+                glUniform1f(renderer.heatAlphaLocation, 0.5f);
+                glBindTexture(GL_TEXTURE_BUFFER, heatTextures[1]);
+                glEnable(GL_BLEND);
+                glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+                glDepthMask(GL_FALSE);
+                glBindVertexArray(faceVAO);
+                glDrawArrays(GL_TRIANGLES, 0, (GLsizei)(faceCellVertices.size() / 4));
+                glDepthMask(GL_TRUE);
+                glDisable(GL_BLEND);
+            }
+            glUniform1i(renderer.isHeatmapLocation, 0);
+            gpuDrawTimer.end();
+        }
+
+        if (PROFILING_ENABLED) {
+            if (hudEnabled)
+                hud.draw(renderer.isOverlayLocation, renderer.overlayColorLocation);
+            hud.updateTitle(window, glfwGetTime());
+        }
+
+        {
+            PHOTON_PROFILE_SCOPE("frame.swap");
+            glfwSwapBuffers(window);
+        }
         glfwPollEvents();
     }
 
+    simulationRunning = false;
+    simulationThread.join();
+    // A failed --tally or --trace is reported and fails the exit status, after cleanup
+    bool written = true;
+    if (options.gpu) {
+        gpu.readCounters();
+        std::cout << "GPU histories: " << gpu.histories() << " in " << gpu.ticks << " steps" << std::endl;
+    } else {
+        written = writeTally(options, photons.tally);
+    }
+    eventLog.stop();
+    written = writeTrace(options) && written;
+
     // Cleanup
-    glDeleteVertexArrays(1, &rayVAO);
-    glDeleteBuffers(1, &rayVBO);
+    trailRing.release();
+    hud.release();
+    gpuDrawTimer.release();
+    gpuComputeTimer.release();
     glDeleteVertexArrays(1, &VAO);
     glDeleteBuffers(1, &VBO);
-    glDeleteProgram(shaderProgram);
+    renderer.release();
 
         // Clean up sphere buffers
-    glDeleteVertexArrays(spheres.size(), sphereVAOs.data());
-    glDeleteBuffers(spheres.size(), sphereVBOs.data());
+    glDeleteVertexArrays(1, &sphereVAO);
+    glDeleteBuffers(1, &sphereMeshVBO);
+    glDeleteBuffers(1, &sphereInstanceVBO);
+    glDeleteBuffers(1, &sphereIndexVBO);
+    if (sphereDrawBuffer)
+        glDeleteBuffers(1, &sphereDrawBuffer);
+    glDeleteVertexArrays(1, &faceVAO);
+    glDeleteBuffers(1, &faceVBO);
+    glDeleteTextures(2, heatTextures);
+    glDeleteBuffers(2, heatBuffers);
+    gpu.release();
     glfwTerminate();
-    return 0;
+    return written ? 0 : -1;
 }
\ No newline at end of file
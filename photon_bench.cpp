@@ -0,0 +1,589 @@
+// photon_bench: photons/second and ns per photon-step for every intersection
+// backend, over a range of scene sizes and thread counts. Each run is one
+// CSV row (or one JSON object per line) so results can be diffed and
+// tracked across releases.
+#include "photon_engine.h"
+#ifdef PHOTON_BENCH_GPU
+#include "photon_gpu.h"
+#include <GLFW/glfw3.h>
+#endif
+#ifdef PHOTON_ENABLE_MPI
+#include "photon_mpi.h"
+#endif
+#include <new>
+#include <cstddef>
+
+// Bump when columns change meaning or are removed
+const int BENCH_FORMAT_VERSION = 1;
+
+const unsigned BENCH_MAX_WARMUP_ROUNDS = 64;  // Regroup periods to wait for allocations to stop
+
+// Every operator new in the process, from any thread, so the CPU runs can
+// report heap allocations per tick (the engine aims for none once warm).
+// The whole replaceable set is overridden, array and aligned forms
+// included, so nothing allocates past the counter and every delete matches.
+std::atomic<unsigned long long> heapAllocations(0);
+
+void* countedAllocation(size_t size, size_t alignment) {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (size == 0)
+        size = 1;
+    if (alignment <= alignof(std::max_align_t))
+        return std::malloc(size);
+    void* p = nullptr;
+    return posix_memalign(&p, alignment, size) == 0 ? p : nullptr;
+}
+
+void* countedAllocationOrThrow(size_t size, size_t alignment) {
+    if (void* p = countedAllocation(size, alignment))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size) {
+    return countedAllocationOrThrow(size, alignof(std::max_align_t));
+}
+
+void* operator new[](size_t size) {
+    return countedAllocationOrThrow(size, alignof(std::max_align_t));
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    return countedAllocationOrThrow(size, (size_t)alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return countedAllocationOrThrow(size, (size_t)alignment);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return countedAllocation(size, alignof(std::max_align_t));
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return countedAllocation(size, alignof(std::max_align_t));
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return countedAllocation(size, (size_t)alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return countedAllocation(size, (size_t)alignment);
+}
+
+// malloc and posix_memalign memory both go back through free()
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { std::free(p); }
+
+struct BenchOptions {
+    std::vector<size_t> sphereCounts;
+    std::vector<unsigned> threadCounts;
+    std::vector<std::string> backends;
+    std::vector<PropagationMode> modes;
+    size_t batchSize;
+    double minSeconds;         // Measure each configuration at least this long
+    size_t maxLinearSpheres;   // Linear scans are O(spheres) per query; skip above this
+    bool json;
+    std::string outputPath;    // Empty = stdout
+    uint64_t seed;
+    unsigned long long scalingPhotons;  // Strong-scaling budget over MPI ranks (0 = off)
+    InteractionSettings interaction;    // Applied to every CPU run
+    unsigned regroupInterval;           // CPU runs: ticks between photon regroup passes
+
+    BenchOptions() :
+        sphereCounts{ 360, 4096, 32768, 262144, 1000000 },
+        backends{ "linear-scalar", "linear-simd", "grid", "bvh", "lattice", "gpu" },
+        modes{ STEP_MARCHING, EVENT_DRIVEN },
+        batchSize(1 << 16),
+        minSeconds(0.3),
+        maxLinearSpheres(32768),
+        json(false),
+        seed(DEFAULT_PHOTON_SEED),
+        scalingPhotons(0),
+        interaction(DEFAULT_INTERACTION),
+        regroupInterval(0) {
+        // 1, 2, 4, ... up to every hardware thread
+        unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned n = 1; n < hardware; n *= 2)
+            threadCounts.push_back(n);
+        threadCounts.push_back(hardware);
+    }
+};
+
+// One measured configuration
+struct BenchResult {
+    std::string backend;
+    std::string kernel;   // Collision kernel or structure detail
+    PropagationMode mode;
+    size_t spheres;
+    unsigned threads;     // 0 for the GPU
+    size_t batch;
+    double buildMs;
+    double seconds;
+    unsigned long long ticks;
+    unsigned long long histories;
+    int ranks;            // MPI ranks sharing the photon budget
+    double efficiency;    // Strong scaling: T(1 rank) / (ranks * T(ranks))
+    const char* interaction;
+    unsigned long long scatters;
+    unsigned regroup;     // Ticks between regroup passes, 0 = off
+    double allocationsPerTick;  // Heap allocations during the timed ticks
+};
+
+class BenchWriter {
+public:
+    std::ostream& out;
+    bool json;
+
+    BenchWriter(std::ostream& stream, bool jsonLines) : out(stream), json(jsonLines) {
+        if (!json)
+            out << "format_version,backend,kernel,mode,spheres,threads,batch,build_ms,seconds,ticks,"
+                   "histories,photons_per_second,ns_per_step,ranks,scaling_efficiency,interaction,scatters,regroup,"
+                   "allocs_per_tick" << std::endl;
+    }
+
+    void write(const BenchResult& r) {
+        double photonsPerSecond = r.seconds > 0.0 ? r.histories / r.seconds : 0.0;
+        double nsPerStep = r.ticks ? r.seconds * 1e9 / ((double)r.ticks * r.batch) : 0.0;
+        const char* mode = r.mode == EVENT_DRIVEN ? "event" : "step";
+        if (json) {
+            out << "{\"format_version\":" << BENCH_FORMAT_VERSION << ",\"backend\":\"" << r.backend
+                << "\",\"kernel\":\"" << r.kernel << "\",\"mode\":\"" << mode << "\",\"spheres\":" << r.spheres
+                << ",\"threads\":" << r.threads << ",\"batch\":" << r.batch << ",\"build_ms\":" << r.buildMs
+                << ",\"seconds\":" << r.seconds << ",\"ticks\":" << r.ticks << ",\"histories\":" << r.histories
+                << ",\"photons_per_second\":" << photonsPerSecond << ",\"ns_per_step\":" << nsPerStep
+                << ",\"ranks\":" << r.ranks << ",\"scaling_efficiency\":" << r.efficiency
+                << ",\"interaction\":\"" << r.interaction << "\",\"scatters\":" << r.scatters
+                << ",\"regroup\":" << r.regroup << ",\"allocs_per_tick\":" << r.allocationsPerTick << "}" << std::endl;
+        } else {
+            out << BENCH_FORMAT_VERSION << "," << r.backend << "," << r.kernel << "," << mode << "," << r.spheres
+                << "," << r.threads << "," << r.batch << "," << r.buildMs << "," << r.seconds << "," << r.ticks
+                << "," << r.histories << "," << photonsPerSecond << "," << nsPerStep << "," << r.ranks
+                << "," << r.efficiency << "," << r.interaction << "," << r.scatters << "," << r.regroup
+                << "," << r.allocationsPerTick << std::endl;
+        }
+    }
+};
+
+// Near-cubic lattice of about `target` spheres filling the cube, with every
+// sphere inside its own cell so the implicit lattice backend applies
+LatticeSpec benchLattice(size_t target) {
+    int best[3] = { 1, 1, (int)std::max<size_t>(1, target) };
+    double bestError = 1e300, bestAspect = 1e300;
+    int limit = (int)std::ceil(std::cbrt((double)target)) + 1;
+    for (int nx = 1; nx <= limit; nx++) {
+        for (int ny = nx; ny <= 2 * limit; ny++) {
+            int nz = std::max(ny, (int)std::lround((double)target / ((double)nx * ny)));
+            double error = std::fabs((double)nx * ny * nz - (double)target);
+            double aspect = (double)nz / nx;
+            if (error < bestError || (error == bestError && aspect < bestAspect)) {
+                best[0] = nx; best[1] = ny; best[2] = nz;
+                bestError = error;
+                bestAspect = aspect;
+            }
+        }
+    }
+    float halfSize = (GRID_SIZE * CELL_SIZE) / 2.0f;
+    LatticeSpec spec = {};
+    float minPitch = std::numeric_limits<float>::infinity();
+    for (int a = 0; a < 3; a++) {
+        spec.counts[a] = best[a];
+        spec.pitch[a] = 1.8f * halfSize / best[a];
+        spec.origin[a] = -0.9f * halfSize + 0.5f * spec.pitch[a];
+        minPitch = std::min(minPitch, spec.pitch[a]);
+    }
+    spec.radius = 0.3f * minPitch;
+    return spec;
+}
+
+bool parseList(const std::string& text, std::vector<std::string>& out) {
+    out.clear();
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        if (!item.empty())
+            out.push_back(item);
+    return !out.empty();
+}
+
+void printBenchUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  --spheres N,N,...     target sphere counts (default 360,4096,32768,262144,1000000)\n"
+              << "  --threads N,N,...     CPU thread counts (default 1,2,4,... up to all)\n"
+              << "  --backends LIST       linear-scalar,linear-simd,grid,bvh,lattice,gpu\n"
+              << "  --modes LIST          step,event\n"
+              << "  --batch N             photons per batch (default 65536)\n"
+              << "  --seconds T           minimum time per configuration (default 0.3)\n"
+              << "  --max-linear N        skip linear scans above N spheres (default 32768)\n"
+              << "  --seed N              photon random stream key\n"
+              << "  --interaction MODEL   absorb|specular|lambertian|isotropic for the CPU backends\n"
+              << "  --regroup K           CPU backends: sort photons by cell and direction every K ticks\n"
+              << "  --format csv|json     output format (default csv)\n"
+              << "  --output FILE         write results to FILE instead of stdout\n"
+              << "  --quick               360 and 4096 spheres, 1 and all threads, 0.1 s each\n"
+              << "  --scaling N           MPI strong scaling: N photons on 1, 2, 4, ... ranks (grid backend,\n"
+              << "                        first --threads count per rank); needs PHOTON_ENABLE_MPI" << std::endl;
+}
+
+// Returns false (after printing why) on a bad command line
+bool parseBenchArguments(int argc, char** argv, BenchOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        std::vector<std::string> items;
+        if (arg == "--spheres" && hasValue && parseList(argv[++i], items)) {
+            options.sphereCounts.clear();
+            for (const std::string& item : items)
+                options.sphereCounts.push_back((size_t)std::max(1LL, atoll(item.c_str())));
+        } else if (arg == "--threads" && hasValue && parseList(argv[++i], items)) {
+            options.threadCounts.clear();
+            for (const std::string& item : items)
+                options.threadCounts.push_back((unsigned)std::max(1, atoi(item.c_str())));
+        } else if (arg == "--backends" && hasValue) {
+            parseList(argv[++i], options.backends);
+        } else if (arg == "--modes" && hasValue && parseList(argv[++i], items)) {
+            options.modes.clear();
+            for (const std::string& item : items) {
+                if (item != "step" && item != "event") {
+                    std::cerr << "Unknown mode: " << item << std::endl;
+                    return false;
+                }
+                options.modes.push_back(item == "event" ? EVENT_DRIVEN : STEP_MARCHING);
+            }
+        } else if (arg == "--batch" && hasValue) {
+            options.batchSize = (size_t)std::max(1LL, atoll(argv[++i]));
+        } else if (arg == "--seconds" && hasValue) {
+            options.minSeconds = std::max(0.0, atof(argv[++i]));
+        } else if (arg == "--max-linear" && hasValue) {
+            options.maxLinearSpheres = (size_t)std::max(0LL, atoll(argv[++i]));
+        } else if (arg == "--seed" && hasValue) {
+            options.seed = strtoull(argv[++i], nullptr, 0);
+        } else if (arg == "--interaction" && hasValue) {
+            if (!parseInteractionModel(argv[++i], options.interaction.model)) {
+                std::cerr << "Unknown interaction model: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (arg == "--regroup" && hasValue) {
+            options.regroupInterval = (unsigned)std::max(0, atoi(argv[++i]));
+        } else if (arg == "--format" && hasValue) {
+            std::string format = argv[++i];
+            if (format != "csv" && format != "json") {
+                std::cerr << "Unknown format: " << format << std::endl;
+                return false;
+            }
+            options.json = format == "json";
+        } else if (arg == "--output" && hasValue) {
+            options.outputPath = argv[++i];
+        } else if (arg == "--scaling" && hasValue) {
+            options.scalingPhotons = std::max(1ull, strtoull(argv[++i], nullptr, 10));
+        } else if (arg == "--quick") {
+            options.sphereCounts = { 360, 4096 };
+            unsigned all = options.threadCounts.back();
+            options.threadCounts = { 1 };
+            if (all > 1)
+                options.threadCounts.push_back(all);
+            options.minSeconds = 0.1;
+        } else {
+            printBenchUsage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Run the CPU batch until minSeconds have passed (at least one tick after
+// warming up)
+void measureCpu(const SphereScene& scene, PropagationMode mode, ThreadPool& pool,
+                const BenchOptions& options, BenchResult& result) {
+    PhotonBatch photons(options.batchSize, mode, PhotonBatch::UNLIMITED, options.seed);
+    photons.interaction = options.interaction;
+    photons.regroupInterval = options.regroupInterval;
+    // Warm up caches, the worker tallies and the arenas: tick in regroup
+    // periods until one whole period makes no heap allocation
+    unsigned period = std::max(1u, options.regroupInterval);
+    for (unsigned round = 0; round < BENCH_MAX_WARMUP_ROUNDS; round++) {
+        unsigned long long before = heapAllocations.load();
+        for (unsigned k = 0; k < period; k++)
+            photons.update(scene, &pool);
+        if (heapAllocations.load() == before)
+            break;
+    }
+
+    unsigned long long startHistories = photons.histories;
+    unsigned long long startScatters = photons.scatters;
+    unsigned long long startAllocations = heapAllocations.load();
+    unsigned long long ticks = 0;
+    double seconds = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    while (ticks == 0 || seconds < options.minSeconds) {
+        photons.update(scene, &pool);
+        ticks++;
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    result.seconds = seconds;
+    result.ticks = ticks;
+    result.histories = photons.histories - startHistories;
+    result.scatters = photons.scatters - startScatters;
+    result.allocationsPerTick = (double)(heapAllocations.load() - startAllocations) / ticks;
+    if (result.allocationsPerTick > 0.0)
+        std::cerr << "warning: " << result.backend << " " << (mode == EVENT_DRIVEN ? "event" : "step") << " with "
+                  << result.spheres << " spheres on " << result.threads << " threads made "
+                  << result.allocationsPerTick << " heap allocations per tick after warming up" << std::endl;
+}
+
+#ifdef PHOTON_ENABLE_MPI
+// Strong scaling: the fixed --scaling budget split over the first 1, 2, 4,
+// ... ranks of the job, up to all of them. Each run is timed from a barrier
+// to the end of the tally reduction on the slowest rank. Only world rank 0
+// gets a writer.
+void measureScaling(const BenchOptions& options, BenchWriter* writer) {
+    int worldRank = 0, worldSize = 1;
+    MPI_Comm_rank(MPI_COMM_WORLD, &worldRank);
+    MPI_Comm_size(MPI_COMM_WORLD, &worldSize);
+    std::vector<int> rankCounts;
+    for (int n = 1; n < worldSize; n *= 2)
+        rankCounts.push_back(n);
+    rankCounts.push_back(worldSize);
+    unsigned threads = options.threadCounts.front();
+    ThreadPool pool(threads);
+
+    for (size_t target : options.sphereCounts) {
+        Scene scene(benchLattice(target));
+        int gridResolution = std::max(DEFAULT_ACCEL_GRID_RESOLUTION, (int)std::cbrt((double)scene.count));
+        SphereScene sphereScene(scene, ACCEL_GRID, gridResolution);
+        for (PropagationMode mode : options.modes) {
+            double baseline = 0.0;
+            for (int ranks : rankCounts) {
+                MPI_Comm comm;
+                MPI_Comm_split(MPI_COMM_WORLD, worldRank < ranks ? 0 : MPI_UNDEFINED, worldRank, &comm);
+                if (comm != MPI_COMM_NULL) {
+                    int rank = 0;
+                    MPI_Comm_rank(comm, &rank);
+                    PhotonShard shard = photonShard(options.scalingPhotons, rank, ranks);
+                    PhotonBatch photons(options.batchSize, mode, shard.count, options.seed, shard.first);
+                    photons.interaction = options.interaction;
+                    photons.regroupInterval = options.regroupInterval;
+                    MPI_Barrier(comm);
+                    auto start = std::chrono::steady_clock::now();
+                    while (!photons.finished())
+                        photons.update(sphereScene, &pool);
+                    reduceBatch(photons, sphereScene.table.count, comm);
+                    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    seconds = reduceMaxSeconds(seconds, comm);
+                    if (ranks == 1)
+                        baseline = seconds;
+                    if (writer) {
+                        BenchResult result = { "mpi", "grid", mode, scene.count, threads, options.batchSize, 0.0,
+                                               seconds, photons.ticks, photons.histories, ranks,
+                                               seconds > 0.0 ? baseline / (ranks * seconds) : 0.0,
+                                               interactionName(options.interaction.model), photons.scatters,
+                                               options.regroupInterval, 0.0 };
+                        writer->write(result);
+                    }
+                    MPI_Comm_free(&comm);
+                }
+                MPI_Barrier(MPI_COMM_WORLD);
+            }
+        }
+    }
+}
+#endif
+
+#ifdef PHOTON_BENCH_GPU
+// Hidden window for a GL 4.3 context; nullptr (after a note) without one
+GLFWwindow* createGpuContext() {
+    if (!glfwInit()) {
+        std::cerr << "gpu: skipped, GLFW failed to initialize" << std::endl;
+        return nullptr;
+    }
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow* window = glfwCreateWindow(64, 64, "photon_bench", nullptr, nullptr);
+    if (!window) {
+        std::cerr << "gpu: skipped, no OpenGL 4.3 context" << std::endl;
+        glfwTerminate();
+        return nullptr;
+    }
+    glfwMakeContextCurrent(window);
+    glewExperimental = GL_TRUE;
+    if (glewInit() != GLEW_OK) {
+        std::cerr << "gpu: skipped, GLEW failed to initialize" << std::endl;
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return nullptr;
+    }
+    return window;
+}
+
+// Same protocol as measureCpu, with glFinish so the timing covers the GPU work
+bool measureGpu(const SphereScene& scene, PropagationMode mode, int gridResolution,
+                const BenchOptions& options, BenchResult& result) {
+    GpuPhotonEngine gpu;
+    auto buildStart = std::chrono::steady_clock::now();
+    if (!gpu.init(scene.table, options.batchSize, mode, gridResolution, PhotonBatch::UNLIMITED, options.seed)) {
+        gpu.release();
+        return false;
+    }
+    gpu.dispatch(GPU_STEPS_PER_DISPATCH);  // Warm up
+    gpu.readCounters();
+    result.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+
+    unsigned long long startHistories = gpu.histories();
+    unsigned long long startTicks = gpu.ticks;
+    double seconds = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    while (gpu.ticks == startTicks || seconds < options.minSeconds) {
+        gpu.dispatch(GPU_STEPS_PER_DISPATCH);
+        glFinish();
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    gpu.readCounters();
+    result.seconds = seconds;
+    result.ticks = gpu.ticks - startTicks;
+    result.histories = gpu.histories() - startHistories;
+    gpu.release();
+    return true;
+}
+#endif
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+#ifdef PHOTON_ENABLE_MPI
+    MpiSession mpi(argc, argv);
+#endif
+    if (!parseBenchArguments(argc, argv, options))
+        return -1;
+#ifdef PHOTON_ENABLE_MPI
+    // Under mpirun only rank 0 runs the single-node sweep and writes results
+    if (mpi.rank != 0) {
+        if (options.scalingPhotons > 0)
+            measureScaling(options, nullptr);
+        return 0;
+    }
+#else
+    if (options.scalingPhotons > 0) {
+        std::cerr << "--scaling needs a build with PHOTON_ENABLE_MPI" << std::endl;
+        return -1;
+    }
+#endif
+
+    std::ofstream file;
+    if (!options.outputPath.empty()) {
+        file.open(options.outputPath);
+        if (!file) {
+            std::cerr << "Failed to open " << options.outputPath << " for writing" << std::endl;
+#ifdef PHOTON_ENABLE_MPI
+            MPI_Abort(MPI_COMM_WORLD, 1);  // Other ranks may already be waiting in measureScaling
+#endif
+            return -1;
+        }
+    }
+    BenchWriter writer(options.outputPath.empty() ? std::cout : file, options.json);
+#ifdef PHOTON_ENABLE_MPI
+    if (options.scalingPhotons > 0) {
+        measureScaling(options, &writer);
+        return 0;
+    }
+#endif
+
+    bool wantGpu = std::find(options.backends.begin(), options.backends.end(), "gpu") != options.backends.end();
+#ifdef PHOTON_BENCH_GPU
+    GLFWwindow* gpuWindow = wantGpu ? createGpuContext() : nullptr;
+#else
+    if (wantGpu)
+        std::cerr << "gpu: skipped, photon_bench was built without OpenGL" << std::endl;
+#endif
+
+    for (size_t target : options.sphereCounts) {
+        Scene scene(benchLattice(target));
+        // About one sphere per grid cell at every scene size
+        int gridResolution = std::max(DEFAULT_ACCEL_GRID_RESOLUTION, (int)std::cbrt((double)scene.count));
+
+        for (const std::string& backend : options.backends) {
+            AccelerationKind kind;
+            if (backend == "linear-scalar" || backend == "linear-simd")
+                kind = ACCEL_LINEAR;
+            else if (backend == "grid")
+                kind = ACCEL_GRID;
+            else if (backend == "bvh")
+                kind = ACCEL_BVH;
+            else if (backend == "lattice")
+                kind = ACCEL_LATTICE;
+            else if (backend == "gpu")
+                kind = ACCEL_GRID;  // The compute shader brings its own grid
+            else {
+                std::cerr << "Unknown backend: " << backend << std::endl;
+                return -1;
+            }
+            if (kind == ACCEL_LINEAR && scene.count > options.maxLinearSpheres) {
+                std::cerr << backend << ": skipped " << scene.count << " spheres (above --max-linear)" << std::endl;
+                continue;
+            }
+            if (!SphereScene::supports(scene, kind))
+                continue;
+
+            auto buildStart = std::chrono::steady_clock::now();
+            SphereScene sphereScene(scene, backend == "gpu" ? ACCEL_LINEAR : kind, gridResolution);
+            double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+            const char* kernel = accelerationName(kind);
+            if (backend == "linear-scalar") {
+                sphereScene.linear.hitKernel = firstSphereHitScalar;
+                kernel = "scalar";
+            } else if (backend == "linear-simd") {
+                sphereScene.linear.hitKernel = selectSphereHitKernel(&kernel);
+            }
+
+            for (PropagationMode mode : options.modes) {
+                BenchResult result = { backend, kernel, mode, scene.count, 0, options.batchSize, buildMs, 0.0, 0, 0, 1, 1.0,
+                                      interactionName(options.interaction.model), 0, options.regroupInterval, 0.0 };
+                if (backend == "gpu") {
+#ifdef PHOTON_BENCH_GPU
+                    if (!gpuWindow)
+                        break;
+                    // Event-mode GPU photons scan the whole table, like the linear backends
+                    if (mode == EVENT_DRIVEN && scene.count > options.maxLinearSpheres) {
+                        std::cerr << "gpu: skipped event mode at " << scene.count << " spheres (above --max-linear)" << std::endl;
+                        continue;
+                    }
+                    result.kernel = mode == EVENT_DRIVEN ? "table" : "grid";
+                    result.interaction = interactionName(INTERACT_ABSORB);  // The compute shader only absorbs
+                    result.regroup = 0;
+                    if (measureGpu(sphereScene, mode, gridResolution, options, result))
+                        writer.write(result);
+#endif
+                    continue;
+                }
+                // The SIMD kernels only serve step mode's containment test
+                if (backend == "linear-simd" && mode == EVENT_DRIVEN)
+                    continue;
+                for (unsigned threads : options.threadCounts) {
+                    ThreadPool pool(threads);
+                    result.threads = threads;
+                    measureCpu(sphereScene, mode, pool, options, result);
+                    writer.write(result);
+                }
+            }
+        }
+    }
+
+#ifdef PHOTON_BENCH_GPU
+    if (gpuWindow) {
+        glfwDestroyWindow(gpuWindow);
+        glfwTerminate();
+    }
+#endif
+    return 0;
+}
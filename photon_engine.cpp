@@ -0,0 +1,169 @@
+#include "photon_engine.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+std::vector<SphereRecord> generateLattice(const LatticeSpec& spec) {
+    std::vector<SphereRecord> spheres;
+    spheres.reserve(spec.size());
+    for (int ix = 0; ix < spec.counts[0]; ix++)
+        for (int iy = 0; iy < spec.counts[1]; iy++)
+            for (int iz = 0; iz < spec.counts[2]; iz++) {
+                float c[3];
+                spec.center(ix, iy, iz, c);
+                spheres.push_back(SphereRecord{c[0], c[1], c[2], spec.radius});
+            }
+    return spheres;
+}
+
+int firstSphereHitScalar(const SphereTable& table, float px, float py, float pz) {
+    for (size_t i = 0; i < table.count; i++) {
+        float dx = px - table.centerX[i];
+        float dy = py - table.centerY[i];
+        float dz = pz - table.centerZ[i];
+        float distanceSquared = dx*dx + dy*dy + dz*dz;
+        if (distanceSquared <= table.radiusSquared[i])
+            return (int)i;
+    }
+    return -1;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PHOTON_HAVE_X86_SIMD 1
+
+// Tests one point against 8 sphere centers per iteration
+__attribute__((target("avx2")))
+int firstSphereHitAvx2(const SphereTable& table, float px, float py, float pz) {
+    const __m256 vx = _mm256_set1_ps(px);
+    const __m256 vy = _mm256_set1_ps(py);
+    const __m256 vz = _mm256_set1_ps(pz);
+    const size_t n = table.paddedCount();
+    for (size_t i = 0; i < n; i += 8) {
+        __m256 dx = _mm256_sub_ps(vx, _mm256_loadu_ps(&table.centerX[i]));
+        __m256 dy = _mm256_sub_ps(vy, _mm256_loadu_ps(&table.centerY[i]));
+        __m256 dz = _mm256_sub_ps(vz, _mm256_loadu_ps(&table.centerZ[i]));
+        __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+                                  _mm256_mul_ps(dz, dz));
+        __m256 hit = _mm256_cmp_ps(d2, _mm256_loadu_ps(&table.radiusSquared[i]), _CMP_LE_OQ);
+        int mask = _mm256_movemask_ps(hit);
+        if (mask)
+            return (int)i + __builtin_ctz(mask);
+    }
+    return -1;
+}
+
+// Tests one point against 16 sphere centers per iteration
+__attribute__((target("avx512f")))
+int firstSphereHitAvx512(const SphereTable& table, float px, float py, float pz) {
+    const __m512 vx = _mm512_set1_ps(px);
+    const __m512 vy = _mm512_set1_ps(py);
+    const __m512 vz = _mm512_set1_ps(pz);
+    const size_t n = table.paddedCount();
+    for (size_t i = 0; i < n; i += 16) {
+        __m512 dx = _mm512_sub_ps(vx, _mm512_loadu_ps(&table.centerX[i]));
+        __m512 dy = _mm512_sub_ps(vy, _mm512_loadu_ps(&table.centerY[i]));
+        __m512 dz = _mm512_sub_ps(vz, _mm512_loadu_ps(&table.centerZ[i]));
+        __m512 d2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy)),
+                                  _mm512_mul_ps(dz, dz));
+        __mmask16 mask = _mm512_cmp_ps_mask(d2, _mm512_loadu_ps(&table.radiusSquared[i]), _CMP_LE_OQ);
+        if (mask)
+            return (int)i + __builtin_ctz((unsigned)mask);
+    }
+    return -1;
+}
+#endif
+
+SphereHitKernel selectSphereHitKernel(const char** name) {
+    const char* forced = getenv("PHOTON_SIMD");
+    std::string request = forced ? forced : "";
+#ifdef PHOTON_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    bool haveAvx512 = __builtin_cpu_supports("avx512f");
+    bool haveAvx2 = __builtin_cpu_supports("avx2");
+    if (haveAvx512 && (request.empty() || request == "avx512")) {
+        if (name) *name = "avx512";
+        return firstSphereHitAvx512;
+    }
+    if (haveAvx2 && (request.empty() || request == "avx2" || request == "avx512")) {
+        if (name) *name = "avx2";
+        return firstSphereHitAvx2;
+    }
+#endif
+    if (name) *name = "scalar";
+    return firstSphereHitScalar;
+}
+
+int nearestSphereHit(const SphereTable& table, float ox, float oy, float oz,
+                     float ux, float uy, float uz, float tMax, float& tHit) {
+    int nearest = -1;
+    for (size_t i = 0; i < table.count; i++) {
+        float t = raySphereDistance(ox, oy, oz, ux, uy, uz,
+                                    table.centerX[i], table.centerY[i], table.centerZ[i],
+                                    table.radiusSquared[i]);
+        if (t >= 0.0f && t < tMax) {
+            tMax = t;
+            nearest = (int)i;
+        }
+    }
+    tHit = tMax;
+    return nearest;
+}
+
+void isotropicDirections(const uint64_t* ids, size_t n, uint64_t seed,
+                         float* u0, float* u1, float* dx, float* dy, float* dz) {
+    for (size_t k = 0; k < n; k++)
+        photonUniforms(ids[k], 0, seed, u0[k], u1[k]);
+    for (size_t k = 0; k < n; k++)
+        isotropicDirection(u0[k], u1[k], dx[k], dy[k], dz[k]);
+}
+
+std::vector<SphereRecord> createClusteredSpheres(int clusters, int spheresPerCluster, unsigned seed) {
+    std::vector<SphereRecord> spheres;
+    spheres.reserve((size_t)clusters * spheresPerCluster);
+    srand(seed);
+    float halfSize = (GRID_SIZE * CELL_SIZE) / 2.0f;
+    for (int c = 0; c < clusters; c++) {
+        float clusterX = (rand() / (float)RAND_MAX - 0.5f) * 1.6f * halfSize;
+        float clusterY = (rand() / (float)RAND_MAX - 0.5f) * 1.6f * halfSize;
+        float clusterZ = (rand() / (float)RAND_MAX - 0.5f) * 1.6f * halfSize;
+        float spread = 0.03f + 0.05f * (rand() / (float)RAND_MAX);
+        for (int i = 0; i < spheresPerCluster; i++) {
+            spheres.push_back(SphereRecord{clusterX + (rand() / (float)RAND_MAX - 0.5f) * spread,
+                                           clusterY + (rand() / (float)RAND_MAX - 0.5f) * spread,
+                                           clusterZ + (rand() / (float)RAND_MAX - 0.5f) * spread,
+                                           0.002f});
+        }
+    }
+    return spheres;
+}
+
+const char* accelerationName(AccelerationKind kind) {
+    switch (kind) {
+        case ACCEL_LINEAR: return "linear";
+        case ACCEL_GRID: return "grid";
+        case ACCEL_BVH: return "bvh";
+        case ACCEL_LATTICE: return "lattice";
+    }
+    return "unknown";
+}
+
+const char* interactionName(InteractionModel model) {
+    switch (model) {
+        case INTERACT_ABSORB: return "absorb";
+        case INTERACT_SPECULAR: return "specular";
+        case INTERACT_LAMBERTIAN: return "lambertian";
+        case INTERACT_ISOTROPIC: return "isotropic";
+    }
+    return "unknown";
+}
+
+bool parseInteractionModel(const std::string& name, InteractionModel& model) {
+    for (InteractionModel candidate : { INTERACT_ABSORB, INTERACT_SPECULAR, INTERACT_LAMBERTIAN, INTERACT_ISOTROPIC }) {
+        if (name == interactionName(candidate)) {
+            model = candidate;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,3023 @@
+// Photon transport engine: scenes, the packed sphere table, collision
+// kernels and acceleration structures, the work-stealing pool, event log,
+// tallies and the SoA photon batch. Nothing here needs OpenGL, so headless
+// runs and photon_bench build without it.
+#pragma once
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <cstdlib>
+#include <cmath>
+#include <limits>
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <iomanip>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <type_traits>
+#include <functional>
+#include <memory>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdio>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "photon_profile.h"
+#define M_PI 3.14159265358979323846
+
+// Grid parameters
+const int GRID_SIZE = 5;  // Number of cells in each dimension
+const float CELL_SIZE = 0.2f;  // Size of each cell
+
+// Photon batch parameters
+const size_t PHOTON_BATCH_SIZE = 4096;  // Rays propagated together per tick
+const size_t HEADLESS_BATCH_SIZE = 1 << 18;  // Default batch when there is no window
+const int TRAIL_POINTS = 8;  // Positions kept per displayed trail
+
+// One sphere: center and radius, 16 bytes. This is all the physics needs;
+// scene files store spheres in exactly this layout.
+struct Sphere {
+    float x, y, z;  // Position
+    float radius;
+};
+static_assert(sizeof(Sphere) == 16, "Sphere is part of the file format");
+typedef Sphere SphereRecord;
+
+// Header of the binary scene format, followed directly by `count` records
+struct SceneFileHeader {
+    char magic[8];        // "PHOTSCN\0"
+    uint32_t version;
+    uint32_t recordSize;  // sizeof(SphereRecord)
+    uint64_t count;
+};
+const uint32_t SCENE_FILE_VERSION = 1;
+const char SCENE_FILE_MAGIC[8] = { 'P', 'H', 'O', 'T', 'S', 'C', 'N', '\0' };
+
+// Regular 3D array of identical spheres. Sphere (ix, iy, iz) sits at
+// origin + (ix, iy, iz) * pitch, optionally moved by up to `jitter` along each
+// axis. The jitter comes from a hash of the sphere index, so any center can
+// be recomputed without storing it.
+struct LatticeSpec {
+    float origin[3];
+    float pitch[3];
+    int counts[3];
+    float radius;
+    float jitter;
+    unsigned seed;
+
+    size_t size() const {
+        return (size_t)counts[0] * counts[1] * counts[2];
+    }
+
+    // Index order: z fastest, then y, then x
+    size_t index(int ix, int iy, int iz) const {
+        return ((size_t)ix * counts[1] + iy) * counts[2] + iz;
+    }
+
+    // Deterministic offset in [-1, 1] for one axis of one sphere
+    float jitterOffset(size_t sphereIndex, int axis) const {
+        uint32_t h = (uint32_t)sphereIndex * 0x9E3779B1u ^ (seed + (uint32_t)axis * 0x85EBCA77u);
+        h ^= h >> 15; h *= 0x2C1B3C6Du;
+        h ^= h >> 12; h *= 0x297A2D39u;
+        h ^= h >> 15;
+        return (h >> 8) * (2.0f / 16777216.0f) - 1.0f;
+    }
+
+    void center(int ix, int iy, int iz, float out[3]) const {
+        const int cell[3] = { ix, iy, iz };
+        size_t i = index(ix, iy, iz);
+        for (int a = 0; a < 3; a++) {
+            out[a] = origin[a] + cell[a] * pitch[a];
+            if (jitter > 0.0f)
+                out[a] += jitter * jitterOffset(i, a);
+        }
+    }
+
+    // Every sphere stays inside its own pitch-sized cell, which is what the
+    // implicit intersection mode relies on
+    bool spheresStayInCells() const {
+        for (int a = 0; a < 3; a++) {
+            if (counts[a] < 1 || pitch[a] <= 0.0f || radius + jitter > 0.5f * pitch[a])
+                return false;
+        }
+        return true;
+    }
+};
+
+// Every sphere of the lattice, in LatticeSpec::index order, with no duplicates
+std::vector<SphereRecord> generateLattice(const LatticeSpec& spec);
+
+// The detector array used when no scene file is given: x in {0.1..0.4},
+// y in {-0.1..0.4}, z from -0.4 to 0.4 in steps of 0.05
+const LatticeSpec DEFAULT_DETECTOR_LATTICE = {
+    { 0.1f, -0.1f, -0.4f }, { 0.1f, 0.1f, 0.05f }, { 4, 6, 17 }, 0.02f, 0.0f, 0
+};
+
+// Sphere geometry loaded from disk. Text scenes are parsed into an owned
+// array, one directive per line ('#' starts a comment):
+//     sphere x y z radius
+//     lattice ox oy oz  px py pz  nx ny nz  radius [jitter [seed]]
+// Binary scenes are mmap'ed and their records used in place, so loading
+// costs no parsing at all.
+class Scene {
+public:
+    std::vector<SphereRecord> owned;
+    std::vector<LatticeSpec> lattices;  // Lattices the records were generated from
+    const SphereRecord* records;
+    size_t count;
+    void* mapping;
+    size_t mappingSize;
+
+    Scene() : records(nullptr), count(0), mapping(nullptr), mappingSize(0) {}
+
+    Scene(std::vector<SphereRecord> spheres) : owned(std::move(spheres)), mapping(nullptr), mappingSize(0) {
+        records = owned.data();
+        count = owned.size();
+    }
+
+    Scene(const LatticeSpec& lattice) : Scene() {
+        generate(lattice);
+    }
+
+    // Replaces the scene with a single generated lattice
+    void generate(const LatticeSpec& lattice) {
+        owned = generateLattice(lattice);
+        lattices.assign(1, lattice);
+        records = owned.data();
+        count = owned.size();
+    }
+
+    // True when the whole scene is one generated lattice, so the implicit
+    // intersection mode can stand in for the sphere table
+    bool isSingleLattice() const {
+        return lattices.size() == 1 && lattices[0].size() == count;
+    }
+
+    ~Scene() {
+        if (mapping)
+            munmap(mapping, mappingSize);
+    }
+
+    // FNV-1a over the sphere records; checkpoints only resume on the same scene
+    uint64_t fingerprint() const {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        const unsigned char* bytes = (const unsigned char*)records;
+        for (size_t i = 0; i < count * sizeof(SphereRecord); i++)
+            hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+        return hash;
+    }
+
+    Scene(const Scene&) = delete;
+    Scene& operator=(const Scene&) = delete;
+
+    static bool hasBinaryMagic(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        char magic[8] = {};
+        file.read(magic, sizeof(magic));
+        return file && std::equal(magic, magic + 8, SCENE_FILE_MAGIC);
+    }
+
+    // Picks the format from the file's first bytes. Prints the reason and
+    // returns false on failure.
+    bool load(const std::string& path) {
+        return hasBinaryMagic(path) ? loadBinary(path) : loadText(path);
+    }
+
+    bool loadText(const std::string& path) {
+        std::ifstream file(path);
+        if (!file) {
+            std::cerr << "Failed to open scene " << path << std::endl;
+            return false;
+        }
+        owned.clear();
+        lattices.clear();
+        std::string line;
+        size_t lineNumber = 0;
+        while (std::getline(file, line)) {
+            lineNumber++;
+            size_t comment = line.find('#');
+            if (comment != std::string::npos)
+                line.erase(comment);
+            std::istringstream fields(line);
+            std::string kind;
+            if (!(fields >> kind))
+                continue;  // Blank or comment-only line
+            if (kind == "lattice") {
+                LatticeSpec lattice = {};
+                if (!(fields >> lattice.origin[0] >> lattice.origin[1] >> lattice.origin[2]
+                             >> lattice.pitch[0] >> lattice.pitch[1] >> lattice.pitch[2]
+                             >> lattice.counts[0] >> lattice.counts[1] >> lattice.counts[2]
+                             >> lattice.radius) ||
+                    lattice.counts[0] < 1 || lattice.counts[1] < 1 || lattice.counts[2] < 1) {
+                    std::cerr << path << ":" << lineNumber << ": expected \"lattice ox oy oz px py pz nx ny nz radius [jitter [seed]]\"" << std::endl;
+                    return false;
+                }
+                if (fields >> lattice.jitter)
+                    fields >> lattice.seed;
+                std::vector<SphereRecord> generated = generateLattice(lattice);
+                owned.insert(owned.end(), generated.begin(), generated.end());
+                lattices.push_back(lattice);
+                continue;
+            }
+            SphereRecord sphere;
+            if (kind != "sphere" || !(fields >> sphere.x >> sphere.y >> sphere.z >> sphere.radius)) {
+                std::cerr << path << ":" << lineNumber << ": expected \"sphere x y z radius\" or \"lattice ...\"" << std::endl;
+                return false;
+            }
+            owned.push_back(sphere);
+        }
+        records = owned.data();
+        count = owned.size();
+        return true;
+    }
+
+    bool loadBinary(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Failed to open scene " << path << std::endl;
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SceneFileHeader)) {
+            std::cerr << "Scene " << path << " is truncated" << std::endl;
+            close(fd);
+            return false;
+        }
+        size_t size = (size_t)info.st_size;
+        void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            std::cerr << "Failed to map scene " << path << std::endl;
+            return false;
+        }
+        const SceneFileHeader* header = (const SceneFileHeader*)data;
+        if (header->version != SCENE_FILE_VERSION || header->recordSize != sizeof(SphereRecord) ||
+            header->count > (size - sizeof(SceneFileHeader)) / sizeof(SphereRecord)) {  // Cannot wrap
+            std::cerr << "Scene " << path << " has an unsupported version or is truncated" << std::endl;
+            munmap(data, size);
+            return false;
+        }
+        mapping = data;
+        mappingSize = size;
+        records = (const SphereRecord*)(header + 1);
+        count = (size_t)header->count;
+        return true;
+    }
+
+    bool saveBinary(const std::string& path) const {
+        std::ofstream file(path, std::ios::binary);
+        SceneFileHeader header = {};
+        std::copy(SCENE_FILE_MAGIC, SCENE_FILE_MAGIC + 8, header.magic);
+        header.version = SCENE_FILE_VERSION;
+        header.recordSize = sizeof(SphereRecord);
+        header.count = count;
+        file.write((const char*)&header, sizeof(header));
+        file.write((const char*)records, count * sizeof(SphereRecord));
+        return (bool)file;
+    }
+
+    bool saveText(const std::string& path) const {
+        std::ofstream file(path);
+        file << "# sphere x y z radius\n" << std::setprecision(9);
+        for (size_t i = 0; i < count; i++)
+            file << "sphere " << records[i].x << " " << records[i].y << " " << records[i].z << " " << records[i].radius << "\n";
+        return (bool)file;
+    }
+};
+
+// Sphere centers and squared radii packed into separate contiguous arrays for
+// the collision kernels. Padded to a multiple of SPHERE_TABLE_PADDING with
+// entries that can never be hit (negative radius squared).
+const size_t SPHERE_TABLE_PADDING = 16;
+
+class SphereTable {
+public:
+    std::vector<float> centerX, centerY, centerZ;
+    std::vector<float> radiusSquared;
+    size_t count;  // Real spheres, excluding padding
+
+    SphereTable(const SphereRecord* spheres, size_t sphereCount) : count(sphereCount) {
+        size_t padded = (count + SPHERE_TABLE_PADDING - 1) / SPHERE_TABLE_PADDING * SPHERE_TABLE_PADDING;
+        centerX.assign(padded, 0.0f);
+        centerY.assign(padded, 0.0f);
+        centerZ.assign(padded, 0.0f);
+        radiusSquared.assign(padded, -1.0f);
+        for (size_t i = 0; i < count; i++) {
+            centerX[i] = spheres[i].x;
+            centerY[i] = spheres[i].y;
+            centerZ[i] = spheres[i].z;
+            radiusSquared[i] = spheres[i].radius * spheres[i].radius;
+        }
+    }
+
+    size_t paddedCount() const {
+        return centerX.size();
+    }
+};
+
+// Collision kernels: return the index of the first sphere containing the point,
+// or -1. All variants give identical results; the SIMD ones avoid FMA on purpose
+// so the distance is rounded exactly like the scalar path.
+typedef int (*SphereHitKernel)(const SphereTable& table, float px, float py, float pz);
+
+int firstSphereHitScalar(const SphereTable& table, float px, float py, float pz);
+
+// Pick the widest kernel the CPU supports. PHOTON_SIMD=scalar|avx2|avx512
+// forces a specific one (falling back to scalar if unsupported).
+SphereHitKernel selectSphereHitKernel(const char** name = nullptr);
+
+// Analytic intersection helpers for event-driven propagation. Directions are
+// unit vectors, so the ray-sphere quadratic reduces to t^2 + 2bt + c = 0.
+
+// Distance along the ray to the first point inside the sphere, or -1 on a miss.
+// A ray starting inside the sphere hits it at distance 0.
+inline float raySphereDistance(float ox, float oy, float oz, float ux, float uy, float uz,
+                               float cx, float cy, float cz, float radiusSquared) {
+    float ocx = ox - cx;
+    float ocy = oy - cy;
+    float ocz = oz - cz;
+    float b = ocx*ux + ocy*uy + ocz*uz;
+    float c = ocx*ocx + ocy*ocy + ocz*ocz - radiusSquared;
+    if (c <= 0.0f)
+        return 0.0f;  // Already inside
+    float discriminant = b*b - c;
+    if (discriminant < 0.0f || b > 0.0f)
+        return -1.0f;  // Misses, or the sphere is behind the origin
+    return -b - std::sqrt(discriminant);
+}
+
+// Distance along the ray to where it leaves the axis-aligned cube [-h, h]^3
+// (slab test; the origin is assumed to be inside the cube).
+inline float rayCubeExitDistance(float ox, float oy, float oz, float ux, float uy, float uz,
+                                 float halfSize) {
+    float tExit = std::numeric_limits<float>::infinity();
+    if (ux != 0.0f) tExit = std::min(tExit, ((ux > 0.0f ? halfSize : -halfSize) - ox) / ux);
+    if (uy != 0.0f) tExit = std::min(tExit, ((uy > 0.0f ? halfSize : -halfSize) - oy) / uy);
+    if (uz != 0.0f) tExit = std::min(tExit, ((uz > 0.0f ? halfSize : -halfSize) - oz) / uz);
+    return std::max(tExit, 0.0f);
+}
+
+// Nearest sphere hit along the ray closer than tMax. Returns the sphere index
+// (and its distance in tHit) or -1.
+int nearestSphereHit(const SphereTable& table, float ox, float oy, float oz,
+                     float ux, float uy, float uz, float tMax, float& tHit);
+
+// How photons move between interactions
+enum PropagationMode {
+    STEP_MARCHING,  // Fixed-length steps with a point-in-sphere test after each
+    EVENT_DRIVEN    // Jump straight to the nearest sphere hit or cube exit
+};
+
+// What happens when a photon reaches a sphere
+enum InteractionModel {
+    INTERACT_ABSORB,      // The history ends at the first hit
+    INTERACT_SPECULAR,    // Mirror reflection about the surface normal
+    INTERACT_LAMBERTIAN,  // Cosine-weighted over the outward hemisphere
+    INTERACT_ISOTROPIC    // Uniform over the outward hemisphere
+};
+
+// Absorption is analog by default: each hit ends the history with
+// probability `absorption`. With rouletteWeight > 0 photons carry a weight
+// instead, each hit deposits that fraction of it, and photons lighter than
+// rouletteWeight play Russian roulette: survivors come back at rouletteWeight.
+struct InteractionSettings {
+    InteractionModel model;
+    float absorption;
+    float rouletteWeight;  // 0 = analog absorption
+    uint32_t maxBounces;   // The history ends at the sphere after this many scatters
+};
+const InteractionSettings DEFAULT_INTERACTION = { INTERACT_ABSORB, 0.1f, 0.0f, 64 };
+const int INTERACTION_MODEL_COUNT = 4;
+
+// Compile-time half of InteractionSettings for the specialized propagation
+// kernels: the model, and whether photons carry weights (rouletteWeight > 0).
+// The numeric settings stay runtime values.
+template <InteractionModel Model, bool Weighted>
+struct InteractionPolicy {
+    static constexpr InteractionModel model = Model;
+    static constexpr bool weighted = Weighted;
+};
+
+// Brute-force "acceleration structure": every query scans the whole table.
+// Point queries go through the SIMD kernel picked for the host CPU.
+class LinearScan {
+public:
+    SphereHitKernel hitKernel;
+
+    LinearScan() : hitKernel(selectSphereHitKernel()) {}
+
+    int firstHit(const SphereTable& table, float px, float py, float pz) const {
+        return hitKernel(table, px, py, pz);
+    }
+
+    int nearestHit(const SphereTable& table, float ox, float oy, float oz,
+                   float ux, float uy, float uz, float tMax, float& tHit) const {
+        return nearestSphereHit(table, ox, oy, oz, ux, uy, uz, tMax, tHit);
+    }
+};
+
+// Uniform voxel grid over the sphere bounds. Each cell lists (in CSR form)
+// the indices of every sphere whose bounding box overlaps it, in table order,
+// so the first hit in a cell is also the first hit in list order.
+class UniformGrid {
+public:
+    int resolution;             // Cells per axis
+    float boundsMin[3];         // Lower corner of the grid
+    float cellSize[3];
+    float inverseCellSize[3];
+    std::vector<uint32_t> cellStart;    // Offset of each cell's list, size cells + 1
+    std::vector<uint32_t> cellSpheres;  // Sphere indices, grouped by cell
+
+    UniformGrid() : resolution(0) {}
+
+    // The grid covers the cube [-halfSize, halfSize]^3 plus any sphere that sticks out of it
+    UniformGrid(const SphereTable& table, float halfSize, int cellsPerAxis) : resolution(std::max(1, cellsPerAxis)) {
+        float boundsMax[3];
+        for (int a = 0; a < 3; a++) {
+            boundsMin[a] = -halfSize;
+            boundsMax[a] = halfSize;
+        }
+        for (size_t i = 0; i < table.count; i++) {
+            float r = std::sqrt(table.radiusSquared[i]);
+            const float c[3] = { table.centerX[i], table.centerY[i], table.centerZ[i] };
+            for (int a = 0; a < 3; a++) {
+                boundsMin[a] = std::min(boundsMin[a], c[a] - r);
+                boundsMax[a] = std::max(boundsMax[a], c[a] + r);
+            }
+        }
+        for (int a = 0; a < 3; a++) {
+            cellSize[a] = (boundsMax[a] - boundsMin[a]) / resolution;
+            inverseCellSize[a] = 1.0f / cellSize[a];
+        }
+
+        // Two passes: count the spheres per cell, then fill the lists
+        const size_t cells = (size_t)resolution * resolution * resolution;
+        cellStart.assign(cells + 1, 0);
+        for (int pass = 0; pass < 2; pass++) {
+            std::vector<uint32_t> fill;
+            if (pass == 1) {
+                for (size_t c = 0; c < cells; c++)
+                    cellStart[c + 1] += cellStart[c];
+                cellSpheres.resize(cellStart[cells]);
+                fill.assign(cellStart.begin(), cellStart.end() - 1);
+            }
+            for (size_t i = 0; i < table.count; i++) {
+                float r = std::sqrt(table.radiusSquared[i]);
+                const float c[3] = { table.centerX[i], table.centerY[i], table.centerZ[i] };
+                int lo[3], hi[3];
+                for (int a = 0; a < 3; a++) {
+                    lo[a] = cellCoordinate(c[a] - r, a);
+                    hi[a] = cellCoordinate(c[a] + r, a);
+                }
+                for (int ix = lo[0]; ix <= hi[0]; ix++)
+                    for (int iy = lo[1]; iy <= hi[1]; iy++)
+                        for (int iz = lo[2]; iz <= hi[2]; iz++) {
+                            size_t cell = cellIndex(ix, iy, iz);
+                            if (pass == 0)
+                                cellStart[cell + 1]++;
+                            else
+                                cellSpheres[fill[cell]++] = (uint32_t)i;
+                        }
+            }
+        }
+    }
+
+    // Cell coordinate along axis a, clamped to the grid
+    int cellCoordinate(float p, int a) const {
+        int c = (int)((p - boundsMin[a]) * inverseCellSize[a]);
+        return std::min(std::max(c, 0), resolution - 1);
+    }
+
+    size_t cellIndex(int ix, int iy, int iz) const {
+        return ((size_t)iz * resolution + iy) * resolution + ix;
+    }
+
+    bool contains(float px, float py, float pz) const {
+        const float p[3] = { px, py, pz };
+        for (int a = 0; a < 3; a++) {
+            if (p[a] < boundsMin[a] || p[a] > boundsMin[a] + cellSize[a] * resolution)
+                return false;
+        }
+        return true;
+    }
+
+    int firstHit(const SphereTable& table, float px, float py, float pz) const {
+        if (!contains(px, py, pz))
+            return -1;
+        size_t cell = cellIndex(cellCoordinate(px, 0), cellCoordinate(py, 1), cellCoordinate(pz, 2));
+        for (uint32_t k = cellStart[cell]; k < cellStart[cell + 1]; k++) {
+            uint32_t i = cellSpheres[k];
+            float dx = px - table.centerX[i];
+            float dy = py - table.centerY[i];
+            float dz = pz - table.centerZ[i];
+            if (dx*dx + dy*dy + dz*dz <= table.radiusSquared[i])
+                return (int)i;
+        }
+        return -1;
+    }
+
+    // 3D-DDA (Amanatides & Woo): visit the cells along the ray in order and
+    // stop at the first cell that contains a hit closer than its far boundary.
+    // The origin must lie inside the grid.
+    int nearestHit(const SphereTable& table, float ox, float oy, float oz,
+                   float ux, float uy, float uz, float tMax, float& tHit) const {
+        const float o[3] = { ox, oy, oz };
+        const float u[3] = { ux, uy, uz };
+        int cell[3], step[3];
+        float tNext[3], tDelta[3];
+        for (int a = 0; a < 3; a++) {
+            cell[a] = cellCoordinate(o[a], a);
+            if (u[a] > 0.0f) {
+                step[a] = 1;
+                tNext[a] = (boundsMin[a] + (cell[a] + 1) * cellSize[a] - o[a]) / u[a];
+                tDelta[a] = cellSize[a] / u[a];
+            } else if (u[a] < 0.0f) {
+                step[a] = -1;
+                tNext[a] = (boundsMin[a] + cell[a] * cellSize[a] - o[a]) / u[a];
+                tDelta[a] = -cellSize[a] / u[a];
+            } else {
+                step[a] = 0;
+                tNext[a] = std::numeric_limits<float>::infinity();
+                tDelta[a] = std::numeric_limits<float>::infinity();
+            }
+        }
+
+        int nearest = -1;
+        float best = tMax;
+        for (;;) {
+            size_t c = cellIndex(cell[0], cell[1], cell[2]);
+            for (uint32_t k = cellStart[c]; k < cellStart[c + 1]; k++) {
+                uint32_t i = cellSpheres[k];
+                float t = raySphereDistance(ox, oy, oz, ux, uy, uz,
+                                            table.centerX[i], table.centerY[i], table.centerZ[i],
+                                            table.radiusSquared[i]);
+                if (t >= 0.0f && t < best) {
+                    best = t;
+                    nearest = (int)i;
+                }
+            }
+
+            int a = (tNext[0] < tNext[1]) ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+            // Anything found so far is closer than every cell still ahead
+            if (best <= tNext[a])
+                break;
+            cell[a] += step[a];
+            if (cell[a] < 0 || cell[a] >= resolution)
+                break;
+            tNext[a] += tDelta[a];
+        }
+        tHit = best;
+        return nearest;
+    }
+};
+
+// Flattened BVH node: 32 bytes, so two nodes share a cache line. Interior
+// nodes store the index of their left child (the right child follows it),
+// and leaves store a range of entries in Bvh::sphereIndices.
+struct alignas(32) BvhNode {
+    float boundsMin[3];
+    uint32_t leftOrFirst;  // Left child index, or first sphere entry for leaves
+    float boundsMax[3];
+    uint32_t count;        // Number of spheres in a leaf, 0 for interior nodes
+};
+
+// Bounding volume hierarchy over the spheres, built top-down with a binned
+// surface area heuristic. Suited to clustered layouts where a uniform grid
+// wastes most of its cells on empty space.
+class Bvh {
+public:
+    static const int SAH_BINS = 12;
+    static const int MAX_LEAF_SIZE = 4;
+    static const int MAX_DEPTH = 64;
+
+    std::vector<BvhNode> nodes;
+    std::vector<uint32_t> sphereIndices;
+
+    Bvh() {}
+
+    Bvh(const SphereTable& table) {
+        if (table.count == 0) {
+            nodes.push_back(BvhNode{{0, 0, 0}, 0, {0, 0, 0}, 0});
+            return;
+        }
+        // Per-sphere bounds and centroids used during the build
+        std::vector<float> lo(table.count * 3), hi(table.count * 3), centroid(table.count * 3);
+        for (size_t i = 0; i < table.count; i++) {
+            float r = std::sqrt(table.radiusSquared[i]);
+            const float c[3] = { table.centerX[i], table.centerY[i], table.centerZ[i] };
+            for (int a = 0; a < 3; a++) {
+                lo[i * 3 + a] = c[a] - r;
+                hi[i * 3 + a] = c[a] + r;
+                centroid[i * 3 + a] = c[a];
+            }
+        }
+        sphereIndices.resize(table.count);
+        for (size_t i = 0; i < table.count; i++)
+            sphereIndices[i] = (uint32_t)i;
+
+        nodes.reserve(2 * table.count);
+        nodes.push_back(BvhNode{});
+        nodes[0].leftOrFirst = 0;
+        nodes[0].count = (uint32_t)table.count;
+        refit(0, lo, hi);
+        subdivide(0, lo, hi, centroid, 0);
+        nodes.shrink_to_fit();
+    }
+
+    static float surfaceArea(const float* mn, const float* mx) {
+        float ex = mx[0] - mn[0], ey = mx[1] - mn[1], ez = mx[2] - mn[2];
+        return 2.0f * (ex * ey + ey * ez + ez * ex);
+    }
+
+    void refit(uint32_t nodeIndex, const std::vector<float>& lo, const std::vector<float>& hi) {
+        BvhNode& node = nodes[nodeIndex];
+        for (int a = 0; a < 3; a++) {
+            node.boundsMin[a] = std::numeric_limits<float>::max();
+            node.boundsMax[a] = -std::numeric_limits<float>::max();
+        }
+        for (uint32_t k = 0; k < node.count; k++) {
+            uint32_t i = sphereIndices[node.leftOrFirst + k];
+            for (int a = 0; a < 3; a++) {
+                node.boundsMin[a] = std::min(node.boundsMin[a], lo[i * 3 + a]);
+                node.boundsMax[a] = std::max(node.boundsMax[a], hi[i * 3 + a]);
+            }
+        }
+    }
+
+    void subdivide(uint32_t nodeIndex, const std::vector<float>& lo, const std::vector<float>& hi,
+                   const std::vector<float>& centroid, int depth) {
+        uint32_t first = nodes[nodeIndex].leftOrFirst;
+        uint32_t count = nodes[nodeIndex].count;
+        if (count <= (uint32_t)MAX_LEAF_SIZE || depth >= MAX_DEPTH)
+            return;
+
+        // Centroid bounds decide the bin layout
+        float cMin[3], cMax[3];
+        for (int a = 0; a < 3; a++) {
+            cMin[a] = std::numeric_limits<float>::max();
+            cMax[a] = -std::numeric_limits<float>::max();
+        }
+        for (uint32_t k = 0; k < count; k++) {
+            uint32_t i = sphereIndices[first + k];
+            for (int a = 0; a < 3; a++) {
+                cMin[a] = std::min(cMin[a], centroid[i * 3 + a]);
+                cMax[a] = std::max(cMax[a], centroid[i * 3 + a]);
+            }
+        }
+
+        // Evaluate the SAH cost of every bin boundary on every axis
+        int bestAxis = -1;
+        int bestSplit = 0;
+        float bestCost = surfaceArea(nodes[nodeIndex].boundsMin, nodes[nodeIndex].boundsMax) * count;
+        for (int a = 0; a < 3; a++) {
+            float extent = cMax[a] - cMin[a];
+            if (extent <= 0.0f)
+                continue;
+            float binMin[SAH_BINS][3], binMax[SAH_BINS][3];
+            uint32_t binCount[SAH_BINS] = {};
+            for (int b = 0; b < SAH_BINS; b++) {
+                for (int j = 0; j < 3; j++) {
+                    binMin[b][j] = std::numeric_limits<float>::max();
+                    binMax[b][j] = -std::numeric_limits<float>::max();
+                }
+            }
+            float scale = SAH_BINS / extent;
+            for (uint32_t k = 0; k < count; k++) {
+                uint32_t i = sphereIndices[first + k];
+                int b = std::min(SAH_BINS - 1, (int)((centroid[i * 3 + a] - cMin[a]) * scale));
+                binCount[b]++;
+                for (int j = 0; j < 3; j++) {
+                    binMin[b][j] = std::min(binMin[b][j], lo[i * 3 + j]);
+                    binMax[b][j] = std::max(binMax[b][j], hi[i * 3 + j]);
+                }
+            }
+            // Sweep from the left, then from the right, accumulating area * count
+            float leftCost[SAH_BINS - 1];
+            float accMin[3], accMax[3];
+            uint32_t acc = 0;
+            for (int j = 0; j < 3; j++) {
+                accMin[j] = std::numeric_limits<float>::max();
+                accMax[j] = -std::numeric_limits<float>::max();
+            }
+            for (int b = 0; b < SAH_BINS - 1; b++) {
+                acc += binCount[b];
+                for (int j = 0; j < 3; j++) {
+                    accMin[j] = std::min(accMin[j], binMin[b][j]);
+                    accMax[j] = std::max(accMax[j], binMax[b][j]);
+                }
+                leftCost[b] = acc ? surfaceArea(accMin, accMax) * acc : 0.0f;
+            }
+            acc = 0;
+            for (int j = 0; j < 3; j++) {
+                accMin[j] = std::numeric_limits<float>::max();
+                accMax[j] = -std::numeric_limits<float>::max();
+            }
+            for (int b = SAH_BINS - 1; b > 0; b--) {
+                acc += binCount[b];
+                for (int j = 0; j < 3; j++) {
+                    accMin[j] = std::min(accMin[j], binMin[b][j]);
+                    accMax[j] = std::max(accMax[j], binMax[b][j]);
+                }
+                float cost = leftCost[b - 1] + (acc ? surfaceArea(accMin, accMax) * acc : 0.0f);
+                if (acc > 0 && acc < count && cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = a;
+                    bestSplit = b;
+                }
+            }
+        }
+        if (bestAxis < 0)
+            return;  // Splitting would not pay off
+
+        // Partition the index range around the chosen bin boundary
+        float scale = SAH_BINS / (cMax[bestAxis] - cMin[bestAxis]);
+        uint32_t* begin = &sphereIndices[first];
+        uint32_t* middle = std::partition(begin, begin + count, [&](uint32_t i) {
+            return std::min(SAH_BINS - 1, (int)((centroid[i * 3 + bestAxis] - cMin[bestAxis]) * scale)) < bestSplit;
+        });
+        uint32_t leftCount = (uint32_t)(middle - begin);
+        if (leftCount == 0 || leftCount == count)
+            return;
+
+        uint32_t left = (uint32_t)nodes.size();
+        nodes.push_back(BvhNode{});
+        nodes.push_back(BvhNode{});
+        nodes[left].leftOrFirst = first;
+        nodes[left].count = leftCount;
+        nodes[left + 1].leftOrFirst = first + leftCount;
+        nodes[left + 1].count = count - leftCount;
+        nodes[nodeIndex].leftOrFirst = left;
+        nodes[nodeIndex].count = 0;
+        refit(left, lo, hi);
+        refit(left + 1, lo, hi);
+        subdivide(left, lo, hi, centroid, depth + 1);
+        subdivide(left + 1, lo, hi, centroid, depth + 1);
+    }
+
+    static bool nodeContains(const BvhNode& node, float px, float py, float pz) {
+        return px >= node.boundsMin[0] && px <= node.boundsMax[0] &&
+               py >= node.boundsMin[1] && py <= node.boundsMax[1] &&
+               pz >= node.boundsMin[2] && pz <= node.boundsMax[2];
+    }
+
+    // Entry and exit distances of one slab. A ray lying on a slab plane gives
+    // 0 * inf = NaN there; it is parallel to the slab, so the slab never clips it
+    static void slabInterval(float boundsMin, float boundsMax, float origin, float inv, float& tEnter, float& tExit) {
+        float t0 = (boundsMin - origin) * inv, t1 = (boundsMax - origin) * inv;
+        if (std::isnan(t0) || std::isnan(t1)) {
+            tEnter = -std::numeric_limits<float>::infinity();
+            tExit = std::numeric_limits<float>::infinity();
+            return;
+        }
+        tEnter = std::min(t0, t1);
+        tExit = std::max(t0, t1);
+    }
+
+    // Slab test against the node bounds; returns the entry distance or +inf on a miss
+    static float nodeEntryDistance(const BvhNode& node, float ox, float oy, float oz,
+                                   float invX, float invY, float invZ, float tMax) {
+        float t0x, t1x, t0y, t1y, t0z, t1z;
+        slabInterval(node.boundsMin[0], node.boundsMax[0], ox, invX, t0x, t1x);
+        slabInterval(node.boundsMin[1], node.boundsMax[1], oy, invY, t0y, t1y);
+        slabInterval(node.boundsMin[2], node.boundsMax[2], oz, invZ, t0z, t1z);
+        float tNear = std::max(std::max(t0x, t0y), std::max(t0z, 0.0f));
+        float tFar = std::min(std::min(t1x, t1y), std::min(t1z, tMax));
+        return tNear <= tFar ? tNear : std::numeric_limits<float>::infinity();
+    }
+
+    // Lowest-index sphere containing the point, matching the linear scan
+    int firstHit(const SphereTable& table, float px, float py, float pz) const {
+        uint32_t stack[MAX_DEPTH + 1];
+        int top = 0;
+        int best = -1;
+        stack[top++] = 0;
+        while (top > 0) {
+            const BvhNode& node = nodes[stack[--top]];
+            if (!nodeContains(node, px, py, pz))
+                continue;
+            if (node.count == 0) {
+                stack[top++] = node.leftOrFirst;
+                stack[top++] = node.leftOrFirst + 1;
+                continue;
+            }
+            for (uint32_t k = 0; k < node.count; k++) {
+                uint32_t i = sphereIndices[node.leftOrFirst + k];
+                float dx = px - table.centerX[i];
+                float dy = py - table.centerY[i];
+                float dz = pz - table.centerZ[i];
+                if (dx*dx + dy*dy + dz*dz <= table.radiusSquared[i] && (best < 0 || (int)i < best))
+                    best = (int)i;
+            }
+        }
+        return best;
+    }
+
+    // Front-to-back traversal: visit the nearer child first and skip any node
+    // whose entry distance is beyond the closest hit found so far.
+    int nearestHit(const SphereTable& table, float ox, float oy, float oz,
+                   float ux, float uy, float uz, float tMax, float& tHit) const {
+        const float invX = 1.0f / ux, invY = 1.0f / uy, invZ = 1.0f / uz;
+        uint32_t stack[MAX_DEPTH + 1];
+        int top = 0;
+        int nearest = -1;
+        float best = tMax;
+        if (nodeEntryDistance(nodes[0], ox, oy, oz, invX, invY, invZ, best) <= best)
+            stack[top++] = 0;
+        while (top > 0) {
+            const BvhNode& node = nodes[stack[--top]];
+            if (node.count > 0) {
+                for (uint32_t k = 0; k < node.count; k++) {
+                    uint32_t i = sphereIndices[node.leftOrFirst + k];
+                    float t = raySphereDistance(ox, oy, oz, ux, uy, uz,
+                                                table.centerX[i], table.centerY[i], table.centerZ[i],
+                                                table.radiusSquared[i]);
+                    if (t >= 0.0f && (t < best || (t == best && nearest >= 0 && (int)i < nearest))) {
+                        best = t;
+                        nearest = (int)i;
+                    }
+                }
+                continue;
+            }
+            uint32_t near = node.leftOrFirst, far = node.leftOrFirst + 1;
+            float tNear = nodeEntryDistance(nodes[near], ox, oy, oz, invX, invY, invZ, best);
+            float tFar = nodeEntryDistance(nodes[far], ox, oy, oz, invX, invY, invZ, best);
+            if (tFar < tNear) {
+                std::swap(near, far);
+                std::swap(tNear, tFar);
+            }
+            // Push the far child first so the near one is popped next
+            if (tFar <= best)
+                stack[top++] = far;
+            if (tNear <= best)
+                stack[top++] = near;
+        }
+        tHit = best;
+        return nearest;
+    }
+};
+
+// Intersection against a single LatticeSpec without any per-sphere data: a
+// point can only be inside the sphere of the lattice cell it falls in, and a
+// ray meets the cells in DDA order. Each cell is a pitch-sized box centered on
+// its lattice point, and spheres never leave their cell, so the first sphere
+// hit along the ray is also the nearest one. Sphere indices match
+// generateLattice, so results are interchangeable with the table-based paths.
+class ImplicitLattice {
+public:
+    LatticeSpec spec;
+    float radiusSquared;
+    float boundsMin[3];
+    float inversePitch[3];
+
+    ImplicitLattice() : spec(), radiusSquared(0.0f) {}
+
+    ImplicitLattice(const LatticeSpec& lattice) : spec(lattice), radiusSquared(lattice.radius * lattice.radius) {
+        for (int a = 0; a < 3; a++) {
+            boundsMin[a] = spec.origin[a] - 0.5f * spec.pitch[a];
+            inversePitch[a] = 1.0f / spec.pitch[a];
+        }
+    }
+
+    // Cell along one axis, or -1 / counts[a] when outside the lattice
+    int cellCoordinate(float p, int a) const {
+        float c = std::floor((p - boundsMin[a]) * inversePitch[a]);
+        return (int)std::max(-1.0f, std::min(c, (float)spec.counts[a]));
+    }
+
+    bool validCell(const int cell[3]) const {
+        return cell[0] >= 0 && cell[0] < spec.counts[0] &&
+               cell[1] >= 0 && cell[1] < spec.counts[1] &&
+               cell[2] >= 0 && cell[2] < spec.counts[2];
+    }
+
+    int firstHit(const SphereTable&, float px, float py, float pz) const {
+        const int cell[3] = { cellCoordinate(px, 0), cellCoordinate(py, 1), cellCoordinate(pz, 2) };
+        if (!validCell(cell))
+            return -1;
+        float c[3];
+        spec.center(cell[0], cell[1], cell[2], c);
+        float dx = px - c[0];
+        float dy = py - c[1];
+        float dz = pz - c[2];
+        if (dx*dx + dy*dy + dz*dz <= radiusSquared)
+            return (int)spec.index(cell[0], cell[1], cell[2]);
+        return -1;
+    }
+
+    int nearestHit(const SphereTable&, float ox, float oy, float oz,
+                   float ux, float uy, float uz, float tMax, float& tHit) const {
+        const float o[3] = { ox, oy, oz };
+        const float u[3] = { ux, uy, uz };
+        tHit = tMax;
+
+        // Clip the ray to the lattice bounds
+        float tEnter = 0.0f;
+        float tLeave = tMax;
+        for (int a = 0; a < 3; a++) {
+            float lo = boundsMin[a];
+            float hi = boundsMin[a] + spec.counts[a] * spec.pitch[a];
+            if (u[a] == 0.0f) {
+                if (o[a] < lo || o[a] > hi)
+                    return -1;
+                continue;
+            }
+            float t0 = (lo - o[a]) / u[a];
+            float t1 = (hi - o[a]) / u[a];
+            tEnter = std::max(tEnter, std::min(t0, t1));
+            tLeave = std::min(tLeave, std::max(t0, t1));
+        }
+        if (tEnter > tLeave)
+            return -1;
+
+        int cell[3], step[3];
+        float tNext[3], tDelta[3];
+        for (int a = 0; a < 3; a++) {
+            float p = o[a] + u[a] * tEnter;
+            cell[a] = std::max(0, std::min(cellCoordinate(p, a), spec.counts[a] - 1));
+            if (u[a] > 0.0f) {
+                step[a] = 1;
+                tNext[a] = (boundsMin[a] + (cell[a] + 1) * spec.pitch[a] - o[a]) / u[a];
+                tDelta[a] = spec.pitch[a] / u[a];
+            } else if (u[a] < 0.0f) {
+                step[a] = -1;
+                tNext[a] = (boundsMin[a] + cell[a] * spec.pitch[a] - o[a]) / u[a];
+                tDelta[a] = -spec.pitch[a] / u[a];
+            } else {
+                step[a] = 0;
+                tNext[a] = std::numeric_limits<float>::infinity();
+                tDelta[a] = std::numeric_limits<float>::infinity();
+            }
+        }
+
+        for (;;) {
+            float c[3];
+            spec.center(cell[0], cell[1], cell[2], c);
+            float t = raySphereDistance(ox, oy, oz, ux, uy, uz, c[0], c[1], c[2], radiusSquared);
+            if (t >= 0.0f && t < tMax) {
+                tHit = t;
+                return (int)spec.index(cell[0], cell[1], cell[2]);
+            }
+            int a = (tNext[0] < tNext[1]) ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+            if (tNext[a] >= tLeave)
+                break;
+            cell[a] += step[a];
+            if (cell[a] < 0 || cell[a] >= spec.counts[a])
+                break;
+            tNext[a] += tDelta[a];
+        }
+        return -1;
+    }
+};
+
+// Which structure answers the collision queries
+enum AccelerationKind {
+    ACCEL_LINEAR,
+    ACCEL_GRID,
+    ACCEL_BVH,
+    ACCEL_LATTICE  // ImplicitLattice; the scene must be one generated lattice
+};
+const int ACCELERATION_KIND_COUNT = 4;
+
+// Finer than the drawn lattice so each cell holds only a few spheres
+const int DEFAULT_ACCEL_GRID_RESOLUTION = GRID_SIZE * 4;
+
+// The sphere table together with the acceleration structure built over it
+class SphereScene {
+public:
+    SphereTable table;
+    AccelerationKind accel;
+    LinearScan linear;
+    UniformGrid grid;
+    Bvh bvh;
+    ImplicitLattice lattice;
+
+    SphereScene(const Scene& scene, AccelerationKind kind,
+                int gridResolution = DEFAULT_ACCEL_GRID_RESOLUTION)
+        : table(scene.records, scene.count), accel(kind) {
+        if (accel == ACCEL_GRID)
+            grid = UniformGrid(table, (GRID_SIZE * CELL_SIZE) / 2.0f, gridResolution);
+        else if (accel == ACCEL_BVH)
+            bvh = Bvh(table);
+        else if (accel == ACCEL_LATTICE)
+            lattice = ImplicitLattice(scene.lattices[0]);
+    }
+
+    // The structure a kernel specialized for Kind queries
+    template <AccelerationKind Kind>
+    const auto& structure() const {
+        if constexpr (Kind == ACCEL_GRID)
+            return grid;
+        else if constexpr (Kind == ACCEL_BVH)
+            return bvh;
+        else if constexpr (Kind == ACCEL_LATTICE)
+            return lattice;
+        else
+            return linear;
+    }
+
+    // The implicit mode needs the scene to be exactly one lattice whose
+    // spheres stay inside their cells
+    static bool supports(const Scene& scene, AccelerationKind kind) {
+        return kind != ACCEL_LATTICE || (scene.isSingleLattice() && scene.lattices[0].spheresStayInCells());
+    }
+};
+
+// Bump allocator for transient data that lives no longer than one tick:
+// emission scratch, finished-slot lists, regroup buffers. Blocks are only
+// ever appended and are kept when the arena is rewound, so once the chain
+// covers a thread's high-water mark its ticks make no heap allocations.
+// Callers that know their high-water mark reserve() it up front and never
+// grow at all. Only for trivially copyable types; memory is not initialized.
+class Arena {
+public:
+    static const size_t MIN_BLOCK_BYTES = 1 << 16;
+    static const size_t MAX_BLOCKS = 48;  // Doubling from MIN_BLOCK_BYTES, far past any real need
+
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    // Position to rewind() back to
+    struct Marker {
+        size_t block;
+        size_t offset;
+    };
+
+    std::vector<Block> blocks;
+    size_t current;  // Block being bumped
+    size_t offset;   // Next free byte in it
+    unsigned long long blockAllocations;
+
+    Arena() : current(0), offset(0), blockAllocations(0) {
+        blocks.reserve(MAX_BLOCKS);  // Appending a block never moves the others
+    }
+
+    // The calling thread's arena
+    static Arena& forThread() {
+        thread_local Arena arena;
+        return arena;
+    }
+
+    template <class T>
+    T* allocate(size_t count) {
+        static_assert(std::is_trivially_copyable<T>::value, "Arena memory is never constructed or destroyed");
+        return (T*)allocateBytes(count * sizeof(T), alignof(T));
+    }
+
+    void* allocateBytes(size_t bytes, size_t alignment) {
+        for (;;) {
+            if (current < blocks.size()) {
+                uintptr_t base = (uintptr_t)blocks[current].data.get();
+                size_t start = (size_t)(((base + offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) - base);
+                if (start + bytes <= blocks[current].size) {
+                    offset = start + bytes;
+                    return blocks[current].data.get() + start;
+                }
+                // Move on to the first later block that holds the request
+                size_t next = current + 1;
+                while (next < blocks.size() && blocks[next].size < bytes + alignment)
+                    next++;
+                if (next < blocks.size()) {
+                    current = next;
+                    offset = 0;
+                    continue;
+                }
+            }
+            // Grow: a new block at the end, at least double the last
+            size_t previous = blocks.empty() ? 0 : blocks.back().size;
+            size_t size = std::max({ MIN_BLOCK_BYTES, 2 * previous, bytes + alignment });
+            blocks.push_back(Block{ std::unique_ptr<char[]>(new char[size]), size });
+            blockAllocations++;
+            current = blocks.size() - 1;
+            offset = 0;
+        }
+    }
+
+    // Make the first block hold at least `bytes`, replacing the chain if it
+    // is too small. Only acts on an empty arena, so it is safe to call at the
+    // start of every chunk: after the first call it allocates nothing.
+    void reserve(size_t bytes) {
+        if (current != 0 || offset != 0 || (!blocks.empty() && blocks[0].size >= bytes))
+            return;
+        size_t total = bytes;
+        for (const Block& block : blocks)
+            total = std::max(total, block.size);
+        blocks.clear();
+        blocks.push_back(Block{ std::unique_ptr<char[]>(new char[total]), total });
+        blockAllocations++;
+    }
+
+    Marker mark() const {
+        return Marker{ current, offset };
+    }
+
+    // Free everything allocated since `marker`
+    void rewind(Marker marker) {
+        current = marker.block;
+        offset = marker.offset;
+    }
+
+    void reset() {
+        rewind(Marker{ 0, 0 });
+    }
+};
+
+// Arena every pool worker reserves as it starts, so one that first gets
+// work late in a run does not allocate then. Covers a propagation chunk's
+// scratch (PhotonBatch::chunkScratchBytes).
+const size_t WORKER_ARENA_BYTES = 1 << 17;
+
+// Frees the scope's arena allocations when it ends
+class ArenaScope {
+public:
+    Arena& arena;
+    Arena::Marker marker;
+
+    explicit ArenaScope(Arena& scopeArena = Arena::forThread()) : arena(scopeArena), marker(scopeArena.mark()) {}
+
+    ~ArenaScope() {
+        arena.rewind(marker);
+    }
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+};
+
+// Fixed pool of worker threads for parallel loops over the photon batch.
+// parallelFor splits the range into chunks and deals contiguous runs of them
+// onto per-worker queues. Workers pop from the front of their own deque and,
+// once it is empty, steal from the back of the others', so a worker that drew
+// short-lived photons picks up work from one stuck with long paths.
+class ThreadPool {
+public:
+    // Non-owning reference to a loop body, so parallelFor never allocates
+    // (a lambda with a few captures outgrows std::function's inline storage).
+    // The body must outlive the call.
+    class RangeBody {
+    public:
+        template <class Body>
+        RangeBody(const Body& body) :
+            target(&body),
+            invoke([](const void* b, size_t begin, size_t end) { (*(const Body*)b)(begin, end); }) {}
+
+        void operator()(size_t begin, size_t end) const {
+            invoke(target, begin, end);
+        }
+
+    private:
+        const void* target;
+        void (*invoke)(const void*, size_t, size_t);
+    };
+
+    // Ranges [head, tail) are still queued; the storage is reused by every call
+    struct WorkQueue {
+        std::mutex mutex;
+        std::vector<std::pair<size_t, size_t>> ranges;
+        size_t head;
+        size_t tail;
+
+        WorkQueue() : head(0), tail(0) {}
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::mutex mutex;
+    std::condition_variable workReady;
+    std::condition_variable workDone;
+    const RangeBody* body;
+    unsigned long long generation;   // Bumped for every parallelFor call
+    size_t pendingChunks;
+    size_t activeWorkers;  // Workers still taking ranges for the current call
+    bool stopping;
+
+    ThreadPool(unsigned threadCount) :
+        body(nullptr), generation(0), pendingChunks(0), activeWorkers(0), stopping(false) {
+        threadCount = std::max(1u, threadCount);
+        for (unsigned i = 0; i < threadCount; i++)
+            queues.emplace_back(new WorkQueue());
+        for (unsigned i = 0; i < threadCount; i++)
+            workers.emplace_back(&ThreadPool::workerLoop, this, (int)i);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        workReady.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    unsigned size() const {
+        return (unsigned)workers.size();
+    }
+
+    // Index of the pool worker running the calling thread, or -1 outside the pool
+    static int& currentWorker() {
+        thread_local int index = -1;
+        return index;
+    }
+
+    // Run rangeBody(begin, end) over [0, count) in chunks of at most chunkSize
+    // and return once every chunk has finished.
+    void parallelFor(size_t count, size_t chunkSize, const RangeBody& rangeBody) {
+        if (count == 0)
+            return;
+        chunkSize = std::max<size_t>(1, chunkSize);
+        size_t chunks = (count + chunkSize - 1) / chunkSize;
+        size_t perWorker = (chunks + queues.size() - 1) / queues.size();
+        for (size_t q = 0; q < queues.size(); q++) {
+            WorkQueue& queue = *queues[q];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.ranges.clear();
+            for (size_t c = q * perWorker; c < std::min(chunks, (q + 1) * perWorker); c++)
+                queue.ranges.emplace_back(c * chunkSize, std::min(count, (c + 1) * chunkSize));
+            queue.head = 0;
+            queue.tail = queue.ranges.size();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        body = &rangeBody;
+        pendingChunks = chunks;
+        generation++;
+        workReady.notify_all();
+        // A worker that woke late may still be looking for ranges; wait for it
+        // too, so it cannot pick up the next call's ranges with this body
+        workDone.wait(lock, [this] { return pendingChunks == 0 && activeWorkers == 0; });
+        body = nullptr;
+    }
+
+    bool takeRange(int self, std::pair<size_t, size_t>& range) {
+        {
+            WorkQueue& own = *queues[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (own.head < own.tail) {
+                range = own.ranges[own.head++];
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); k++) {
+            WorkQueue& victim = *queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.head < victim.tail) {
+                range = victim.ranges[--victim.tail];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(int self) {
+        currentWorker() = self;
+        Arena::forThread().reserve(WORKER_ARENA_BYTES);
+        unsigned long long seen = 0;
+        for (;;) {
+            const RangeBody* job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                workReady.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+                job = body;
+                if (!job)
+                    continue;  // That call has already returned
+                activeWorkers++;
+            }
+
+            size_t finished = 0;
+            std::pair<size_t, size_t> range;
+            while (takeRange(self, range)) {
+                (*job)(range.first, range.second);
+                finished++;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            pendingChunks -= finished;
+            activeWorkers--;
+            if (pendingChunks == 0 && activeWorkers == 0)
+                workDone.notify_all();
+        }
+    }
+};
+
+// Photons per work-stealing chunk: large enough to amortize the queue locks,
+// small enough to balance uneven path lengths
+const size_t PROPAGATION_CHUNK_SIZE = 2048;
+
+// regroup() bins photons by lattice cell (a Morton code of GRID_SIZE cells
+// per axis) and then by direction octant: one counting-sort bucket per pair
+const int REGROUP_CELL_BITS = 3;
+static_assert((1 << REGROUP_CELL_BITS) >= GRID_SIZE, "REGROUP_CELL_BITS too small for GRID_SIZE");
+const uint32_t REGROUP_BUCKETS = 1u << (3 * REGROUP_CELL_BITS + 3);
+
+// Interleave the low REGROUP_CELL_BITS bits of three cell coordinates
+inline uint32_t mortonCode3(uint32_t cx, uint32_t cy, uint32_t cz) {
+    uint32_t code = 0;
+    for (int bit = 0; bit < REGROUP_CELL_BITS; bit++) {
+        code |= ((cx >> bit) & 1u) << (3 * bit);
+        code |= ((cy >> bit) & 1u) << (3 * bit + 1);
+        code |= ((cz >> bit) & 1u) << (3 * bit + 2);
+    }
+    return code;
+}
+
+// Key used when --seed is not given
+const uint64_t DEFAULT_PHOTON_SEED = 0x5EED5EED5EEDull;
+
+// Philox4x32-10 counter-based generator (Salmon et al., SC'11): ten rounds
+// over a 128-bit counter under a 64-bit key. There is no state to share, so
+// any thread can draw photon `id`'s numbers and get the same bits.
+inline void philox4x32(uint32_t counter[4], uint64_t key) {
+    uint32_t k0 = (uint32_t)key;
+    uint32_t k1 = (uint32_t)(key >> 32);
+    for (int round = 0; round < 10; round++) {
+        uint64_t p0 = (uint64_t)0xD2511F53u * counter[0];
+        uint64_t p1 = (uint64_t)0xCD9E8D57u * counter[2];
+        uint32_t c0 = (uint32_t)(p1 >> 32) ^ counter[1] ^ k0;
+        uint32_t c2 = (uint32_t)(p0 >> 32) ^ counter[3] ^ k1;
+        counter[1] = (uint32_t)p1;
+        counter[3] = (uint32_t)p0;
+        counter[0] = c0;
+        counter[2] = c2;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+}
+
+// Uniform floats in [0, 1) for draw `draw` of photon `id`
+inline void photonUniforms(uint64_t id, uint32_t draw, uint64_t seed, float& u0, float& u1) {
+    uint32_t counter[4] = { (uint32_t)id, (uint32_t)(id >> 32), draw, 0 };
+    philox4x32(counter, seed);
+    u0 = (counter[0] >> 8) * (1.0f / 16777216.0f);
+    u1 = (counter[1] >> 8) * (1.0f / 16777216.0f);
+}
+
+// All four words of one Philox block as uniforms in [0, 1)
+inline void photonUniforms4(uint64_t id, uint32_t draw, uint64_t seed, float u[4]) {
+    uint32_t counter[4] = { (uint32_t)id, (uint32_t)(id >> 32), draw, 0 };
+    philox4x32(counter, seed);
+    for (int k = 0; k < 4; k++)
+        u[k] = (counter[k] >> 8) * (1.0f / 16777216.0f);
+}
+
+// Tangents t, b completing unit n to an orthonormal basis, without branches
+// on n's orientation (Duff et al., "Building an Orthonormal Basis, Revisited")
+inline void orthonormalBasis(float nx, float ny, float nz, float t[3], float b[3]) {
+    float sign = std::copysign(1.0f, nz);
+    float a = -1.0f / (sign + nz);
+    float c = nx * ny * a;
+    t[0] = 1.0f + sign * nx * nx * a; t[1] = sign * c; t[2] = -sign * nx;
+    b[0] = c; b[1] = sign + ny * ny * a; b[2] = -ny;
+}
+
+// Isotropic unit vector: cos(zenith) uniform in [-1, 1], azimuth uniform
+inline void isotropicDirection(float u0, float u1, float& dx, float& dy, float& dz) {
+    float cosTheta = 1.0f - 2.0f * u0;
+    float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+    float phi = 2.0f * (float)M_PI * u1;
+    dx = sinTheta * std::cos(phi);
+    dy = cosTheta;
+    dz = sinTheta * std::sin(phi);
+}
+
+// Emission directions for n photons at once. There is no hand-written SIMD
+// path: the lanes are independent and the Philox rounds are plain
+// 32x32->64 multiplies, so GCC auto-vectorizes the first loop (4 lanes with
+// SSE2, 8 with AVX2; check with -fopt-info-vec). The trigonometry runs in a
+// second, scalar pass through libm, which keeps every direction bit-equal
+// to emit()'s one-at-a-time isotropicDirection().
+void isotropicDirections(const uint64_t* ids, size_t n, uint64_t seed,
+                         float* u0, float* u1, float* dx, float* dy, float* dz);
+
+// What ended or changed a photon's flight
+enum PhotonEventType : uint8_t {
+    EVENT_SPHERE_HIT = 1,     // History ended at a sphere (absorbed or rouletted)
+    EVENT_BOUNDARY_EXIT = 2,
+    EVENT_SCATTER = 3         // Hit a sphere and carried on in a new direction
+};
+
+// One record of the binary event stream. Fixed 32 bytes, written as-is.
+struct PhotonEvent {
+    uint64_t photonId;
+    int32_t sphere;      // Sphere index, -1 for boundary exits
+    uint8_t type;        // PhotonEventType
+    uint8_t bounce;      // Scatters before this event, saturating at 255
+    uint8_t reserved[2];
+    float x, y, z;       // Where the event happened
+    float pathLength;
+};
+static_assert(sizeof(PhotonEvent) == 32, "PhotonEvent is part of the file format");
+
+// Header at the start of every event stream file
+struct EventStreamHeader {
+    char magic[8];        // "PHOTEVT\0"
+    uint32_t version;
+    uint32_t recordSize;  // sizeof(PhotonEvent)
+};
+const uint32_t EVENT_STREAM_VERSION = 2;  // 2: EVENT_SCATTER and the bounce count
+
+// Extra consumer of the event stream (e.g. a columnar file export). write()
+// runs on the EventLog's writer thread with runs of consecutive events.
+class EventSink {
+public:
+    virtual ~EventSink() {}
+    virtual void write(const PhotonEvent* events, size_t count) = 0;
+};
+
+// Single-producer/single-consumer ring of events. The producing thread only
+// writes head and the writer thread only writes tail, so neither side locks.
+class EventRing {
+public:
+    std::vector<PhotonEvent> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head;  // Next slot the producer fills
+    alignas(64) std::atomic<size_t> tail;  // Next slot the consumer drains
+
+    EventRing(size_t capacityPow2) : slots(capacityPow2), mask(capacityPow2 - 1), head(0), tail(0) {}
+
+    bool tryPush(const PhotonEvent& event) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == slots.size())
+            return false;
+        slots[h & mask] = event;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+// Collects hit and exit events from the propagation threads without putting
+// any I/O on the hot path. Every producer thread owns one ring (pool workers
+// by index, plus one for the thread driving the batch); a background writer
+// drains them into a binary stream and, optionally, writes every Nth event as
+// a text line for debugging.
+class EventLog {
+public:
+    static const size_t RING_CAPACITY = 1 << 16;
+
+    std::vector<std::unique_ptr<EventRing>> rings;
+    std::ofstream binary;
+    std::ofstream textFile;
+    std::ostream* text;              // Sampled text log, nullptr when off
+    EventSink* sink;                 // Gets every event too, nullptr when off
+    unsigned long long textSampleEvery;
+    std::atomic<unsigned long long> stalls;  // Pushes that had to wait for the writer
+    unsigned long long written;
+    unsigned long long drained;
+    std::atomic<bool> stopping;
+    std::thread writer;
+
+    // producerThreads is the pool size; one extra ring serves the caller
+    EventLog(unsigned producerThreads) :
+        text(nullptr), sink(nullptr), textSampleEvery(0), stalls(0), written(0), drained(0), stopping(false) {
+        for (unsigned i = 0; i <= producerThreads; i++)
+            rings.emplace_back(new EventRing(RING_CAPACITY));
+    }
+
+    ~EventLog() {
+        stop();
+    }
+
+    // Returns false if the file could not be opened
+    bool openBinary(const std::string& path) {
+        binary.open(path, std::ios::binary);
+        if (!binary)
+            return false;
+        EventStreamHeader header = { { 'P', 'H', 'O', 'T', 'E', 'V', 'T', '\0' },
+                                     EVENT_STREAM_VERSION, (uint32_t)sizeof(PhotonEvent) };
+        binary.write((const char*)&header, sizeof(header));
+        return true;
+    }
+
+    // "-" logs to stdout; sampleEvery = 1 logs every event
+    bool openText(const std::string& path, unsigned long long sampleEvery) {
+        textSampleEvery = std::max(1ull, sampleEvery);
+        if (path == "-") {
+            text = &std::cout;
+            return true;
+        }
+        textFile.open(path);
+        text = textFile ? &textFile : nullptr;
+        return text != nullptr;
+    }
+
+    // True if any output is open, i.e. the batch should record events
+    bool enabled() const {
+        return binary.is_open() || text || sink;
+    }
+
+    void start() {
+        writer = std::thread(&EventLog::writerLoop, this);
+    }
+
+    // Drain whatever is left and join the writer
+    void stop() {
+        if (!writer.joinable())
+            return;
+        stopping = true;
+        writer.join();
+        binary.flush();
+        if (text)
+            text->flush();
+    }
+
+    // Called from propagation threads. Spins (yielding) only if the writer
+    // has fallen a full ring behind.
+    void record(const PhotonEvent& event) {
+        int worker = ThreadPool::currentWorker();
+        EventRing& ring = *rings[worker >= 0 ? (size_t)worker : rings.size() - 1];
+        if (ring.tryPush(event))
+            return;
+        stalls.fetch_add(1, std::memory_order_relaxed);
+        while (!ring.tryPush(event))
+            std::this_thread::yield();
+    }
+
+    void writeText(const PhotonEvent& event) {
+        if (event.type == EVENT_SPHERE_HIT || event.type == EVENT_SCATTER)
+            *text << "photon " << event.photonId << (event.type == EVENT_SCATTER ? " scattered off sphere " : " hit sphere ")
+                  << event.sphere << " at (" << event.x << ", " << event.y << ", " << event.z << ") after "
+                  << event.pathLength << "\n";
+        else
+            *text << "photon " << event.photonId << " left the cube at ("
+                  << event.x << ", " << event.y << ", " << event.z << ") after " << event.pathLength << "\n";
+    }
+
+    // Copy out everything currently in the rings; returns the number of events
+    size_t drainOnce() {
+        size_t total = 0;
+        for (std::unique_ptr<EventRing>& ringPtr : rings) {
+            EventRing& ring = *ringPtr;
+            size_t t = ring.tail.load(std::memory_order_relaxed);
+            size_t h = ring.head.load(std::memory_order_acquire);
+            while (t != h) {
+                // Largest contiguous run before the ring wraps
+                size_t begin = t & ring.mask;
+                size_t run = std::min(h - t, ring.slots.size() - begin);
+                const PhotonEvent* events = &ring.slots[begin];
+                if (binary.is_open()) {
+                    binary.write((const char*)events, run * sizeof(PhotonEvent));
+                    written += run;
+                }
+                if (sink)
+                    sink->write(events, run);
+                if (text) {
+                    for (size_t k = 0; k < run; k++) {
+                        if ((drained + k) % textSampleEvery == 0)
+                            writeText(events[k]);
+                    }
+                }
+                drained += run;
+                t += run;
+                total += run;
+                ring.tail.store(t, std::memory_order_release);
+            }
+        }
+        return total;
+    }
+
+    void writerLoop() {
+        while (!stopping.load(std::memory_order_acquire)) {
+            if (drainOnce() == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        drainOnce();  // Producers are finished by the time stop() is called
+    }
+};
+
+// Cube faces in tally order
+enum CubeFace { FACE_NEG_X, FACE_POS_X, FACE_NEG_Y, FACE_POS_Y, FACE_NEG_Z, FACE_POS_Z, FACE_COUNT };
+
+const int PATH_LENGTH_BINS = 64;  // The last bin also takes anything longer
+
+// Deposited and escaped photon weight is summed in fixed point (units of
+// 1 / WEIGHT_SCALE) so the totals do not depend on the order threads or
+// ranks add them in
+const double WEIGHT_SCALE = 16777216.0;
+
+inline uint64_t fixedWeight(float weight) {
+    return (uint64_t)((double)weight * WEIGHT_SCALE + 0.5);
+}
+
+// Running count, mean and sum of squared deviations of a stream of scores,
+// updated one sample at a time with Welford's method. Two partial streams
+// combine with Chan's pairwise formula, so worker and rank results merge
+// without revisiting samples. Unlike the fixed-point counts the moments are
+// doubles, reproducible only up to rounding in the order they merge.
+struct ScoreMoments {
+    uint64_t count;
+    double mean;
+    double m2;
+
+    void add(double score) {
+        count++;
+        double delta = score - mean;
+        mean += delta / (double)count;
+        m2 += delta * (score - mean);
+    }
+
+    void merge(const ScoreMoments& other) {
+        if (other.count == 0)
+            return;
+        uint64_t total = count + other.count;
+        double delta = other.mean - mean;
+        mean += delta * ((double)other.count / (double)total);
+        m2 += other.m2 + delta * delta * ((double)count * (double)other.count / (double)total);
+        count = total;
+    }
+};
+
+// Counts that make up the result of a run: hits per sphere (every
+// interaction, including scatters), weight deposited per sphere, exits per
+// face cell (each face binned on the GRID_SIZE x GRID_SIZE drawn cells) and a
+// histogram of path lengths at the end of each history. Propagation threads
+// fill private Tallies that are merged once per batch update. Each Tally
+// lists the spheres and face cells record*() has touched since its last
+// clear(), so merging and clearing a worker's tally costs what it recorded,
+// not the size of the scene.
+class Tally {
+public:
+    std::vector<uint64_t> sphereHits;
+    std::vector<uint64_t> sphereDeposit;  // Absorbed weight, fixedWeight() units
+    std::vector<uint64_t> faceExits;   // FACE_COUNT * GRID_SIZE * GRID_SIZE, row-major per face
+    std::vector<uint64_t> pathLength;  // PATH_LENGTH_BINS bins of pathBinWidth
+    std::vector<ScoreMoments> depositMoments;  // Nonzero per-history deposits of each sphere
+    uint64_t escapedWeight;            // Weight that left the cube, fixedWeight() units
+    float halfSize;
+    float pathBinWidth;
+    bool touched;  // Anything added since the last clear() (or heatmap publish)
+    size_t changedBegin, changedEnd;  // sphereHits entries changed by merge() since resetChanged()
+    // Entries record*() has written since clear(): the first dirtySphereCount
+    // of dirtySpheres, flagged in sphereDirty (likewise for face cells).
+    // Fixed size, so recording never allocates.
+    std::vector<uint32_t> dirtySpheres;
+    std::vector<uint8_t> sphereDirty;
+    size_t dirtySphereCount;
+    std::vector<uint32_t> dirtyFaces;
+    std::vector<uint8_t> faceDirty;
+    size_t dirtyFaceCount;
+
+    Tally() :
+        escapedWeight(0), halfSize(0.0f), pathBinWidth(1.0f), touched(false), changedBegin(0), changedEnd(0),
+        dirtySphereCount(0), dirtyFaceCount(0) {}
+
+    Tally(size_t sphereCount, float cubeHalfSize) :
+        sphereHits(sphereCount, 0),
+        sphereDeposit(sphereCount, 0),
+        faceExits(FACE_COUNT * GRID_SIZE * GRID_SIZE, 0),
+        pathLength(PATH_LENGTH_BINS, 0),
+        depositMoments(sphereCount, ScoreMoments()),
+        escapedWeight(0),
+        halfSize(cubeHalfSize),
+        // Bins cover the center-to-corner distance
+        pathBinWidth(std::sqrt(3.0f) * cubeHalfSize / PATH_LENGTH_BINS),
+        touched(false),
+        changedBegin(0),
+        changedEnd(0),
+        dirtySpheres(sphereCount),
+        sphereDirty(sphereCount, 0),
+        dirtySphereCount(0),
+        dirtyFaces(FACE_COUNT * GRID_SIZE * GRID_SIZE),
+        faceDirty(FACE_COUNT * GRID_SIZE * GRID_SIZE, 0),
+        dirtyFaceCount(0) {}
+
+    void markSphere(int sphere) {
+        if (!sphereDirty[sphere]) {
+            sphereDirty[sphere] = 1;
+            dirtySpheres[dirtySphereCount++] = (uint32_t)sphere;
+        }
+        touched = true;
+    }
+
+    void markFace(size_t cell) {
+        if (!faceDirty[cell]) {
+            faceDirty[cell] = 1;
+            dirtyFaces[dirtyFaceCount++] = (uint32_t)cell;
+        }
+        touched = true;
+    }
+
+    void recordPath(float length) {
+        int bin = (int)(length / pathBinWidth);
+        pathLength[std::min(std::max(bin, 0), PATH_LENGTH_BINS - 1)]++;
+    }
+
+    void recordHit(int sphere) {
+        sphereHits[sphere]++;
+        markSphere(sphere);
+    }
+
+    void recordDeposit(int sphere, float weight) {
+        sphereDeposit[sphere] += fixedWeight(weight);
+        markSphere(sphere);
+    }
+
+    // Everything one history deposited in a sphere, as one sample of its score
+    void recordScore(int sphere, float score) {
+        depositMoments[sphere].add(score);
+        markSphere(sphere);
+    }
+
+    // Relative standard error of the mean deposit per history in a sphere,
+    // over `histories` histories. Histories that left nothing there are
+    // zero scores; they join the recorded ones as a block of zeros.
+    // Infinite until the sphere has scored.
+    double relativeError(size_t sphere, unsigned long long histories) const {
+        ScoreMoments moments = depositMoments[sphere];
+        if (moments.count == 0 || moments.mean <= 0.0 || histories < 2)
+            return std::numeric_limits<double>::infinity();
+        ScoreMoments zeros = { histories > moments.count ? histories - moments.count : 0, 0.0, 0.0 };
+        moments.merge(zeros);
+        double variance = moments.m2 / (double)(moments.count - 1);
+        return std::sqrt(variance / (double)moments.count) / moments.mean;
+    }
+
+    // Cell across the face for one coordinate in [-halfSize, halfSize]
+    int faceBin(float c) const {
+        int bin = (int)((c + halfSize) / (2.0f * halfSize) * GRID_SIZE);
+        return std::min(std::max(bin, 0), GRID_SIZE - 1);
+    }
+
+    // The exit face is the axis the point is furthest out along
+    void recordExit(float x, float y, float z, float length, float weight) {
+        const float p[3] = { x, y, z };
+        int axis = 0;
+        for (int a = 1; a < 3; a++) {
+            if (std::fabs(p[a]) > std::fabs(p[axis]))
+                axis = a;
+        }
+        int face = axis * 2 + (p[axis] > 0.0f ? 1 : 0);
+        int u = faceBin(p[(axis + 1) % 3]);
+        int v = faceBin(p[(axis + 2) % 3]);
+        size_t cell = (face * GRID_SIZE + v) * GRID_SIZE + u;
+        faceExits[cell]++;
+        markFace(cell);
+        escapedWeight += fixedWeight(weight);
+        recordPath(length);
+    }
+
+    // Add everything `other` recorded since its last clear(); other must
+    // only have been filled through record*()
+    void merge(const Tally& other) {
+        for (size_t k = 0; k < other.dirtySphereCount; k++) {
+            size_t i = other.dirtySpheres[k];
+            sphereHits[i] += other.sphereHits[i];
+            sphereDeposit[i] += other.sphereDeposit[i];
+            depositMoments[i].merge(other.depositMoments[i]);
+            if (changedBegin == changedEnd)
+                changedBegin = i;
+            changedBegin = std::min(changedBegin, i);
+            changedEnd = std::max(changedEnd, i + 1);
+        }
+        for (size_t k = 0; k < other.dirtyFaceCount; k++) {
+            size_t i = other.dirtyFaces[k];
+            faceExits[i] += other.faceExits[i];
+        }
+        for (size_t i = 0; i < pathLength.size(); i++)
+            pathLength[i] += other.pathLength[i];
+        escapedWeight += other.escapedWeight;
+        touched = touched || other.touched;
+    }
+
+    // Zero what record*() wrote since the last clear(). Only for worker
+    // tallies; one filled any other way (a restored checkpoint, an MPI
+    // reduction) is rebuilt instead.
+    void clear() {
+        for (size_t k = 0; k < dirtySphereCount; k++) {
+            size_t i = dirtySpheres[k];
+            sphereHits[i] = 0;
+            sphereDeposit[i] = 0;
+            depositMoments[i] = ScoreMoments();
+            sphereDirty[i] = 0;
+        }
+        for (size_t k = 0; k < dirtyFaceCount; k++) {
+            size_t i = dirtyFaces[k];
+            faceExits[i] = 0;
+            faceDirty[i] = 0;
+        }
+        dirtySphereCount = dirtyFaceCount = 0;
+        std::fill(pathLength.begin(), pathLength.end(), 0);
+        escapedWeight = 0;
+        touched = false;
+        resetChanged();
+    }
+
+    void resetChanged() {
+        changedBegin = changedEnd = 0;
+    }
+
+    // Plain-text dump: "sphere", "face", "path" and "deposit" sections
+    void write(std::ostream& out) const {
+        static const char* faceNames[FACE_COUNT] = { "-x", "+x", "-y", "+y", "-z", "+z" };
+        out << "# sphere index hits\n";
+        for (size_t i = 0; i < sphereHits.size(); i++)
+            out << "sphere " << i << " " << sphereHits[i] << "\n";
+        out << "# face name row: exits per cell\n";
+        for (int face = 0; face < FACE_COUNT; face++) {
+            for (int v = 0; v < GRID_SIZE; v++) {
+                out << "face " << faceNames[face] << " " << v << ":";
+                for (int u = 0; u < GRID_SIZE; u++)
+                    out << " " << faceExits[(face * GRID_SIZE + v) * GRID_SIZE + u];
+                out << "\n";
+            }
+        }
+        out << "# path bin-start count\n";
+        for (int bin = 0; bin < PATH_LENGTH_BINS; bin++)
+            out << "path " << bin * pathBinWidth << " " << pathLength[bin] << "\n";
+        out << "# deposit index absorbed-weight\n" << std::setprecision(9);
+        for (size_t i = 0; i < sphereDeposit.size(); i++)
+            out << "deposit " << i << " " << sphereDeposit[i] / WEIGHT_SCALE << "\n";
+        out << "escaped " << escapedWeight / WEIGHT_SCALE << "\n";
+    }
+};
+
+const uint64_t ERROR_TARGET_MIN_SCORES = 32;  // A sphere's error is not trusted on fewer scores
+const unsigned long long ERROR_TARGET_UNSCORED_HISTORIES = 1ull << 20;  // Default for ErrorTarget::unscoredAfter
+
+// Stopping rule of an adaptive run: the relative error of every selected
+// sphere's deposit is at or below `target`. Spheres that have scored fewer
+// than ERROR_TARGET_MIN_SCORES times count as unconverged, so a lucky first
+// few hits cannot end a run. Spheres that have not scored at all after
+// unscoredAfter histories (shadowed ones, usually) would never converge, so
+// they are left out until they do score; unscoredCount() says how many are.
+class ErrorTarget {
+public:
+    double target;                  // 0 = no target
+    std::vector<uint32_t> spheres;  // Spheres that must converge; empty means all of them
+    unsigned long long unscoredAfter;  // Histories before never-scored spheres are left out, 0 = never
+
+    ErrorTarget(double relativeError = 0.0, const std::vector<uint32_t>& selected = {},
+                unsigned long long unscoredHistories = ERROR_TARGET_UNSCORED_HISTORIES) :
+        target(relativeError), spheres(selected), unscoredAfter(unscoredHistories) {}
+
+    // Calls visit(sphere) for every selected sphere
+    template <class Visit>
+    void forEachSelected(const Tally& tally, Visit visit) const {
+        if (spheres.empty()) {
+            for (size_t i = 0; i < tally.depositMoments.size(); i++)
+                visit(i);
+        } else {
+            for (uint32_t i : spheres)
+                visit(i);
+        }
+    }
+
+    bool unscored(const Tally& tally, size_t sphere, unsigned long long histories) const {
+        return unscoredAfter && tally.depositMoments[sphere].count == 0 && histories >= unscoredAfter;
+    }
+
+    double sphereError(const Tally& tally, size_t sphere, unsigned long long histories) const {
+        if (tally.depositMoments[sphere].count < ERROR_TARGET_MIN_SCORES)
+            return std::numeric_limits<double>::infinity();
+        return tally.relativeError(sphere, histories);
+    }
+
+    // Largest relative error over the selected spheres still in the target
+    double worst(const Tally& tally, unsigned long long histories) const {
+        double largest = 0.0;
+        forEachSelected(tally, [&](size_t i) {
+            if (!unscored(tally, i, histories))
+                largest = std::max(largest, sphereError(tally, i, histories));
+        });
+        return largest;
+    }
+
+    // Selected spheres still above the target
+    size_t unconverged(const Tally& tally, unsigned long long histories) const {
+        size_t count = 0;
+        forEachSelected(tally, [&](size_t i) {
+            if (!unscored(tally, i, histories) && !(sphereError(tally, i, histories) <= target))
+                count++;
+        });
+        return count;
+    }
+
+    // Selected spheres left out because they have never scored
+    size_t unscoredCount(const Tally& tally, unsigned long long histories) const {
+        size_t count = 0;
+        forEachSelected(tally, [&](size_t i) {
+            if (unscored(tally, i, histories))
+                count++;
+        });
+        return count;
+    }
+
+    bool met(const Tally& tally, unsigned long long histories) const {
+        return target > 0.0 && worst(tally, histories) <= target;
+    }
+};
+
+// Last TRAIL_POINTS positions of an evenly strided sample of the batch,
+// recorded by the simulation thread after each tick. A trail restarts at
+// the emission point whenever its slot starts a new photon.
+class PhotonTrails {
+public:
+    std::vector<float> points;  // TRAIL_POINTS xyz positions per tracked photon, a ring each
+    std::vector<uint64_t> ids;  // Photon each trail belongs to
+    std::vector<int> lengths;   // Points recorded (at most TRAIL_POINTS)
+    std::vector<int> heads;     // Ring index of the next point
+
+    void resize(size_t tracked) {
+        points.assign(tracked * TRAIL_POINTS * 3, 0.0f);
+        ids.assign(tracked, ~0ull);
+        lengths.assign(tracked, 0);
+        heads.assign(tracked, 0);
+    }
+
+    void push(size_t k, float px, float py, float pz) {
+        float* p = &points[(k * TRAIL_POINTS + heads[k]) * 3];
+        p[0] = px; p[1] = py; p[2] = pz;
+        heads[k] = (heads[k] + 1) % TRAIL_POINTS;
+        lengths[k] = std::min(lengths[k] + 1, TRAIL_POINTS);
+    }
+
+    void record(size_t k, uint64_t id, bool alive, float px, float py, float pz) {
+        if (!alive) {
+            lengths[k] = 0;
+            return;
+        }
+        if (ids[k] != id) {
+            ids[k] = id;
+            lengths[k] = heads[k] = 0;
+            push(k, 0.0f, 0.0f, 0.0f);  // Emitted at the center
+        }
+        push(k, px, py, pz);
+    }
+
+    // Line-segment vertices for every trail, oldest segment first. Returns
+    // the number of vertices written; out needs room for maxVertices().
+    size_t write(float* out) const {
+        size_t vertices = 0;
+        for (size_t k = 0; k < ids.size(); k++) {
+            int oldest = (heads[k] - lengths[k] + TRAIL_POINTS) % TRAIL_POINTS;
+            for (int s = 0; s + 1 < lengths[k]; s++) {
+                const float* a = &points[(k * TRAIL_POINTS + (oldest + s) % TRAIL_POINTS) * 3];
+                const float* b = &points[(k * TRAIL_POINTS + (oldest + s + 1) % TRAIL_POINTS) * 3];
+                std::copy(a, a + 3, out + vertices * 3);
+                std::copy(b, b + 3, out + vertices * 3 + 3);
+                vertices += 2;
+            }
+        }
+        return vertices;
+    }
+
+    size_t maxVertices() const {
+        return ids.size() * (TRAIL_POINTS - 1) * 2;
+    }
+};
+
+// Tally counts published for the heatmap overlay, as floats ready for the
+// GPU. The simulation widens the dirty range of sphere entries it changed;
+// the renderer uploads only that range and then empties it.
+class HeatmapSnapshot {
+public:
+    std::mutex mutex;
+    std::vector<float> sphereHits;
+    std::vector<float> faceExits;
+    size_t dirtyBegin, dirtyEnd;  // sphereHits range not yet uploaded
+    bool facesDirty;
+    float maxSphereHits;
+    float maxFaceExits;
+
+    HeatmapSnapshot() : dirtyBegin(0), dirtyEnd(0), facesDirty(false), maxSphereHits(0.0f), maxFaceExits(0.0f) {}
+};
+
+// Photon IDs [first, first + count) that one of `ranks` ranks simulates out
+// of `total`. Histories depend only on their ID, so any split of the range
+// gives the same summed tallies.
+struct PhotonShard {
+    uint64_t first;
+    uint64_t count;
+};
+
+inline PhotonShard photonShard(uint64_t total, int rank, int ranks) {
+    uint64_t base = total / (uint64_t)ranks, extra = total % (uint64_t)ranks;
+    uint64_t r = (uint64_t)rank;
+    PhotonShard shard = { r * base + std::min(r, extra), base + (r < extra ? 1 : 0) };
+    return shard;
+}
+
+// Versioned snapshot of a PhotonBatch: this header, then the SoA arrays and
+// the tally counts, each starting on a CHECKPOINT_ALIGNMENT boundary
+struct CheckpointHeader {
+    char magic[8];           // "PHOTCKP\0"
+    uint32_t version;
+    uint32_t mode;           // PropagationMode
+    uint64_t photons;        // Batch size
+    uint64_t seed;
+    uint64_t photonLimit;
+    uint64_t emitted;
+    uint64_t histories;
+    uint64_t sphereHits;
+    uint64_t boundaryExits;
+    uint64_t ticks;
+    uint64_t sphereCount;
+    uint64_t sceneHash;      // Scene::fingerprint() of the scene being run
+    uint64_t firstPhoton;
+    uint64_t scatters;
+    uint64_t escapedWeight;
+    uint32_t interactionModel;  // InteractionModel
+    float absorption;
+    float rouletteWeight;
+    uint32_t maxBounces;
+    float speed;
+    float gridHalfSize;
+    uint32_t faceCells;
+    uint32_t pathBins;
+    uint64_t fileSize;       // Catches truncated snapshots
+};
+const uint32_t CHECKPOINT_VERSION = 4;  // 2: firstPhoton; 3: interactions, weights and deposits; 4: deposit moments
+const char CHECKPOINT_MAGIC[8] = { 'P', 'H', 'O', 'T', 'C', 'K', 'P', '\0' };
+const size_t CHECKPOINT_ALIGNMENT = 64;
+
+inline size_t alignCheckpoint(size_t bytes) {
+    return (bytes + CHECKPOINT_ALIGNMENT - 1) / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT;
+}
+
+// Batch of photons stored as structure-of-arrays so the step loop streams
+// through contiguous memory. Directions are cached as unit vectors at emission.
+class PhotonBatch {
+public:
+    // Current position
+    std::vector<float> x, y, z;
+    // Unit direction, computed once per emission
+    std::vector<float> dirX, dirY, dirZ;
+    std::vector<float> currentLength;
+    std::vector<uint64_t> photonId;  // Sequence number of the photon in each slot
+    std::vector<float> weight;       // 1 unless roulette is on
+    std::vector<uint32_t> bounces;   // Scatters so far in the current history
+    // Weighted histories deposit at every hit; their score in the sphere they
+    // are depositing in is held here until they move on or end
+    std::vector<int32_t> scoreSphere;  // -1 = nothing pending
+    std::vector<float> score;
+    float speed;
+    float gridHalfSize;  // Half size of the grid for boundary checking
+    std::vector<uint8_t> alive;  // PhotonState of each slot
+    unsigned long long histories;  // Completed photon histories (hits + exits)
+    unsigned long long sphereHits;  // Histories that ended at a sphere
+    unsigned long long boundaryExits;
+    unsigned long long scatters;  // Hits the photon survived
+    unsigned long long ticks;
+    std::atomic<unsigned long long> emitted;  // Photons started so far
+    unsigned long long photonLimit;  // Stop emitting after this many photons
+    uint64_t firstPhoton;  // ID of the first photon; IDs run on from here
+    PropagationMode mode;
+    InteractionSettings interaction;
+    uint32_t regroupInterval;  // Ticks between regroup() passes, 0 = never
+    uint64_t seed;  // Philox key; with the photon ID it fixes every random draw
+    EventLog* eventLog;  // Receives hit and exit events, nullptr when off
+    Tally tally;  // Everything counted so far, merged after each update
+    std::vector<Tally> workerTallies;  // One per pool worker plus one for the caller
+
+    static const unsigned long long UNLIMITED = ~0ull;
+
+    // Values of alive[]; event mode holds finished photons for one tick so
+    // the renderer sees where they ended
+    enum PhotonState : uint8_t { PHOTON_RETIRED = 0, PHOTON_FLYING = 1, PHOTON_ENDED = 2 };
+
+    PhotonBatch(size_t count, PropagationMode propagationMode = STEP_MARCHING,
+                unsigned long long maxPhotons = UNLIMITED, uint64_t rngSeed = DEFAULT_PHOTON_SEED,
+                uint64_t firstId = 0) :
+        x(count, 0.0f), y(count, 0.0f), z(count, 0.0f),
+        dirX(count), dirY(count), dirZ(count),
+        currentLength(count, 0.0f),
+        photonId(count, 0),
+        weight(count, 1.0f),
+        bounces(count, 0),
+        scoreSphere(count, -1),
+        score(count, 0.0f),
+        speed(0.005f),
+        gridHalfSize((GRID_SIZE * CELL_SIZE) / 2.0f),
+        alive(count, PHOTON_FLYING),
+        histories(0),
+        sphereHits(0),
+        boundaryExits(0),
+        scatters(0),
+        ticks(0),
+        emitted(0),
+        photonLimit(maxPhotons),
+        firstPhoton(firstId),
+        mode(propagationMode),
+        interaction(DEFAULT_INTERACTION),
+        regroupInterval(0),
+        seed(rngSeed),
+        eventLog(nullptr) {
+        std::vector<uint32_t> slots(count);
+        for (size_t i = 0; i < count; i++)
+            slots[i] = (uint32_t)i;
+        emitSlots(slots.data(), count);
+    }
+
+    size_t size() const {
+        return x.size();
+    }
+
+    // True once every photon in the budget has been emitted and finished
+    bool finished() const {
+        return photonLimit != UNLIMITED && histories >= photonLimit;
+    }
+
+    // Shrink the budget to the photons already emitted: the ones in flight
+    // finish their histories, then finished() turns true
+    void stopEmitting() {
+        photonLimit = emitted.load();
+    }
+
+    // Claim the next photon ID from the budget; false once it is spent
+    bool claimPhoton(uint64_t& id) {
+        unsigned long long current = emitted.load(std::memory_order_relaxed);
+        while (current < photonLimit) {
+            if (emitted.compare_exchange_weak(current, current + 1, std::memory_order_relaxed)) {
+                id = firstPhoton + current;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void recordEvent(size_t i, PhotonEventType type, int sphere) {
+        PhotonEvent event = {};
+        event.photonId = photonId[i];
+        event.sphere = sphere;
+        event.type = type;
+        event.bounce = (uint8_t)std::min<uint32_t>(bounces[i], 255);
+        event.x = x[i];
+        event.y = y[i];
+        event.z = z[i];
+        event.pathLength = currentLength[i];
+        eventLog->record(event);
+    }
+
+    // Restart photon i at the center with a new random direction, or retire
+    // the slot if the photon budget is spent
+    void emit(size_t i) {
+        x[i] = y[i] = z[i] = 0.0f;  // Reset position to center
+        currentLength[i] = 0.0f;
+        weight[i] = 1.0f;
+        bounces[i] = 0;
+        if (!claimPhoton(photonId[i])) {
+            alive[i] = PHOTON_RETIRED;
+            return;
+        }
+        alive[i] = PHOTON_FLYING;
+        float u0, u1;
+        photonUniforms(photonId[i], 0, seed, u0, u1);
+        isotropicDirection(u0, u1, dirX[i], dirY[i], dirZ[i]);
+    }
+
+    // emit() for a list of slots, drawing all their directions in one pass.
+    // Gives the same directions as emitting the slots one by one.
+    void emitSlots(const uint32_t* slots, size_t n) {
+        ArenaScope scope;
+        Arena& arena = scope.arena;
+        uint64_t* ids = arena.allocate<uint64_t>(n);
+        uint32_t* liveSlots = arena.allocate<uint32_t>(n);
+        size_t live = 0;
+        for (size_t k = 0; k < n; k++) {
+            uint32_t i = slots[k];
+            x[i] = y[i] = z[i] = 0.0f;
+            currentLength[i] = 0.0f;
+            weight[i] = 1.0f;
+            bounces[i] = 0;
+            if (!claimPhoton(photonId[i])) {
+                alive[i] = PHOTON_RETIRED;
+                continue;
+            }
+            alive[i] = PHOTON_FLYING;
+            ids[live] = photonId[i];
+            liveSlots[live] = i;
+            live++;
+        }
+        float* u0 = arena.allocate<float>(live);
+        float* u1 = arena.allocate<float>(live);
+        float* dx = arena.allocate<float>(live);
+        float* dy = arena.allocate<float>(live);
+        float* dz = arena.allocate<float>(live);
+        isotropicDirections(ids, live, seed, u0, u1, dx, dy, dz);
+        for (size_t k = 0; k < live; k++) {
+            uint32_t i = liveSlots[k];
+            dirX[i] = dx[k];
+            dirY[i] = dy[k];
+            dirZ[i] = dz[k];
+        }
+    }
+
+    bool isOutsideCube(size_t i) const {
+        return (std::fabs(x[i]) > gridHalfSize ||
+                std::fabs(y[i]) > gridHalfSize ||
+                std::fabs(z[i]) > gridHalfSize);
+    }
+
+    // Advance every photon in the batch by one tick
+    // With a pool the batch is split into work-stealing chunks; without one it
+    // runs on the calling thread.
+    void update(const SphereScene& scene, ThreadPool* pool = nullptr) {
+        PHOTON_PROFILE_SCOPE("sim.update");
+        size_t threads = pool ? pool->size() + 1 : 1;
+        if (tally.sphereHits.size() != scene.table.count || workerTallies.size() != threads) {
+            if (tally.sphereHits.size() != scene.table.count)
+                tally = Tally(scene.table.count, gridHalfSize);
+            workerTallies.assign(threads, Tally(scene.table.count, gridHalfSize));
+        }
+
+        // Dispatch once per tick so the per-photon loops are specialized
+        PropagationKernel kernel = kernelFor(scene.accel, mode, interaction);
+        (this->*kernel)(scene, pool);
+        ticks++;
+        if (regroupInterval && ticks % regroupInterval == 0)
+            regroup();
+    }
+
+    // Counting-sort bucket of photon i: its cell's Morton code, then the
+    // octant of its direction
+    uint32_t regroupKey(size_t i) const {
+        float cellsPerUnit = GRID_SIZE / (2.0f * gridHalfSize);
+        auto cell = [&](float v) {
+            int c = (int)((v + gridHalfSize) * cellsPerUnit);
+            return (uint32_t)std::min(std::max(c, 0), GRID_SIZE - 1);
+        };
+        uint32_t octant = (dirX[i] < 0.0f ? 1u : 0u) | (dirY[i] < 0.0f ? 2u : 0u) | (dirZ[i] < 0.0f ? 4u : 0u);
+        return (mortonCode3(cell(x[i]), cell(y[i]), cell(z[i])) << 3) | octant;
+    }
+
+    // Reorder the slots so photons in the same cell heading the same way sit
+    // next to each other, and drop retired slots. After many bounces the
+    // photons in a chunk are scattered all over the cube; this keeps each
+    // chunk's queries in one part of the acceleration structure and the
+    // move loop free of dead lanes. Results do not change, since every
+    // random draw depends only on the photon ID, not its slot.
+    void regroup() {
+        PHOTON_PROFILE_SCOPE("sim.regroup");
+        ArenaScope scope;
+        Arena& arena = scope.arena;
+        size_t n = size();
+        uint32_t* keys = arena.allocate<uint32_t>(n);
+        uint32_t* offsets = arena.allocate<uint32_t>(REGROUP_BUCKETS + 1);
+        std::fill(offsets, offsets + REGROUP_BUCKETS + 1, 0u);
+        for (size_t i = 0; i < n; i++) {
+            if (alive[i] == PHOTON_RETIRED)
+                continue;
+            keys[i] = regroupKey(i);
+            offsets[keys[i] + 1]++;
+        }
+        for (uint32_t b = 0; b < REGROUP_BUCKETS; b++)
+            offsets[b + 1] += offsets[b];
+        size_t live = offsets[REGROUP_BUCKETS];
+        uint32_t* order = arena.allocate<uint32_t>(live);
+        for (size_t i = 0; i < n; i++) {
+            if (alive[i] != PHOTON_RETIRED)
+                order[offsets[keys[i]]++] = (uint32_t)i;
+        }
+
+        // Gather each array through one scratch buffer; shrinking keeps capacity
+        forEachPhotonArray([&](auto& values) {
+            typedef typename std::decay<decltype(values)>::type::value_type Value;
+            ArenaScope gather(arena);
+            Value* sorted = arena.allocate<Value>(live);
+            for (size_t k = 0; k < live; k++)
+                sorted[k] = values[order[k]];
+            std::copy(sorted, sorted + live, values.begin());
+            values.resize(live);
+        });
+    }
+
+    // Calls visit(array) for every per-slot array
+    template <class Visit>
+    void forEachPhotonArray(Visit visit) {
+        visit(x);
+        visit(y);
+        visit(z);
+        visit(dirX);
+        visit(dirY);
+        visit(dirZ);
+        visit(currentLength);
+        visit(photonId);
+        visit(weight);
+        visit(bounces);
+        visit(scoreSphere);
+        visit(score);
+        visit(alive);
+    }
+
+    // One specialization of the propagation loop, from kernelFor()
+    typedef void (PhotonBatch::*PropagationKernel)(const SphereScene&, ThreadPool*);
+
+    struct KernelTable {
+        PropagationKernel kernels[ACCELERATION_KIND_COUNT][2][INTERACTION_MODEL_COUNT][2];
+    };
+
+    // Registry of the specialized kernels: one instantiation of propagate()
+    // per acceleration structure, propagation mode, interaction model and
+    // analog or weighted absorption, so none of them is tested per photon
+    static PropagationKernel kernelFor(AccelerationKind accel, PropagationMode mode, const InteractionSettings& settings) {
+        static const KernelTable table = buildKernelTable();
+        bool weighted = settings.rouletteWeight > 0.0f;
+        return table.kernels[accel][mode][settings.model][weighted ? 1 : 0];
+    }
+
+    static KernelTable buildKernelTable() {
+        KernelTable table;
+        registerKernels<ACCEL_LINEAR, STEP_MARCHING>(table);
+        registerKernels<ACCEL_LINEAR, EVENT_DRIVEN>(table);
+        registerKernels<ACCEL_GRID, STEP_MARCHING>(table);
+        registerKernels<ACCEL_GRID, EVENT_DRIVEN>(table);
+        registerKernels<ACCEL_BVH, STEP_MARCHING>(table);
+        registerKernels<ACCEL_BVH, EVENT_DRIVEN>(table);
+        registerKernels<ACCEL_LATTICE, STEP_MARCHING>(table);
+        registerKernels<ACCEL_LATTICE, EVENT_DRIVEN>(table);
+        return table;
+    }
+
+    template <AccelerationKind Accel, PropagationMode Mode>
+    static void registerKernels(KernelTable& table) {
+        PropagationKernel (&kernels)[INTERACTION_MODEL_COUNT][2] = table.kernels[Accel][Mode];
+        // Absorption ends every history at its first hit, so weights never change
+        kernels[INTERACT_ABSORB][0] = &PhotonBatch::propagate<Accel, Mode, InteractionPolicy<INTERACT_ABSORB, false>>;
+        kernels[INTERACT_ABSORB][1] = kernels[INTERACT_ABSORB][0];
+        kernels[INTERACT_SPECULAR][0] = &PhotonBatch::propagate<Accel, Mode, InteractionPolicy<INTERACT_SPECULAR, false>>;
+        kernels[INTERACT_SPECULAR][1] = &PhotonBatch::propagate<Accel, Mode, InteractionPolicy<INTERACT_SPECULAR, true>>;
+        kernels[INTERACT_LAMBERTIAN][0] = &PhotonBatch::propagate<Accel, Mode, InteractionPolicy<INTERACT_LAMBERTIAN, false>>;
+        kernels[INTERACT_LAMBERTIAN][1] = &PhotonBatch::propagate<Accel, Mode, InteractionPolicy<INTERACT_LAMBERTIAN, true>>;
+        kernels[INTERACT_ISOTROPIC][0] = &PhotonBatch::propagate<Accel, Mode, InteractionPolicy<INTERACT_ISOTROPIC, false>>;
+        kernels[INTERACT_ISOTROPIC][1] = &PhotonBatch::propagate<Accel, Mode, InteractionPolicy<INTERACT_ISOTROPIC, true>>;
+    }
+
+    template <AccelerationKind Accel, PropagationMode Mode, class Policy>
+    void propagate(const SphereScene& scene, ThreadPool* pool) {
+        advance<Mode, Policy>(scene.table, scene.structure<Accel>(), pool);
+    }
+
+    // Arena bytes a chunk of n photons can use: its finished-slot list, then
+    // emitSlots()' IDs, live slots and five direction arrays, plus padding
+    static constexpr size_t chunkScratchBytes(size_t n) {
+        return n * (2 * sizeof(uint32_t) + sizeof(uint64_t) + 5 * sizeof(float)) + 16 * alignof(std::max_align_t);
+    }
+
+    // Histories finished (and scatters survived) within one chunk
+    struct ChunkCounts {
+        unsigned long long hits;
+        unsigned long long exits;
+        unsigned long long scatters;
+    };
+
+    template <PropagationMode Mode, class Policy, class Accel>
+    void advance(const SphereTable& spheres, const Accel& accel, ThreadPool* pool) {
+        std::atomic<unsigned long long> hits(0), exits(0), scattered(0);
+        static_assert(chunkScratchBytes(PROPAGATION_CHUNK_SIZE) <= WORKER_ARENA_BYTES, "Workers reserve too little arena");
+        auto body = [&](size_t begin, size_t end) {
+            Arena::forThread().reserve(chunkScratchBytes(std::max(end - begin, PROPAGATION_CHUNK_SIZE)));
+            ArenaScope scope;  // Everything a chunk allocates is gone when it ends
+            int worker = ThreadPool::currentWorker();
+            Tally& local = workerTallies[worker >= 0 ? (size_t)worker : workerTallies.size() - 1];
+            ChunkCounts counts;
+            if constexpr (Mode == EVENT_DRIVEN)
+                counts = traceEvents<Policy>(spheres, accel, begin, end, local);
+            else
+                counts = stepMarching<Policy>(spheres, accel, begin, end, local);
+            hits.fetch_add(counts.hits, std::memory_order_relaxed);
+            exits.fetch_add(counts.exits, std::memory_order_relaxed);
+            scattered.fetch_add(counts.scatters, std::memory_order_relaxed);
+        };
+        if (pool)
+            pool->parallelFor(size(), PROPAGATION_CHUNK_SIZE, body);
+        else
+            body(0, size());
+        sphereHits += hits.load();
+        boundaryExits += exits.load();
+        scatters += scattered.load();
+        histories = sphereHits + boundaryExits;
+        PHOTON_PROFILE_SCOPE("sim.merge");
+        for (Tally& local : workerTallies) {
+            if (!local.touched)
+                continue;
+            tally.merge(local);
+            local.clear();
+        }
+    }
+
+    // Move photons [begin, end) one fixed step and test the new positions
+    template <class Policy, class Accel>
+    ChunkCounts stepMarching(const SphereTable& spheres, const Accel& accel, size_t begin, size_t end, Tally& local) {
+        float* px = x.data();
+        float* py = y.data();
+        float* pz = z.data();
+        float* len = currentLength.data();
+        const float* ux = dirX.data();
+        const float* uy = dirY.data();
+        const float* uz = dirZ.data();
+
+        // Move all photons first; this loop has no branches and vectorizes
+        for (size_t i = begin; i < end; i++) {
+            px[i] += ux[i] * speed;
+            py[i] += uy[i] * speed;
+            pz[i] += uz[i] * speed;
+            len[i] += speed;
+        }
+
+        // Finished photons are re-emitted together at the end of the chunk
+        uint32_t* finishedSlots = Arena::forThread().allocate<uint32_t>(end - begin);
+        size_t finished = 0;
+        ChunkCounts counts = { 0, 0, 0 };
+        for (size_t i = begin; i < end; i++) {
+            if (!alive[i])
+                continue;
+            int result = collide<Policy>(i, spheres, accel, local);
+            if (result == 1)
+                counts.hits++;
+            else if (result < 0)
+                counts.exits++;
+            else if (result == 2)
+                counts.scatters++;
+            if (result == 1 || result < 0)
+                finishedSlots[finished++] = (uint32_t)i;
+        }
+        emitSlots(finishedSlots, finished);
+        return counts;
+    }
+
+    // Move photons [begin, end) straight to their next event: the nearest
+    // sphere hit or the cube exit. Each photon stays at its event point until
+    // the next tick so the renderer can show the traced path.
+    template <class Policy, class Accel>
+    ChunkCounts traceEvents(const SphereTable& spheres, const Accel& accel, size_t begin, size_t end, Tally& local) {
+        // Re-emit the photons whose history ended on the previous tick
+        uint32_t* finishedSlots = Arena::forThread().allocate<uint32_t>(end - begin);
+        size_t finished = 0;
+        for (size_t i = begin; i < end; i++) {
+            if (alive[i] == PHOTON_ENDED)
+                finishedSlots[finished++] = (uint32_t)i;
+        }
+        emitSlots(finishedSlots, finished);
+
+        ChunkCounts counts = { 0, 0, 0 };
+        for (size_t i = begin; i < end; i++) {
+            if (!alive[i])
+                continue;
+
+            float ox = x[i], oy = y[i], oz = z[i];
+            float ux = dirX[i], uy = dirY[i], uz = dirZ[i];
+            float tExit = rayCubeExitDistance(ox, oy, oz, ux, uy, uz, gridHalfSize);
+            float tHit;
+            int hit = accel.nearestHit(spheres, ox, oy, oz, ux, uy, uz, tExit, tHit);
+
+            x[i] = ox + ux * tHit;
+            y[i] = oy + uy * tHit;
+            z[i] = oz + uz * tHit;
+            currentLength[i] += tHit;
+            if (hit < 0) {
+                if (eventLog)
+                    recordEvent(i, EVENT_BOUNDARY_EXIT, -1);
+                local.recordExit(x[i], y[i], z[i], currentLength[i], weight[i]);
+                if constexpr (Policy::weighted)
+                    finishScore(i, local);
+                counts.exits++;
+                alive[i] = PHOTON_ENDED;
+            } else if (interact<Policy>(i, hit, spheres, local)) {
+                counts.hits++;
+                alive[i] = PHOTON_ENDED;
+            } else {
+                counts.scatters++;
+            }
+        }
+        return counts;
+    }
+
+    // Returns 1 if photon i's history ended at a sphere, -1 if it left the
+    // cube (either way the caller re-emits it), 2 if it scattered off a
+    // sphere and 0 if it is still in flight
+    template <class Policy, class Accel>
+    int collide(size_t i, const SphereTable& spheres, const Accel& accel, Tally& local) {
+        // Check for sphere collisions against the packed table
+        int hit = accel.firstHit(spheres, x[i], y[i], z[i]);
+        if (hit >= 0)
+            return interact<Policy>(i, hit, spheres, local) ? 1 : 2;
+
+        // Reset if photon hits cube boundary
+        if (isOutsideCube(i)) {
+            if (eventLog)
+                recordEvent(i, EVENT_BOUNDARY_EXIT, -1);
+            local.recordExit(x[i], y[i], z[i], currentLength[i], weight[i]);
+            if constexpr (Policy::weighted)
+                finishScore(i, local);
+            return -1;
+        }
+        return 0;
+    }
+
+    // Photon i has reached sphere `hit`. Applies the interaction model and
+    // returns true if the history ended there; otherwise the photon is back
+    // on the surface, heading out in its new direction. Bounce b draws its
+    // random numbers from Philox block b + 1 of the photon (block 0 was the
+    // emission), so every bounce is reproducible from the photon ID alone.
+    template <class Policy>
+    bool interact(size_t i, int hit, const SphereTable& spheres, Tally& local) {
+        local.recordHit(hit);
+        float u[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        bool ended = true;
+        if constexpr (Policy::model == INTERACT_ABSORB) {
+            deposit<Policy>(i, hit, weight[i], local);
+        } else {
+            photonUniforms4(photonId[i], bounces[i] + 1, seed, u);
+            ended = absorb<Policy>(i, hit, u, local);
+        }
+        if (ended) {
+            if constexpr (Policy::weighted)
+                finishScore(i, local);
+            if (eventLog)
+                recordEvent(i, EVENT_SPHERE_HIT, hit);
+            local.recordPath(currentLength[i]);
+            return true;
+        }
+        if constexpr (Policy::model != INTERACT_ABSORB)
+            scatter<Policy>(i, hit, spheres, u[2], u[3]);
+        if (eventLog)
+            recordEvent(i, EVENT_SCATTER, hit);
+        bounces[i]++;
+        return false;
+    }
+
+    // Absorption, roulette and the bounce limit for one hit; true if the
+    // history ends. u[0] decides analog absorption, u[1] the roulette.
+    template <class Policy>
+    bool absorb(size_t i, int hit, const float u[4], Tally& local) {
+        const InteractionSettings& settings = interaction;
+        if constexpr (!Policy::weighted) {
+            if (u[0] >= settings.absorption && bounces[i] < settings.maxBounces)
+                return false;
+            deposit<Policy>(i, hit, weight[i], local);
+            return true;
+        }
+        float absorbed = weight[i] * settings.absorption;
+        deposit<Policy>(i, hit, absorbed, local);
+        weight[i] -= absorbed;
+        if (bounces[i] >= settings.maxBounces) {
+            deposit<Policy>(i, hit, weight[i], local);
+            return true;
+        }
+        if (weight[i] < settings.rouletteWeight) {
+            if (u[1] * settings.rouletteWeight >= weight[i])
+                return true;  // Lost the roulette; its weight is dropped, which keeps the mean unbiased
+            weight[i] = settings.rouletteWeight;
+        }
+        return false;
+    }
+
+    // Photon i leaves `amount` of weight in sphere `hit`. An analog history
+    // deposits once, as it ends, so that is its whole score; a weighted one
+    // keeps adding to its pending score while it stays on the same sphere.
+    // A weighted history that returns to a sphere after scoring elsewhere
+    // counts there twice, which slightly understates that sphere's variance.
+    template <class Policy>
+    void deposit(size_t i, int hit, float amount, Tally& local) {
+        local.recordDeposit(hit, amount);
+        if constexpr (Policy::weighted) {
+            if (scoreSphere[i] != hit) {
+                finishScore(i, local);
+                scoreSphere[i] = hit;
+            }
+            score[i] += amount;
+        } else {
+            local.recordScore(hit, amount);
+        }
+    }
+
+    // Record photon i's pending score, at the end of its weighted history
+    // or when it starts depositing in another sphere
+    void finishScore(size_t i, Tally& local) {
+        if (scoreSphere[i] >= 0)
+            local.recordScore(scoreSphere[i], score[i]);
+        scoreSphere[i] = -1;
+        score[i] = 0.0f;
+    }
+
+    // Put photon i just outside sphere `hit`, along the normal through its
+    // position, and give it the outgoing direction of the interaction model
+    template <class Policy>
+    void scatter(size_t i, int hit, const SphereTable& spheres, float u0, float u1) {
+        float cx = spheres.centerX[hit], cy = spheres.centerY[hit], cz = spheres.centerZ[hit];
+        float nx = x[i] - cx, ny = y[i] - cy, nz = z[i] - cz;
+        float length = std::sqrt(nx * nx + ny * ny + nz * nz);
+        if (length < 1e-12f) {
+            // At the very center: leave back the way it came
+            nx = -dirX[i]; ny = -dirY[i]; nz = -dirZ[i];
+            length = 1.0f;
+        }
+        nx /= length; ny /= length; nz /= length;
+        // A hair outside, so the next containment test does not see this sphere again
+        float radius = std::sqrt(spheres.radiusSquared[hit]) * (1.0f + 1e-5f) + 1e-6f;
+        x[i] = cx + nx * radius;
+        y[i] = cy + ny * radius;
+        z[i] = cz + nz * radius;
+
+        float dx, dy, dz;
+        if constexpr (Policy::model == INTERACT_SPECULAR) {
+            float dn = dirX[i] * nx + dirY[i] * ny + dirZ[i] * nz;
+            dn = std::min(dn, 0.0f);  // Already heading out (a deep step-mode hit): keep going
+            dx = dirX[i] - 2.0f * dn * nx;
+            dy = dirY[i] - 2.0f * dn * ny;
+            dz = dirZ[i] - 2.0f * dn * nz;
+        } else {
+            // Lambertian: cos(theta) = sqrt(u); isotropic over the hemisphere: cos(theta) = u
+            float cosTheta = Policy::model == INTERACT_LAMBERTIAN ? std::sqrt(1.0f - u0) : 1.0f - u0;
+            float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+            float phi = 2.0f * (float)M_PI * u1;
+            float a = sinTheta * std::cos(phi), b = sinTheta * std::sin(phi);
+            float t[3], bt[3];
+            orthonormalBasis(nx, ny, nz, t, bt);
+            dx = a * t[0] + b * bt[0] + cosTheta * nx;
+            dy = a * t[1] + b * bt[1] + cosTheta * ny;
+            dz = a * t[2] + b * bt[2] + cosTheta * nz;
+        }
+        dirX[i] = dx;
+        dirY[i] = dy;
+        dirZ[i] = dz;
+    }
+
+    // Extend the trails of an evenly strided sample of at most maxPhotons photons
+    void recordTrails(PhotonTrails& trails, size_t maxPhotons) const {
+        size_t count = std::min(maxPhotons, size());
+        if (count == 0)
+            return;
+        if (trails.ids.size() != count)
+            trails.resize(count);
+        size_t stride = size() / count;
+        for (size_t k = 0; k < count; k++) {
+            size_t i = k * stride;
+            trails.record(k, photonId[i], alive[i] != 0, x[i], y[i], z[i]);
+        }
+    }
+
+    // Copy the tally entries changed since the last call into the heatmap snapshot
+    void publish(HeatmapSnapshot& snapshot) {
+        if (!tally.touched)
+            return;
+        std::lock_guard<std::mutex> lock(snapshot.mutex);
+        snapshot.sphereHits.resize(tally.sphereHits.size());
+        snapshot.faceExits.resize(tally.faceExits.size());
+        size_t begin = tally.changedBegin, end = tally.changedEnd;
+        for (size_t i = begin; i < end; i++) {
+            snapshot.sphereHits[i] = (float)tally.sphereHits[i];
+            snapshot.maxSphereHits = std::max(snapshot.maxSphereHits, snapshot.sphereHits[i]);
+        }
+        if (begin < end) {
+            if (snapshot.dirtyBegin == snapshot.dirtyEnd)
+                snapshot.dirtyBegin = begin;
+            snapshot.dirtyBegin = std::min(snapshot.dirtyBegin, begin);
+            snapshot.dirtyEnd = std::max(snapshot.dirtyEnd, end);
+        }
+        for (size_t i = 0; i < tally.faceExits.size(); i++) {
+            snapshot.faceExits[i] = (float)tally.faceExits[i];
+            snapshot.maxFaceExits = std::max(snapshot.maxFaceExits, snapshot.faceExits[i]);
+        }
+        snapshot.facesDirty = true;
+        tally.resetChanged();
+        tally.touched = false;
+    }
+
+    // Calls visit(data, bytes) for every array in a checkpoint of n photons
+    // and `spheres` spheres, in file order. Self is PhotonBatch or const
+    // PhotonBatch; visit may only use data once the arrays have those sizes.
+    template <class Self, class Visit>
+    static void forEachStateArray(Self& batch, size_t n, size_t spheres, Visit visit) {
+        const size_t faceCells = (size_t)FACE_COUNT * GRID_SIZE * GRID_SIZE;
+        visit(batch.x.data(), n * sizeof(float));
+        visit(batch.y.data(), n * sizeof(float));
+        visit(batch.z.data(), n * sizeof(float));
+        visit(batch.dirX.data(), n * sizeof(float));
+        visit(batch.dirY.data(), n * sizeof(float));
+        visit(batch.dirZ.data(), n * sizeof(float));
+        visit(batch.currentLength.data(), n * sizeof(float));
+        visit(batch.photonId.data(), n * sizeof(uint64_t));
+        visit(batch.alive.data(), n * sizeof(uint8_t));
+        visit(batch.weight.data(), n * sizeof(float));
+        visit(batch.bounces.data(), n * sizeof(uint32_t));
+        visit(batch.scoreSphere.data(), n * sizeof(int32_t));
+        visit(batch.score.data(), n * sizeof(float));
+        visit(batch.tally.sphereHits.data(), spheres * sizeof(uint64_t));
+        visit(batch.tally.sphereDeposit.data(), spheres * sizeof(uint64_t));
+        visit(batch.tally.faceExits.data(), faceCells * sizeof(uint64_t));
+        visit(batch.tally.pathLength.data(), PATH_LENGTH_BINS * sizeof(uint64_t));
+        visit(batch.tally.depositMoments.data(), spheres * sizeof(ScoreMoments));
+    }
+
+    // Bytes of a checkpoint of n photons and `spheres` spheres
+    size_t checkpointBytes(size_t n, size_t spheres) const {
+        size_t total = alignCheckpoint(sizeof(CheckpointHeader));
+        forEachStateArray(*this, n, spheres, [&](const void*, size_t bytes) { total += alignCheckpoint(bytes); });
+        return total;
+    }
+
+    // Serialize everything a restart needs into out, reusing its storage.
+    // Call between updates, when the worker tallies are already merged.
+    void saveState(std::vector<char>& out, uint64_t sceneHash) const {
+        size_t total = checkpointBytes(size(), tally.sphereHits.size());
+        out.resize(total);
+
+        CheckpointHeader header = {};
+        std::copy(CHECKPOINT_MAGIC, CHECKPOINT_MAGIC + 8, header.magic);
+        header.version = CHECKPOINT_VERSION;
+        header.mode = (uint32_t)mode;
+        header.photons = size();
+        header.seed = seed;
+        header.photonLimit = photonLimit;
+        header.emitted = emitted.load();
+        header.histories = histories;
+        header.sphereHits = sphereHits;
+        header.boundaryExits = boundaryExits;
+        header.ticks = ticks;
+        header.sphereCount = tally.sphereHits.size();
+        header.sceneHash = sceneHash;
+        header.firstPhoton = firstPhoton;
+        header.scatters = scatters;
+        header.escapedWeight = tally.escapedWeight;
+        header.interactionModel = (uint32_t)interaction.model;
+        header.absorption = interaction.absorption;
+        header.rouletteWeight = interaction.rouletteWeight;
+        header.maxBounces = interaction.maxBounces;
+        header.speed = speed;
+        header.gridHalfSize = gridHalfSize;
+        header.faceCells = (uint32_t)tally.faceExits.size();
+        header.pathBins = (uint32_t)tally.pathLength.size();
+        header.fileSize = total;
+        std::memcpy(out.data(), &header, sizeof(header));
+
+        size_t offset = alignCheckpoint(sizeof(CheckpointHeader));
+        forEachStateArray(*this, size(), tally.sphereHits.size(), [&](const void* data, size_t bytes) {
+            std::memcpy(out.data() + offset, data, bytes);
+            std::memset(out.data() + offset + bytes, 0, alignCheckpoint(bytes) - bytes);
+            offset += alignCheckpoint(bytes);
+        });
+    }
+
+    // Replace the whole batch with a snapshot written by saveState(). Returns
+    // false (after printing why) if it is damaged or from another scene; the
+    // whole header is checked first, so a rejected file leaves the batch as
+    // it was.
+    bool restoreState(const char* data, size_t size, size_t sceneSpheres, uint64_t sceneHash) {
+        CheckpointHeader header;
+        if (size < sizeof(header)) {
+            std::cerr << "Checkpoint is truncated" << std::endl;
+            return false;
+        }
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, CHECKPOINT_MAGIC, 8) != 0 || header.version != CHECKPOINT_VERSION) {
+            std::cerr << "Not a checkpoint, or an unsupported checkpoint version" << std::endl;
+            return false;
+        }
+        if (header.fileSize != size) {
+            std::cerr << "Checkpoint is truncated" << std::endl;
+            return false;
+        }
+        if (header.sphereCount != sceneSpheres || header.sceneHash != sceneHash) {
+            std::cerr << "Checkpoint was written for a different scene" << std::endl;
+            return false;
+        }
+        if (header.faceCells != (uint32_t)FACE_COUNT * GRID_SIZE * GRID_SIZE || header.pathBins != (uint32_t)PATH_LENGTH_BINS) {
+            std::cerr << "Checkpoint tally layout does not match this build" << std::endl;
+            return false;
+        }
+        // These index the kernel table, so a bad value must never get through
+        if (header.mode > EVENT_DRIVEN || header.interactionModel >= (uint32_t)INTERACTION_MODEL_COUNT) {
+            std::cerr << "Checkpoint has an unknown propagation mode or interaction model" << std::endl;
+            return false;
+        }
+        // Every photon takes more than a byte, which also keeps the sizes below from overflowing
+        if (header.photons == 0 || header.photons > size ||
+            checkpointBytes((size_t)header.photons, sceneSpheres) != size) {
+            std::cerr << "Checkpoint is damaged: its photon count does not match its size" << std::endl;
+            return false;
+        }
+
+        size_t n = (size_t)header.photons;
+        for (std::vector<float>* v : { &x, &y, &z, &dirX, &dirY, &dirZ, &currentLength })
+            v->resize(n);
+        photonId.resize(n);
+        alive.resize(n);
+        weight.resize(n);
+        bounces.resize(n);
+        scoreSphere.resize(n);
+        score.resize(n);
+        speed = header.speed;
+        gridHalfSize = header.gridHalfSize;
+        tally = Tally(sceneSpheres, gridHalfSize);
+        workerTallies.clear();  // Rebuilt for the pool on the next update
+
+        size_t offset = alignCheckpoint(sizeof(CheckpointHeader));
+        forEachStateArray(*this, n, sceneSpheres, [&](void* target, size_t bytes) {
+            std::memcpy(target, data + offset, bytes);
+            offset += alignCheckpoint(bytes);
+        });
+        for (size_t i = 0; i < n; i++) {
+            if (scoreSphere[i] >= (int32_t)sceneSpheres || scoreSphere[i] < -1) {
+                scoreSphere[i] = -1;  // Damaged pending score: drop it rather than index past the tally
+                score[i] = 0.0f;
+            }
+        }
+
+        mode = (PropagationMode)header.mode;
+        seed = header.seed;
+        photonLimit = header.photonLimit;
+        firstPhoton = header.firstPhoton;
+        scatters = header.scatters;
+        tally.escapedWeight = header.escapedWeight;
+        interaction.model = (InteractionModel)header.interactionModel;
+        interaction.absorption = header.absorption;
+        interaction.rouletteWeight = header.rouletteWeight;
+        interaction.maxBounces = header.maxBounces;
+        emitted = header.emitted;
+        histories = header.histories;
+        sphereHits = header.sphereHits;
+        boundaryExits = header.boundaryExits;
+        ticks = header.ticks;
+        return true;
+    }
+
+    // restoreState() from a checkpoint file, read through a private mapping
+    bool loadState(const std::string& path, size_t sceneSpheres, uint64_t sceneHash) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Failed to open checkpoint " << path << std::endl;
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            std::cerr << "Checkpoint " << path << " is empty" << std::endl;
+            close(fd);
+            return false;
+        }
+        size_t size = (size_t)info.st_size;
+        void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            std::cerr << "Failed to map checkpoint " << path << std::endl;
+            return false;
+        }
+        bool restored = restoreState((const char*)data, size, sceneSpheres, sceneHash);
+        munmap(data, size);
+        if (!restored)
+            std::cerr << "Could not resume from " << path << std::endl;
+        return restored;
+    }
+};
+
+// Writes checkpoints on a background thread so the simulation never waits
+// for the disk. Of the two buffers, one is being written while the
+// simulation fills the other; a snapshot taken while both are busy is
+// skipped. Files go to a temporary name, are synced and then renamed over
+// the previous checkpoint, so a crash mid-write leaves the old one intact.
+class CheckpointWriter {
+public:
+    enum BufferState { BUFFER_FREE, BUFFER_FILLING, BUFFER_QUEUED, BUFFER_WRITING };
+
+    std::string path;
+    std::vector<char> buffers[2];
+    BufferState states[2];
+    unsigned long long queuedTicks[2];
+    unsigned long long written;  // Checkpoints safely on disk
+    unsigned long long skipped;  // Snapshots dropped because both buffers were busy
+    unsigned long long failed;
+    unsigned long long lastTicks;  // Batch tick count of the newest checkpoint on disk
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    bool stopping;
+    std::thread writer;
+
+    CheckpointWriter() : written(0), skipped(0), failed(0), lastTicks(0), stopping(false) {
+        states[0] = states[1] = BUFFER_FREE;
+        queuedTicks[0] = queuedTicks[1] = 0;
+    }
+
+    ~CheckpointWriter() {
+        stop();
+    }
+
+    void start(const std::string& file) {
+        path = file;
+        stopping = false;
+        writer = std::thread(&CheckpointWriter::writerLoop, this);
+    }
+
+    // Snapshot the batch and queue it for writing. Returns false if it was
+    // skipped. A queued snapshot that has not started writing yet is replaced.
+    bool submit(const PhotonBatch& batch, uint64_t sceneHash) {
+        int k;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            k = states[0] == BUFFER_FREE ? 0 : (states[1] == BUFFER_FREE ? 1 : -1);
+            for (int j = 0; k < 0 && j < 2; j++) {
+                if (states[j] == BUFFER_QUEUED) {
+                    k = j;  // Overwrite the waiting snapshot with a newer one
+                    skipped++;
+                }
+            }
+            if (k < 0) {
+                skipped++;
+                return false;
+            }
+            states[k] = BUFFER_FILLING;
+        }
+        batch.saveState(buffers[k], sceneHash);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (states[1 - k] == BUFFER_QUEUED) {
+                states[1 - k] = BUFFER_FREE;  // Superseded before it was written
+                skipped++;
+            }
+            states[k] = BUFFER_QUEUED;
+            queuedTicks[k] = batch.ticks;
+        }
+        wake.notify_one();
+        return true;
+    }
+
+    // Block until everything queued is on disk
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [&]() { return states[0] == BUFFER_FREE && states[1] == BUFFER_FREE; });
+    }
+
+    // Finish queued writes and join the writer
+    void stop() {
+        if (!writer.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        writer.join();
+    }
+
+private:
+    void writerLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&]() { return stopping || states[0] == BUFFER_QUEUED || states[1] == BUFFER_QUEUED; });
+            // At most one buffer is queued at a time; submit() supersedes older ones
+            int k = states[0] == BUFFER_QUEUED ? 0 : (states[1] == BUFFER_QUEUED ? 1 : -1);
+            if (k < 0)
+                return;  // Stopping with nothing left to write
+            states[k] = BUFFER_WRITING;
+            unsigned long long ticks = queuedTicks[k];
+            lock.unlock();
+            bool ok = writeFile(buffers[k]);
+            lock.lock();
+            states[k] = BUFFER_FREE;
+            if (ok) {
+                written++;
+                lastTicks = ticks;
+            } else {
+                failed++;
+            }
+            idle.notify_all();
+        }
+    }
+
+    bool writeFile(const std::vector<char>& data) {
+        std::string temporary = path + ".tmp";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cerr << "Failed to open " << temporary << " for writing" << std::endl;
+            return false;
+        }
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+            if (n <= 0)
+                break;
+            done += (size_t)n;
+        }
+        bool ok = done == data.size() && fsync(fd) == 0;
+        ok = close(fd) == 0 && ok;
+        if (ok && rename(temporary.c_str(), path.c_str()) != 0)
+            ok = false;
+        if (!ok)
+            std::cerr << "Failed to write checkpoint " << path << std::endl;
+        return ok;
+    }
+};
+
+
+// Dense clusters of small spheres separated by empty space, standing in for
+// pixel arrays. Deterministic for a given seed.
+std::vector<SphereRecord> createClusteredSpheres(int clusters, int spheresPerCluster, unsigned seed);
+
+const char* accelerationName(AccelerationKind kind);
+
+// "absorb", "specular", "lambertian" or "isotropic"
+const char* interactionName(InteractionModel model);
+
+// Inverse of interactionName(); false for an unknown name
+bool parseInteractionModel(const std::string& name, InteractionModel& model);
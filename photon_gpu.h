@@ -0,0 +1,336 @@
+// GL 4.3 compute-shader propagation backend, shared by grid3d and photon_bench
+#pragma once
+
+#include <GL/glew.h>
+#include "photon_engine.h"
+
+const unsigned GPU_STEPS_PER_DISPATCH = 64;  // Steps per compute dispatch when unthrottled
+
+// GPU propagation backend (needs a GL 4.3 context). Photon state and the
+// sphere table live in shader storage buffers; a compute shader advances
+// every photon by several steps per dispatch and the renderer draws the
+// photon buffer directly as points. Step mode looks spheres up in the same
+// uniform grid the CPU uses; event mode scans the sphere table analytically.
+const char* const photonComputeShaderSource = R"(
+    #version 430 core
+    layout (local_size_x = 256) in;
+
+    struct Photon {
+        vec4 position;   // xyz, w = path length
+        vec4 direction;  // xyz unit vector, w = 1 while alive
+        uvec4 state;     // xy = 64-bit photon id, z = 1 when (re-)emission is due
+    };
+    layout (std430, binding = 0) buffer Photons { Photon photons[]; };
+    layout (std430, binding = 1) readonly buffer Spheres { vec4 spheres[]; };  // center, radius^2
+    layout (std430, binding = 2) buffer Counters {
+        uint sphereHits;
+        uint boundaryExits;
+        uint emitted;
+        uint photonLimit;
+    };
+    layout (std430, binding = 3) readonly buffer CellStart { uint cellStart[]; };
+    layout (std430, binding = 4) readonly buffer CellSpheres { uint cellSpheres[]; };
+
+    uniform uint photonCount;
+    uniform uint sphereCount;
+    uniform uint steps;
+    uniform float speed;
+    uniform float halfSize;
+    uniform bool eventDriven;
+    uniform int gridResolution;
+    uniform vec3 gridMin;
+    uniform vec3 gridInverseCellSize;
+    uniform uvec2 seed;    // 64-bit Philox key, low word first
+    uniform uvec2 idBase;  // Photons emitted before the counters were last reset
+
+    // Same Philox4x32-10 as the CPU path, so photon IDs map to the same draws
+    uvec4 philox4x32(uvec4 c, uvec2 k) {
+        for (int round = 0; round < 10; round++) {
+            uint hi0, lo0, hi1, lo1;
+            umulExtended(0xD2511F53u, c.x, hi0, lo0);
+            umulExtended(0xCD9E8D57u, c.z, hi1, lo1);
+            c = uvec4(hi1 ^ c.y ^ k.x, lo1, hi0 ^ c.w ^ k.y, lo0);
+            k += uvec2(0x9E3779B9u, 0xBB67AE85u);
+        }
+        return c;
+    }
+
+    void emit(inout Photon p) {
+        p.position = vec4(0.0);
+        uint claimed = atomicAdd(emitted, 1u);
+        if (claimed >= photonLimit) {
+            p.direction.w = 0.0;  // Budget spent: retire the slot
+            return;
+        }
+        uint carry;
+        uint idLow = uaddCarry(idBase.x, claimed, carry);
+        p.state = uvec4(idLow, idBase.y + carry, 0u, 0u);
+        uvec4 bits = philox4x32(uvec4(p.state.xy, 0u, 0u), seed);
+        float cosTheta = 1.0 - 2.0 * (float(bits.x >> 8) * (1.0 / 16777216.0));  // Isotropic on the sphere
+        float sinTheta = sqrt(max(0.0, 1.0 - cosTheta * cosTheta));
+        float phi = 6.28318530718 * (float(bits.y >> 8) * (1.0 / 16777216.0));
+        p.direction = vec4(sinTheta * cos(phi), cosTheta, sinTheta * sin(phi), 1.0);
+    }
+
+    int firstHit(vec3 p) {
+        ivec3 cell = clamp(ivec3((p - gridMin) * gridInverseCellSize), ivec3(0), ivec3(gridResolution - 1));
+        int c = (cell.z * gridResolution + cell.y) * gridResolution + cell.x;
+        for (uint k = cellStart[c]; k < cellStart[c + 1]; k++) {
+            uint i = cellSpheres[k];
+            vec3 d = p - spheres[i].xyz;
+            if (dot(d, d) <= spheres[i].w)
+                return int(i);
+        }
+        return -1;
+    }
+
+    float nearestHit(vec3 o, vec3 u, float tMax, out int nearest) {
+        nearest = -1;
+        for (uint i = 0u; i < sphereCount; i++) {
+            vec3 oc = o - spheres[i].xyz;
+            float b = dot(oc, u);
+            float c = dot(oc, oc) - spheres[i].w;
+            float disc = b * b - c;
+            float t = (c <= 0.0) ? 0.0 : ((disc < 0.0 || b > 0.0) ? -1.0 : -b - sqrt(disc));
+            if (t >= 0.0 && t < tMax) {
+                tMax = t;
+                nearest = int(i);
+            }
+        }
+        return tMax;
+    }
+
+    void main() {
+        uint index = gl_GlobalInvocationID.x;
+        if (index >= photonCount)
+            return;
+        Photon p = photons[index];
+        for (uint s = 0u; s < steps && p.direction.w > 0.0; s++) {
+            if (p.state.z != 0u) {
+                emit(p);  // Previous step ended this photon's history
+                if (p.direction.w == 0.0)
+                    break;
+            }
+            if (eventDriven) {
+                vec3 u = p.direction.xyz;
+                vec3 slabU = mix(u, vec3(1e-20), equal(u, vec3(0.0)));  // No 0/0 in the slab test
+                vec3 exitT = (sign(slabU) * halfSize - p.position.xyz) / slabU;
+                float tExit = max(0.0, min(exitT.x, min(exitT.y, exitT.z)));
+                int hit;
+                float t = nearestHit(p.position.xyz, u, tExit, hit);
+                p.position += vec4(u * t, t);
+                if (hit >= 0) atomicAdd(sphereHits, 1u); else atomicAdd(boundaryExits, 1u);
+                p.state.z = 1u;
+            } else {
+                p.position += vec4(p.direction.xyz * speed, speed);
+                if (firstHit(p.position.xyz) >= 0) {
+                    atomicAdd(sphereHits, 1u);
+                    p.state.z = 1u;
+                } else if (any(greaterThan(abs(p.position.xyz), vec3(halfSize)))) {
+                    atomicAdd(boundaryExits, 1u);
+                    p.state.z = 1u;
+                }
+            }
+        }
+        photons[index] = p;
+    }
+)";
+
+class GpuPhotonEngine {
+public:
+    struct GpuPhoton {
+        float position[4];
+        float direction[4];
+        uint32_t state[4];
+    };
+    struct GpuCounters {
+        uint32_t sphereHits;
+        uint32_t boundaryExits;
+        uint32_t emitted;
+        uint32_t photonLimit;
+    };
+
+    GLuint program;
+    GLint stepsLocation, idBaseLocation;  // The uniforms that change per dispatch
+    GLuint photonBuffer, sphereBuffer, counterBuffer, cellStartBuffer, cellSpheresBuffer;
+    GLuint pointVAO;  // Draws photonBuffer directly as GL_POINTS
+    size_t photonCount;
+    size_t sphereCount;
+    UniformGrid grid;
+    PropagationMode mode;
+    float speed;
+    float halfSize;
+    unsigned long long sphereHits;
+    unsigned long long boundaryExits;
+    unsigned long long emitted;
+    unsigned long long photonLimit;
+    unsigned long long ticks;
+    uint64_t seed;
+
+    GpuPhotonEngine() : program(0), stepsLocation(-1), idBaseLocation(-1), photonBuffer(0), sphereBuffer(0), counterBuffer(0),
+        cellStartBuffer(0), cellSpheresBuffer(0), pointVAO(0), photonCount(0), sphereCount(0),
+        mode(STEP_MARCHING), speed(0.005f), halfSize((GRID_SIZE * CELL_SIZE) / 2.0f),
+        sphereHits(0), boundaryExits(0), emitted(0), photonLimit(PhotonBatch::UNLIMITED), ticks(0),
+        seed(DEFAULT_PHOTON_SEED) {}
+
+    ~GpuPhotonEngine() {
+        release();
+    }
+
+    // Free the GL objects; must run while the context is still current
+    void release() {
+        if (!program)
+            return;
+        GLuint buffers[] = { photonBuffer, sphereBuffer, counterBuffer, cellStartBuffer, cellSpheresBuffer };
+        glDeleteBuffers(5, buffers);
+        glDeleteVertexArrays(1, &pointVAO);
+        glDeleteProgram(program);
+        program = photonBuffer = sphereBuffer = counterBuffer = cellStartBuffer = cellSpheresBuffer = pointVAO = 0;
+    }
+
+    unsigned long long histories() const {
+        return sphereHits + boundaryExits;
+    }
+
+    bool finished() const {
+        return photonLimit != PhotonBatch::UNLIMITED && histories() >= photonLimit;
+    }
+
+    // Needs a current GL 4.3 context. Returns false (after printing why) on failure.
+    bool init(const SphereTable& table, size_t count, PropagationMode propagationMode,
+              int gridResolution, unsigned long long maxPhotons = PhotonBatch::UNLIMITED,
+              uint64_t rngSeed = DEFAULT_PHOTON_SEED) {
+        if (!GLEW_VERSION_4_3) {
+            std::cerr << "GPU backend needs OpenGL 4.3 compute shaders" << std::endl;
+            return false;
+        }
+        photonCount = count;
+        sphereCount = table.count;
+        mode = propagationMode;
+        photonLimit = maxPhotons;
+        seed = rngSeed;
+
+        GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+        glShaderSource(shader, 1, &photonComputeShaderSource, nullptr);
+        glCompileShader(shader);
+        GLint ok = 0;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+        if (!ok) {
+            char log[2048];
+            glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+            std::cerr << "Photon compute shader failed to compile:\n" << log << std::endl;
+            glDeleteShader(shader);
+            return false;
+        }
+        program = glCreateProgram();
+        glAttachShader(program, shader);
+        glLinkProgram(program);
+        glDeleteShader(shader);
+        glGetProgramiv(program, GL_LINK_STATUS, &ok);
+        if (!ok) {
+            std::cerr << "Photon compute shader failed to link" << std::endl;
+            return false;
+        }
+
+        // The rest of the uniforms are fixed for the life of the program
+        glUseProgram(program);
+        glUniform1ui(glGetUniformLocation(program, "photonCount"), (GLuint)photonCount);
+        glUniform1ui(glGetUniformLocation(program, "sphereCount"), (GLuint)sphereCount);
+        glUniform1f(glGetUniformLocation(program, "speed"), speed);
+        glUniform1f(glGetUniformLocation(program, "halfSize"), halfSize);
+        glUniform1i(glGetUniformLocation(program, "eventDriven"), mode == EVENT_DRIVEN);
+        glUniform2ui(glGetUniformLocation(program, "seed"), (GLuint)seed, (GLuint)(seed >> 32));
+        stepsLocation = glGetUniformLocation(program, "steps");
+        idBaseLocation = glGetUniformLocation(program, "idBase");
+
+        // Every photon starts with its emission due, so the first step draws
+        // its ID from the budget
+        std::vector<GpuPhoton> initial(photonCount);
+        for (GpuPhoton& photon : initial) {
+            photon = GpuPhoton{ { 0.0f, 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 0.0f, 1.0f }, { 0, 0, 1, 0 } };
+        }
+        std::vector<float> packedSpheres(std::max<size_t>(1, sphereCount) * 4, 0.0f);
+        for (size_t i = 0; i < sphereCount; i++) {
+            packedSpheres[i * 4 + 0] = table.centerX[i];
+            packedSpheres[i * 4 + 1] = table.centerY[i];
+            packedSpheres[i * 4 + 2] = table.centerZ[i];
+            packedSpheres[i * 4 + 3] = table.radiusSquared[i];
+        }
+        grid = UniformGrid(table, halfSize, gridResolution);
+        glUniform1i(glGetUniformLocation(program, "gridResolution"), grid.resolution);
+        glUniform3f(glGetUniformLocation(program, "gridMin"), grid.boundsMin[0], grid.boundsMin[1], grid.boundsMin[2]);
+        glUniform3f(glGetUniformLocation(program, "gridInverseCellSize"),
+                    grid.inverseCellSize[0], grid.inverseCellSize[1], grid.inverseCellSize[2]);
+
+        glGenBuffers(1, &photonBuffer);
+        glGenBuffers(1, &sphereBuffer);
+        glGenBuffers(1, &counterBuffer);
+        glGenBuffers(1, &cellStartBuffer);
+        glGenBuffers(1, &cellSpheresBuffer);
+        uploadStorage(photonBuffer, initial.size() * sizeof(GpuPhoton), initial.data(), GL_DYNAMIC_COPY);
+        uploadStorage(sphereBuffer, packedSpheres.size() * sizeof(float), packedSpheres.data(), GL_STATIC_DRAW);
+        uploadStorage(cellStartBuffer, grid.cellStart.size() * sizeof(uint32_t), grid.cellStart.data(), GL_STATIC_DRAW);
+        std::vector<uint32_t> cellSpheres = grid.cellSpheres;
+        if (cellSpheres.empty())
+            cellSpheres.push_back(0);
+        uploadStorage(cellSpheresBuffer, cellSpheres.size() * sizeof(uint32_t), cellSpheres.data(), GL_STATIC_DRAW);
+        GpuCounters counters = { 0, 0, 0, remainingBudget() };
+        uploadStorage(counterBuffer, sizeof(counters), &counters, GL_DYNAMIC_READ);
+
+        // The same buffer doubles as a vertex buffer for drawing
+        glGenVertexArrays(1, &pointVAO);
+        glBindVertexArray(pointVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, photonBuffer);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(GpuPhoton), (void*)0);
+        glEnableVertexAttribArray(0);
+        glBindVertexArray(0);
+        return true;
+    }
+
+    static void uploadStorage(GLuint buffer, size_t bytes, const void* data, GLenum usage) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, bytes, data, usage);
+    }
+
+    // The shader counts emissions in 32 bits, so the budget is handed over in
+    // pieces between counter readbacks; photon IDs on the GPU wrap at 2^32
+    uint32_t remainingBudget() const {
+        if (photonLimit == PhotonBatch::UNLIMITED)
+            return 0xffffffffu;
+        return (uint32_t)std::min<unsigned long long>(photonLimit - emitted, 0xffffffffull);
+    }
+
+    // Advance every photon by the given number of steps (events in event mode)
+    void dispatch(unsigned steps) {
+        glUseProgram(program);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, photonBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, sphereBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, counterBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, cellStartBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, cellSpheresBuffer);
+        glUniform1ui(stepsLocation, steps);
+        glUniform2ui(idBaseLocation, (GLuint)emitted, (GLuint)(emitted >> 32));
+        glDispatchCompute((GLuint)((photonCount + 255) / 256), 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT |
+                        GL_BUFFER_UPDATE_BARRIER_BIT);
+        ticks += steps;
+    }
+
+    // Fold the GPU's 32-bit counters into the 64-bit totals and reset them.
+    // This waits for the GPU, so call it sparingly.
+    void readCounters() {
+        GpuCounters counters;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, counterBuffer);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), &counters);
+        sphereHits += counters.sphereHits;
+        boundaryExits += counters.boundaryExits;
+        emitted += std::min(counters.emitted, counters.photonLimit);
+        GpuCounters reset = { 0, 0, 0, remainingBudget() };
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(reset), &reset);
+    }
+
+    void drawPoints() const {
+        glBindVertexArray(pointVAO);
+        glDrawArrays(GL_POINTS, 0, (GLsizei)photonCount);
+    }
+};
@@ -0,0 +1,208 @@
+// Columnar export of the event stream and the final tallies to HDF5. Events
+// are buffered into row groups of ROW_GROUP rows and each column is appended
+// to its own chunked, shuffled and deflated dataset, so memory stays at one
+// row group however long the run is. Only built with PHOTON_ENABLE_HDF5.
+//
+// Layout:
+//   /events/{photon_id, type, sphere, x, y, z, path_length, bounce}
+//   /tally/{sphere_hits, sphere_deposit, face_exits, path_length}
+// Root attributes: format_version, row_group, events; sphere_deposit carries
+// weight_scale (deposits are fixed point, divide by it for weights).
+#pragma once
+
+#include <hdf5.h>
+#include "photon_engine.h"
+
+const uint32_t HDF5_EXPORT_VERSION = 1;
+
+class Hdf5Export : public EventSink {
+public:
+    static const size_t ROW_GROUP = 1 << 16;  // Rows per chunk and per append
+    static const int DEFLATE_LEVEL = 4;
+
+    // One /events dataset and the current row group's values for it
+    struct Column {
+        const char* name;
+        hid_t type;
+        size_t width;  // Bytes per value
+        hid_t dataset;
+        std::vector<unsigned char> values;
+    };
+
+    hid_t file;
+    hid_t events;
+    std::vector<Column> columns;
+    size_t buffered;            // Rows in the current row group
+    unsigned long long rows;    // Rows already in the file
+    bool failed;                // A write has failed; the export stops
+
+    Hdf5Export() : file(-1), events(-1), buffered(0), rows(0), failed(false) {
+        columns = {
+            { "photon_id", H5T_NATIVE_UINT64, sizeof(uint64_t), -1, {} },
+            { "type", H5T_NATIVE_UINT8, sizeof(uint8_t), -1, {} },
+            { "sphere", H5T_NATIVE_INT32, sizeof(int32_t), -1, {} },
+            { "x", H5T_NATIVE_FLOAT, sizeof(float), -1, {} },
+            { "y", H5T_NATIVE_FLOAT, sizeof(float), -1, {} },
+            { "z", H5T_NATIVE_FLOAT, sizeof(float), -1, {} },
+            { "path_length", H5T_NATIVE_FLOAT, sizeof(float), -1, {} },
+            { "bounce", H5T_NATIVE_UINT8, sizeof(uint8_t), -1, {} },
+        };
+    }
+
+    ~Hdf5Export() {
+        close();
+    }
+
+    Hdf5Export(const Hdf5Export&) = delete;
+    Hdf5Export& operator=(const Hdf5Export&) = delete;
+
+    // Returns false (after printing why) if the file cannot be created
+    bool open(const std::string& path) {
+        H5Eset_auto2(H5E_DEFAULT, nullptr, nullptr);  // Failures are reported here instead
+        file = H5Fcreate(path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+        if (file < 0) {
+            std::cerr << "Failed to create HDF5 file " << path << std::endl;
+            return false;
+        }
+        events = H5Gcreate2(file, "events", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+
+        // Empty, unlimited 1-D datasets, grown by one row group per append
+        hsize_t empty = 0, unlimited = H5S_UNLIMITED, chunk = ROW_GROUP;
+        hid_t space = H5Screate_simple(1, &empty, &unlimited);
+        hid_t properties = compressedChunks(chunk);
+        for (Column& column : columns) {
+            column.dataset = H5Dcreate2(events, column.name, column.type, space, H5P_DEFAULT, properties, H5P_DEFAULT);
+            column.values.resize(ROW_GROUP * column.width);
+            if (column.dataset < 0)
+                failed = true;
+        }
+        H5Pclose(properties);
+        H5Sclose(space);
+        if (events < 0 || failed) {
+            std::cerr << "Failed to create the event datasets in " << path << std::endl;
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    // EventSink: called on the event writer thread
+    void write(const PhotonEvent* batch, size_t count) override {
+        for (size_t k = 0; k < count && !failed; k++) {
+            const PhotonEvent& event = batch[k];
+            const void* fields[] = { &event.photonId, &event.type, &event.sphere, &event.x, &event.y, &event.z,
+                                     &event.pathLength, &event.bounce };
+            for (size_t c = 0; c < columns.size(); c++)
+                std::memcpy(columns[c].values.data() + buffered * columns[c].width, fields[c], columns[c].width);
+            if (++buffered == ROW_GROUP)
+                flushRowGroup();
+        }
+    }
+
+    // Append the buffered rows to every column
+    void flushRowGroup() {
+        if (buffered == 0 || failed)
+            return;
+        hsize_t start = rows, count = buffered, extent = rows + buffered;
+        hid_t memory = H5Screate_simple(1, &count, nullptr);
+        for (Column& column : columns) {
+            hid_t space = -1;
+            bool ok = H5Dset_extent(column.dataset, &extent) >= 0 && (space = H5Dget_space(column.dataset)) >= 0 &&
+                      H5Sselect_hyperslab(space, H5S_SELECT_SET, &start, nullptr, &count, nullptr) >= 0 &&
+                      H5Dwrite(column.dataset, column.type, memory, space, H5P_DEFAULT, column.values.data()) >= 0;
+            if (space >= 0)
+                H5Sclose(space);
+            if (!ok) {
+                std::cerr << "Failed to append to HDF5 column " << column.name << std::endl;
+                failed = true;
+                break;
+            }
+        }
+        H5Sclose(memory);
+        rows += buffered;
+        buffered = 0;
+    }
+
+    // Write the run's tallies under /tally. Call once the event log has stopped.
+    bool writeTally(const Tally& tally) {
+        if (file < 0 || failed)
+            return false;
+        hid_t group = H5Gcreate2(file, "tally", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        bool ok = group >= 0 &&
+                  writeCounts(group, "sphere_hits", tally.sphereHits) &&
+                  writeCounts(group, "sphere_deposit", tally.sphereDeposit) &&
+                  writeCounts(group, "face_exits", tally.faceExits) &&
+                  writeCounts(group, "path_length", tally.pathLength);
+        if (ok) {
+            hid_t deposit = H5Dopen2(group, "sphere_deposit", H5P_DEFAULT);
+            double scale = WEIGHT_SCALE;
+            ok = writeAttribute(deposit, "weight_scale", H5T_NATIVE_DOUBLE, &scale);
+            H5Dclose(deposit);
+        }
+        if (group >= 0)
+            H5Gclose(group);
+        if (!ok) {
+            std::cerr << "Failed to write the tallies to the HDF5 file" << std::endl;
+            failed = true;
+        }
+        return ok;
+    }
+
+    // Flush the last partial row group and close the file. Returns false if
+    // any part of the export failed.
+    bool close() {
+        if (file < 0)
+            return !failed;
+        flushRowGroup();
+        uint32_t version = HDF5_EXPORT_VERSION;
+        unsigned long long rowGroup = ROW_GROUP;
+        if (!writeAttribute(file, "format_version", H5T_NATIVE_UINT32, &version) ||
+            !writeAttribute(file, "row_group", H5T_NATIVE_ULLONG, &rowGroup) ||
+            !writeAttribute(file, "events", H5T_NATIVE_ULLONG, &rows))
+            failed = true;
+        for (Column& column : columns) {
+            if (column.dataset >= 0)
+                H5Dclose(column.dataset);
+            column.dataset = -1;
+        }
+        if (events >= 0)
+            H5Gclose(events);
+        if (H5Fclose(file) < 0)
+            failed = true;
+        file = events = -1;
+        return !failed;
+    }
+
+private:
+    static hid_t compressedChunks(hsize_t chunk) {
+        hid_t properties = H5Pcreate(H5P_DATASET_CREATE);
+        H5Pset_chunk(properties, 1, &chunk);
+        H5Pset_shuffle(properties);  // Byte-transpose first; IDs and positions compress far better
+        H5Pset_deflate(properties, DEFLATE_LEVEL);
+        return properties;
+    }
+
+    static bool writeCounts(hid_t group, const char* name, const std::vector<uint64_t>& counts) {
+        hsize_t size = counts.size();
+        hid_t space = H5Screate_simple(1, &size, nullptr);
+        hid_t properties = size > 0 ? compressedChunks(std::min<hsize_t>(size, ROW_GROUP)) : H5Pcreate(H5P_DATASET_CREATE);
+        hid_t dataset = H5Dcreate2(group, name, H5T_NATIVE_UINT64, space, H5P_DEFAULT, properties, H5P_DEFAULT);
+        bool ok = dataset >= 0 &&
+                  (size == 0 || H5Dwrite(dataset, H5T_NATIVE_UINT64, H5S_ALL, H5S_ALL, H5P_DEFAULT, counts.data()) >= 0);
+        if (dataset >= 0)
+            H5Dclose(dataset);
+        H5Pclose(properties);
+        H5Sclose(space);
+        return ok;
+    }
+
+    static bool writeAttribute(hid_t object, const char* name, hid_t type, const void* value) {
+        hid_t space = H5Screate(H5S_SCALAR);
+        hid_t attribute = H5Acreate2(object, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+        bool ok = attribute >= 0 && H5Awrite(attribute, type, value) >= 0;
+        if (attribute >= 0)
+            H5Aclose(attribute);
+        H5Sclose(space);
+        return ok;
+    }
+};
@@ -0,0 +1,173 @@
+// Distributed runs: every rank propagates its own photonShard() of the ID
+// range against a replicated scene, then the counts are summed onto rank 0.
+// Only built with PHOTON_ENABLE_MPI.
+#pragma once
+
+#include <mpi.h>
+#include "photon_engine.h"
+
+// MPI_Init / MPI_Finalize for the life of main()
+class MpiSession {
+public:
+    int rank;
+    int ranks;
+
+    MpiSession(int& argc, char**& argv) : rank(0), ranks(1) {
+        MPI_Init(&argc, &argv);
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+    }
+
+    ~MpiSession() {
+        MPI_Finalize();
+    }
+
+    MpiSession(const MpiSession&) = delete;
+    MpiSession& operator=(const MpiSession&) = delete;
+};
+
+// ScoreMoments travel as opaque 24-byte records and are combined with the
+// Chan et al. pairwise merge. The op is declared non-commutative so MPI
+// merges in rank order and every run of the same ranks rounds the same way.
+static_assert(std::is_trivially_copyable<ScoreMoments>::value, "ScoreMoments is sent as raw bytes");
+
+class MomentsReduction {
+public:
+    MPI_Datatype type;
+    MPI_Op op;
+
+    MomentsReduction() {
+        MPI_Type_contiguous((int)sizeof(ScoreMoments), MPI_BYTE, &type);
+        MPI_Type_commit(&type);
+        MPI_Op_create(&MomentsReduction::mergeInto, 0, &op);
+    }
+
+    ~MomentsReduction() {
+        MPI_Op_free(&op);
+        MPI_Type_free(&type);
+    }
+
+    MomentsReduction(const MomentsReduction&) = delete;
+    MomentsReduction& operator=(const MomentsReduction&) = delete;
+
+    // inout[i] = in[i] merged with inout[i], lower ranks on the left
+    static void mergeInto(void* in, void* inout, int* length, MPI_Datatype*) {
+        const ScoreMoments* left = static_cast<const ScoreMoments*>(in);
+        ScoreMoments* right = static_cast<ScoreMoments*>(inout);
+        for (int i = 0; i < *length; i++) {
+            ScoreMoments merged = left[i];
+            merged.merge(right[i]);
+            right[i] = merged;
+        }
+    }
+};
+
+// Merge every rank's moments in place, onto rank 0 only or (everyRank) onto
+// all of them. A tree reduction like the counts, so log(ranks) steps.
+inline void reduceMoments(std::vector<ScoreMoments>& moments, MPI_Comm comm, bool everyRank = false) {
+    MomentsReduction reduction;
+    if (everyRank) {
+        MPI_Allreduce(MPI_IN_PLACE, moments.data(), (int)moments.size(), reduction.type, reduction.op, comm);
+        return;
+    }
+    int rank = 0;
+    MPI_Comm_rank(comm, &rank);
+    if (rank == 0)
+        MPI_Reduce(MPI_IN_PLACE, moments.data(), (int)moments.size(), reduction.type, reduction.op, 0, comm);
+    else
+        MPI_Reduce(moments.data(), nullptr, (int)moments.size(), reduction.type, reduction.op, 0, comm);
+}
+
+// Sum every rank's history counters and tally into rank 0's batch; ticks
+// become the maximum over ranks. The counts go through one MPI_Reduce and
+// the deposit moments through reduceMoments(); MPI runs both as trees, so
+// the cost grows with log(ranks). Other ranks keep their local counts.
+inline void reduceBatch(PhotonBatch& batch, size_t sphereCount, MPI_Comm comm) {
+    int rank = 0;
+    MPI_Comm_rank(comm, &rank);
+    Tally& tally = batch.tally;
+    if (tally.sphereHits.size() != sphereCount)
+        tally = Tally(sphereCount, batch.gridHalfSize);  // A rank with an empty shard never updated
+    std::vector<uint64_t> counts;
+    counts.reserve(6 + 2 * tally.sphereHits.size() + tally.faceExits.size() + tally.pathLength.size());
+    counts.push_back(batch.sphereHits);
+    counts.push_back(batch.boundaryExits);
+    counts.push_back(batch.emitted.load());
+    counts.push_back(batch.histories);
+    counts.push_back(batch.scatters);
+    counts.push_back(tally.escapedWeight);
+    counts.insert(counts.end(), tally.sphereHits.begin(), tally.sphereHits.end());
+    counts.insert(counts.end(), tally.sphereDeposit.begin(), tally.sphereDeposit.end());
+    counts.insert(counts.end(), tally.faceExits.begin(), tally.faceExits.end());
+    counts.insert(counts.end(), tally.pathLength.begin(), tally.pathLength.end());
+
+    if (rank == 0)
+        MPI_Reduce(MPI_IN_PLACE, counts.data(), (int)counts.size(), MPI_UINT64_T, MPI_SUM, 0, comm);
+    else
+        MPI_Reduce(counts.data(), nullptr, (int)counts.size(), MPI_UINT64_T, MPI_SUM, 0, comm);
+    unsigned long long ticks = batch.ticks, maxTicks = 0;
+    MPI_Reduce(&ticks, &maxTicks, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0, comm);
+
+    reduceMoments(tally.depositMoments, comm);
+    if (rank != 0)
+        return;
+
+    const uint64_t* p = counts.data();
+    batch.sphereHits = p[0];
+    batch.boundaryExits = p[1];
+    batch.emitted = p[2];
+    batch.histories = p[3];
+    batch.scatters = p[4];
+    tally.escapedWeight = p[5];
+    batch.ticks = maxTicks;
+    p += 6;
+    std::copy(p, p + tally.sphereHits.size(), tally.sphereHits.begin());
+    p += tally.sphereHits.size();
+    std::copy(p, p + tally.sphereDeposit.size(), tally.sphereDeposit.begin());
+    p += tally.sphereDeposit.size();
+    std::copy(p, p + tally.faceExits.size(), tally.faceExits.begin());
+    p += tally.faceExits.size();
+    std::copy(p, p + tally.pathLength.size(), tally.pathLength.begin());
+}
+
+// An error target judged on every rank's moments merged, so all ranks reach
+// the same verdict on the same check and stop emitting together. check() is
+// collective and runs once per tick: two MPI_Allreduce calls, one over the
+// target spheres' moments. Ranks whose own work has ended keep calling it
+// until anyRunning turns false, which keeps every rank's calls matched.
+class DistributedProgress {
+public:
+    Tally merged;                  // Only the target spheres' depositMoments are filled in
+    unsigned long long histories;  // Over all ranks, as of the last check
+    bool anyRunning;               // Some rank still had work at the last check
+
+    DistributedProgress(size_t sphereCount, float halfSize) :
+        merged(sphereCount, halfSize), histories(0), anyRunning(true) {}
+
+    void check(const ErrorTarget& target, const PhotonBatch& batch, bool running, MPI_Comm comm) {
+        // A rank with an empty shard never sized its tally
+        const std::vector<ScoreMoments>& local = batch.tally.depositMoments;
+        selected.clear();
+        target.forEachSelected(merged, [&](size_t i) {
+            selected.push_back(i < local.size() ? local[i] : ScoreMoments());
+        });
+        reduceMoments(selected, comm, true);
+        size_t k = 0;
+        target.forEachSelected(merged, [&](size_t i) { merged.depositMoments[i] = selected[k++]; });
+
+        uint64_t counts[2] = { batch.histories, running ? 1u : 0u };
+        MPI_Allreduce(MPI_IN_PLACE, counts, 2, MPI_UINT64_T, MPI_SUM, comm);
+        histories = counts[0];
+        anyRunning = counts[1] > 0;
+    }
+
+private:
+    std::vector<ScoreMoments> selected;
+};
+
+// Largest value of `seconds` over the ranks of comm, on rank 0
+inline double reduceMaxSeconds(double seconds, MPI_Comm comm) {
+    double slowest = seconds;
+    MPI_Reduce(&seconds, &slowest, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+    return slowest;
+}
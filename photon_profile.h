@@ -0,0 +1,182 @@
+// Scoped wall-clock timers for the hot paths. Compiled in only with
+// PHOTON_ENABLE_PROFILING; otherwise PHOTON_PROFILE_SCOPE expands to nothing
+// and PROFILING_ENABLED lets callers drop their reporting code at compile time.
+#pragma once
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+
+#ifdef PHOTON_ENABLE_PROFILING
+const bool PROFILING_ENABLED = true;
+#define PHOTON_PROFILE_CONCAT2(a, b) a##b
+#define PHOTON_PROFILE_CONCAT(a, b) PHOTON_PROFILE_CONCAT2(a, b)
+// Time the rest of the enclosing scope under `name` (a string literal)
+#define PHOTON_PROFILE_SCOPE(name) ScopedTimer PHOTON_PROFILE_CONCAT(scopedTimer, __LINE__)(name)
+#else
+const bool PROFILING_ENABLED = false;
+#define PHOTON_PROFILE_SCOPE(name) do {} while (0)
+#endif
+
+// One completed span, in microseconds since the profiler started
+struct TraceEvent {
+    const char* name;
+    double startUs;
+    double durationUs;
+};
+
+// Collects spans from every thread. Each thread appends to its own log, so
+// recording only takes that log's (uncontended) lock; the per-name averages
+// shown by the HUD sit behind one shared lock, which is fine for the coarse
+// scopes timed here (one per tick or per frame, not per photon).
+class Profiler {
+public:
+    static const size_t MAX_EVENTS_PER_THREAD = 1 << 20;  // Later spans only feed the averages
+    static const uint32_t GPU_THREAD = 0xFFFF;  // Trace lane for GPU timer queries
+
+    struct ThreadLog {
+        uint32_t thread;
+        std::mutex mutex;
+        std::vector<TraceEvent> events;
+    };
+
+    // Exponential moving average of one scope's duration
+    struct Section {
+        const char* name;
+        double lastUs;
+        double averageUs;
+        unsigned long long calls;
+    };
+
+    std::chrono::steady_clock::time_point epoch;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadLog>> logs;
+    std::vector<Section> sections;
+    std::atomic<unsigned long long> dropped;  // Spans not kept for the trace
+
+    Profiler() : epoch(std::chrono::steady_clock::now()), dropped(0) {}
+
+    static Profiler& instance() {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    double nowUs() const {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    // Threads are numbered in the order they first record; the GPU lane is fixed
+    ThreadLog& threadLog(bool gpu = false) {
+        thread_local ThreadLog* log = nullptr;
+        if (gpu)
+            return logFor(GPU_THREAD);
+        if (!log)
+            log = &logFor(NEXT_THREAD);
+        return *log;
+    }
+
+    void record(const char* name, double startUs, double durationUs, bool gpu = false) {
+        ThreadLog& log = threadLog(gpu);
+        {
+            std::lock_guard<std::mutex> lock(log.mutex);
+            if (log.events.size() < MAX_EVENTS_PER_THREAD)
+                log.events.push_back(TraceEvent{ name, startUs, durationUs });
+            else
+                dropped++;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        Section& section = sectionFor(name);
+        section.lastUs = durationUs;
+        section.averageUs = section.calls ? 0.9 * section.averageUs + 0.1 * durationUs : durationUs;
+        section.calls++;
+    }
+
+    // GPU durations arrive frames late; they are drawn on their own trace
+    // lane, ending at the time the result was read back
+    void recordGpu(const char* name, double durationUs) {
+        record(name, nowUs() - durationUs, durationUs, true);
+    }
+
+    // Smoothed duration in milliseconds, 0 if the scope never ran
+    double averageMs(const char* name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const Section& section : sections)
+            if (std::strcmp(section.name, name) == 0)
+                return section.averageUs / 1000.0;
+        return 0.0;
+    }
+
+    // Chrome trace-event JSON (chrome://tracing, Perfetto). Returns false if
+    // the file cannot be written.
+    bool writeChromeTrace(const std::string& path) {
+        std::ofstream file(path);
+        file << "{\"traceEvents\":[";
+        bool first = true;
+        std::lock_guard<std::mutex> logsLock(mutex);
+        for (const std::unique_ptr<ThreadLog>& log : logs) {
+            std::lock_guard<std::mutex> lock(log->mutex);
+            file << (first ? "" : ",") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << log->thread
+                 << ",\"args\":{\"name\":\"";
+            if (log->thread == GPU_THREAD)
+                file << "gpu";
+            else
+                file << "thread " << log->thread;
+            file << "\"}}";
+            first = false;
+            for (const TraceEvent& event : log->events) {
+                file << ",{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << log->thread
+                     << ",\"ts\":" << event.startUs << ",\"dur\":" << event.durationUs << "}";
+            }
+        }
+        file << "],\"displayTimeUnit\":\"ms\"}\n";
+        return (bool)file;
+    }
+
+private:
+    static const uint32_t NEXT_THREAD = 0xFFFFFFFF;
+
+    ThreadLog& logFor(uint32_t thread) {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint32_t next = 0;
+        for (const std::unique_ptr<ThreadLog>& log : logs) {
+            if (log->thread == thread)
+                return *log;
+            if (log->thread != GPU_THREAD)
+                next++;
+        }
+        logs.emplace_back(new ThreadLog());
+        logs.back()->thread = thread == NEXT_THREAD ? next : thread;
+        return *logs.back();
+    }
+
+    Section& sectionFor(const char* name) {
+        for (Section& section : sections)
+            if (section.name == name || std::strcmp(section.name, name) == 0)
+                return section;
+        sections.push_back(Section{ name, 0.0, 0.0, 0 });
+        return sections.back();
+    }
+};
+
+class ScopedTimer {
+public:
+    const char* name;
+    double startUs;
+
+    explicit ScopedTimer(const char* scopeName) : name(scopeName), startUs(Profiler::instance().nowUs()) {}
+
+    ~ScopedTimer() {
+        Profiler& profiler = Profiler::instance();
+        profiler.record(name, startUs, profiler.nowUs() - startUs);
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+};
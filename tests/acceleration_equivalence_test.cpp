@@ -0,0 +1,137 @@
+// Acceleration structures: the grid, BVH and lattice answer every point and
+// ray query exactly like the linear scan, on random rays and on the edge
+// cases (axis-aligned, starting inside a sphere, grazing, lying on a sphere's
+// bounding planes)
+#include "photon_engine.h"
+
+#include <random>
+
+int failures = 0;
+
+void check(bool condition, const char* what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+struct Ray {
+    float o[3];
+    float u[3];
+};
+
+Ray normalized(float ox, float oy, float oz, float ux, float uy, float uz) {
+    float length = std::sqrt(ux*ux + uy*uy + uz*uz);
+    return Ray{ { ox, oy, oz }, { ux / length, uy / length, uz / length } };
+}
+
+std::vector<Ray> testRays(const Scene& scene, std::mt19937& rng) {
+    const float halfSize = (GRID_SIZE * CELL_SIZE) / 2.0f;
+    std::uniform_real_distribution<float> inCube(-halfSize, halfSize);
+    std::normal_distribution<float> gaussian;
+    std::uniform_int_distribution<size_t> pickSphere(0, scene.count - 1);
+    const float axes[6][3] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+
+    std::vector<Ray> rays;
+    for (int i = 0; i < 4000; i++)
+        rays.push_back(normalized(inCube(rng), inCube(rng), inCube(rng), gaussian(rng), gaussian(rng), gaussian(rng)));
+    for (int i = 0; i < 500; i++) {
+        const float* axis = axes[i % 6];
+        rays.push_back(Ray{ { inCube(rng), inCube(rng), inCube(rng) }, { axis[0], axis[1], axis[2] } });
+    }
+
+    for (int i = 0; i < 300; i++) {
+        const SphereRecord& s = scene.records[pickSphere(rng)];
+        const float* axis = axes[i % 6];
+        // From the center, and through the center from outside along an axis
+        rays.push_back(normalized(s.x, s.y, s.z, gaussian(rng), gaussian(rng), gaussian(rng)));
+        rays.push_back(Ray{ { s.x - 0.3f * axis[0], s.y - 0.3f * axis[1], s.z - 0.3f * axis[2] },
+                            { axis[0], axis[1], axis[2] } });
+        // Axis-aligned rays on the planes of the sphere's bounding box: they
+        // graze the sphere and lie on the bounds of the BVH leaf holding it
+        int a = (i / 6) % 3, b = (a + 1) % 3;
+        float o[3] = { s.x, s.y, s.z };
+        o[a] -= 0.3f;
+        o[b] += (i % 2 ? s.radius : -s.radius);
+        float u[3] = { 0, 0, 0 };
+        u[a] = 1.0f;
+        rays.push_back(Ray{ { o[0], o[1], o[2] }, { u[0], u[1], u[2] } });
+        // Tangent rays just inside and just outside the surface
+        for (float offset : { 0.999f, 1.001f }) {
+            float p[3] = { s.x, s.y, s.z };
+            p[b] += offset * s.radius;
+            p[a] -= 0.2f;
+            float d[3] = { 0, 0, 0 };
+            d[a] = 1.0f;
+            d[(a + 2) % 3] = 0.01f * gaussian(rng);
+            rays.push_back(normalized(p[0], p[1], p[2], d[0], d[1], d[2]));
+        }
+    }
+    return rays;
+}
+
+// Point tests (step mode) and nearest hits (event mode) of one structure
+// against the linear scan over the same table
+template <AccelerationKind Kind>
+void compareWithLinear(const Scene& sceneFile, const char* sceneName, std::mt19937& rng) {
+    if (!SphereScene::supports(sceneFile, Kind))
+        return;
+    const float halfSize = (GRID_SIZE * CELL_SIZE) / 2.0f;
+    SphereScene scene(sceneFile, Kind);
+    const auto& accel = scene.structure<Kind>();
+    std::string label = std::string(sceneName) + " " + accelerationName(Kind);
+
+    int pointMismatches = 0, rayMismatches = 0, hits = 0;
+    for (const Ray& ray : testRays(sceneFile, rng)) {
+        if (accel.firstHit(scene.table, ray.o[0], ray.o[1], ray.o[2]) !=
+            firstSphereHitScalar(scene.table, ray.o[0], ray.o[1], ray.o[2]))
+            pointMismatches++;
+
+        if (std::fabs(ray.o[0]) > halfSize || std::fabs(ray.o[1]) > halfSize || std::fabs(ray.o[2]) > halfSize)
+            continue;
+        float tMax = rayCubeExitDistance(ray.o[0], ray.o[1], ray.o[2], ray.u[0], ray.u[1], ray.u[2], halfSize);
+        float tLinear = 0.0f, tAccel = 0.0f;
+        int linear = nearestSphereHit(scene.table, ray.o[0], ray.o[1], ray.o[2],
+                                      ray.u[0], ray.u[1], ray.u[2], tMax, tLinear);
+        int found = accel.nearestHit(scene.table, ray.o[0], ray.o[1], ray.o[2],
+                                     ray.u[0], ray.u[1], ray.u[2], tMax, tAccel);
+        if (found != linear || (linear >= 0 && tAccel != tLinear))
+            rayMismatches++;
+        hits += linear >= 0;
+    }
+    check(pointMismatches == 0, (label + ": step-mode point tests match the linear scan").c_str());
+    check(rayMismatches == 0, (label + ": event-mode nearest hits match the linear scan").c_str());
+    check(hits > 0, (label + ": the test rays hit some spheres").c_str());
+    if (pointMismatches || rayMismatches)
+        std::cerr << label << ": " << pointMismatches << " point and " << rayMismatches << " ray mismatches" << std::endl;
+}
+
+void compareAll(const Scene& scene, const char* name, std::mt19937& rng) {
+    compareWithLinear<ACCEL_GRID>(scene, name, rng);
+    compareWithLinear<ACCEL_BVH>(scene, name, rng);
+    compareWithLinear<ACCEL_LATTICE>(scene, name, rng);
+}
+
+int main() {
+    std::mt19937 rng(20240611);
+
+    Scene lattice(DEFAULT_DETECTOR_LATTICE);
+    compareAll(lattice, "lattice", rng);
+
+    // Overlapping spheres, so ties between spheres are exercised too
+    Scene clustered(createClusteredSpheres(8, 200, 99));
+    compareAll(clustered, "clustered", rng);
+
+    const float halfSize = (GRID_SIZE * CELL_SIZE) / 2.0f;
+    std::uniform_real_distribution<float> inCube(-0.9f * halfSize, 0.9f * halfSize);
+    std::uniform_real_distribution<float> radius(0.005f, 0.08f);
+    std::vector<SphereRecord> spheres;
+    for (int i = 0; i < 400; i++)
+        spheres.push_back(SphereRecord{ inCube(rng), inCube(rng), inCube(rng), radius(rng) });
+    Scene random(std::move(spheres));
+    compareAll(random, "random", rng);
+
+    if (failures == 0)
+        std::cout << "acceleration equivalence: all checks passed" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
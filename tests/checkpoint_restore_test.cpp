@@ -0,0 +1,69 @@
+// Checkpoint restores: a clean snapshot round-trips, and snapshots with a
+// damaged header are rejected without touching the batch they were loaded into
+#include "photon_engine.h"
+
+int failures = 0;
+
+void check(bool condition, const char* what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+// Header of a saved snapshot, edited and written back
+template <class Edit>
+std::vector<char> corrupted(const std::vector<char>& snapshot, Edit edit) {
+    std::vector<char> damaged = snapshot;
+    CheckpointHeader header;
+    std::memcpy(&header, damaged.data(), sizeof(header));
+    edit(header);
+    std::memcpy(damaged.data(), &header, sizeof(header));
+    return damaged;
+}
+
+int main() {
+    Scene sceneFile;
+    sceneFile.generate(DEFAULT_DETECTOR_LATTICE);
+    SphereScene scene(sceneFile, ACCEL_GRID, DEFAULT_ACCEL_GRID_RESOLUTION);
+    uint64_t hash = sceneFile.fingerprint();
+
+    PhotonBatch source(256, EVENT_DRIVEN, 10000);
+    for (int tick = 0; tick < 8; tick++)
+        source.update(scene);
+    std::vector<char> snapshot;
+    source.saveState(snapshot, hash);
+
+    PhotonBatch restored(64);
+    check(restored.restoreState(snapshot.data(), snapshot.size(), scene.table.count, hash), "clean snapshot restores");
+    check(restored.size() == source.size() && restored.ticks == source.ticks && restored.histories == source.histories &&
+          restored.mode == EVENT_DRIVEN && restored.x == source.x && restored.tally.sphereHits == source.tally.sphereHits,
+          "restored batch matches the saved one");
+
+    std::vector<std::vector<char>> damaged = {
+        corrupted(snapshot, [](CheckpointHeader& h) { h.mode = 7; }),
+        corrupted(snapshot, [](CheckpointHeader& h) { h.interactionModel = 9; }),
+        corrupted(snapshot, [](CheckpointHeader& h) { h.photons = 0; }),
+        corrupted(snapshot, [](CheckpointHeader& h) { h.photons += 1; }),
+        corrupted(snapshot, [](CheckpointHeader& h) { h.photons = ~0ull; }),
+        corrupted(snapshot, [](CheckpointHeader& h) { h.sphereCount += 1; }),
+        corrupted(snapshot, [](CheckpointHeader& h) { h.version = 0; }),
+    };
+    damaged.push_back(std::vector<char>(snapshot.begin(), snapshot.end() - CHECKPOINT_ALIGNMENT));
+
+    PhotonBatch live(64);
+    for (int tick = 0; tick < 4; tick++)
+        live.update(scene);
+    std::vector<float> liveX = live.x;
+    unsigned long long liveTicks = live.ticks;
+    for (const std::vector<char>& file : damaged) {
+        check(!live.restoreState(file.data(), file.size(), scene.table.count, hash), "damaged snapshot is rejected");
+        check(live.size() == 64 && live.x == liveX && live.ticks == liveTicks && live.mode == STEP_MARCHING,
+              "a rejected snapshot leaves the batch unchanged");
+    }
+    live.update(scene);  // Still runs with its own kernels
+
+    if (failures == 0)
+        std::cout << "checkpoint restore: all checks passed" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
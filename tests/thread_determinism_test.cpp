@@ -0,0 +1,86 @@
+// Determinism: with a fixed seed and photon budget the tally is the same on
+// one thread and on a pool, with and without regrouping, because every
+// random draw is keyed by photon ID and weights are summed in fixed point.
+// Only the floating-point moments depend on the order histories complete in
+// (regrouping moves photons between slots), so they match to rounding.
+#include "photon_engine.h"
+
+int failures = 0;
+
+void check(bool condition, const char* what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+const unsigned long long PHOTONS = 20000;
+
+struct Run {
+    unsigned long long histories;
+    Tally tally;
+};
+
+// Run the whole budget and return what it counted
+Run finalTally(const SphereScene& scene, PropagationMode mode, const InteractionSettings& interaction,
+               ThreadPool* pool, uint32_t regroupInterval) {
+    PhotonBatch photons(1024, mode, PHOTONS, 12345);
+    photons.interaction = interaction;
+    photons.regroupInterval = regroupInterval;
+    while (!photons.finished())
+        photons.update(scene, pool);
+    return Run{ photons.histories, photons.tally };
+}
+
+bool close(double a, double b) {
+    return std::fabs(a - b) <= 1e-9 * std::max(std::fabs(a), std::fabs(b));
+}
+
+bool sameMoments(const std::vector<ScoreMoments>& a, const std::vector<ScoreMoments>& b) {
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].count != b[i].count || !close(a[i].mean, b[i].mean) || !close(a[i].m2, b[i].m2))
+            return false;
+    }
+    return true;
+}
+
+int main() {
+    Scene sceneFile(DEFAULT_DETECTOR_LATTICE);
+    SphereScene scene(sceneFile, ACCEL_GRID);
+    ThreadPool pool(4);
+
+    InteractionSettings weighted = DEFAULT_INTERACTION;
+    weighted.model = INTERACT_LAMBERTIAN;
+    weighted.absorption = 0.3f;
+    weighted.rouletteWeight = 0.05f;
+    const InteractionSettings settings[] = { DEFAULT_INTERACTION, weighted };
+
+    for (PropagationMode mode : { STEP_MARCHING, EVENT_DRIVEN }) {
+        for (const InteractionSettings& interaction : settings) {
+            Run reference = finalTally(scene, mode, interaction, nullptr, 0);
+            check(reference.histories == PHOTONS, "the single-thread run finishes its budget");
+            for (uint32_t regroup : { 0u, 4u }) {
+                for (ThreadPool* threads : { (ThreadPool*)nullptr, &pool }) {
+                    Run run = finalTally(scene, mode, interaction, threads, regroup);
+                    std::string label = std::string(mode == EVENT_DRIVEN ? "event" : "step") + " " +
+                                        interactionName(interaction.model) + (threads ? ", 5 threads" : ", 1 thread") +
+                                        (regroup ? ", regroup" : "") + ": ";
+                    const Tally& tally = run.tally;
+                    check(run.histories == reference.histories, (label + "same histories").c_str());
+                    check(tally.sphereHits == reference.tally.sphereHits, (label + "same sphere hits").c_str());
+                    check(tally.sphereDeposit == reference.tally.sphereDeposit, (label + "same deposits").c_str());
+                    check(tally.faceExits == reference.tally.faceExits, (label + "same face exits").c_str());
+                    check(tally.escapedWeight == reference.tally.escapedWeight, (label + "same escaped weight").c_str());
+                    check(tally.pathLength == reference.tally.pathLength, (label + "same path lengths").c_str());
+                    check(sameMoments(tally.depositMoments, reference.tally.depositMoments), (label + "same moments").c_str());
+                }
+            }
+        }
+    }
+
+    if (failures == 0)
+        std::cout << "thread determinism: all checks passed" << std::endl;
+    return failures == 0 ? 0 : 1;
+}